@@ -0,0 +1,545 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Stripe layout autotuner
+ *
+ * With -DAUTOTUNE the daemon doesn't serve cheedon0. Instead it runs every
+ * workload class against the configured backends for AUTOTUNE_SEC, over
+ * each candidate layout: the first 1 to NUM_DEVICE devices striped in
+ * AUTOTUNE_STRIPES units. This is what fio.sh measures, without reloading
+ * the module or rebuilding the daemon for every point.
+ *
+ * Classes are synthetic, plus the trace at AUTOTUNE_TRACE when there is
+ * one, replayed as fast as AUTOTUNE_QD threads go. Requests hit a scratch
+ * region of AUTOTUNE_MB at the end of every backend. Its contents are read
+ * beforehand and put back at the end, so the daemon must not be serving
+ * the array meanwhile. The copy also goes to AUTOTUNE_SCRATCH_PATH and is
+ * synced before the first write; a run that died without putting the
+ * region back restores it from there on the next start.
+ *
+ * The best layout of every class is printed, and saved to AUTOTUNE_PATH
+ * with -DAUTOTUNE_SAVE.
+ */
+
+#ifdef AUTOTUNE
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "user.h"
+
+#define SCRATCH_SIZE	(AUTOTUNE_MB * 1024ULL * 1024)
+#define SCRATCH_MAGIC	0x4843524353454843ULL	// "CHESCRCH"
+
+// Followed by the scratch region of every device
+struct scratch_hdr {
+	uint64_t magic;
+	uint32_t nr_devs;
+	uint32_t mb;
+	uint64_t off;
+};
+
+struct workload {
+	const char *name;
+	unsigned int pages;	// per request, 0 for the trace
+	unsigned int write_pct;
+	bool random;
+};
+
+static const struct workload classes[] = {
+	{ "seq-read",	256,	0,	false },
+	{ "seq-write",	256,	100,	false },
+	{ "rand-read",	1,	0,	true },
+	{ "rand-write",	1,	100,	true },
+	{ "mixed",	4,	30,	true },
+	{ "trace",	0,	0,	false },
+};
+
+#define NR_CLASSES	(sizeof(classes) / sizeof(classes[0]))
+
+static const unsigned int stripes[] = { AUTOTUNE_STRIPES };
+
+#define NR_STRIPES	(int)(sizeof(stripes) / sizeof(stripes[0]))
+#define NR_CANDIDATES	(NUM_DEVICE * NR_STRIPES)
+
+struct worker {
+	pthread_t thread;
+	uint64_t rand;
+	char *buf;
+	uint64_t ios, bytes, errors;
+};
+
+static int fds[NUM_DEVICE];
+static off_t scratch_off;
+
+// The point being measured
+static const struct workload *cur;
+static unsigned int cur_ndev;
+static uint64_t cur_stripe;	// bytes
+static uint64_t vol_pages;
+static uint64_t cursor;
+static volatile bool done;
+
+static const struct record_ent *trace;
+static uint64_t nr_trace;
+
+static volatile sig_atomic_t interrupted;
+
+static void interrupt_handler(int sig)
+{
+	interrupted = 1;
+}
+
+static inline uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void next_req(struct worker *w, int *op, uint64_t *pos, unsigned int *nr)
+{
+	const struct record_ent *e;
+	uint64_t n;
+
+	if (!cur->pages) {
+		// Discards and anything else don't say much about the layout
+		do {
+			e = trace + __atomic_fetch_add(&cursor, 1, __ATOMIC_RELAXED) % nr_trace;
+		} while ((e->op != REQ_OP_READ && e->op != REQ_OP_WRITE) || !e->pages);
+
+		*op = e->op;
+		*nr = e->pages < MAX_REQ_PAGES ? e->pages : MAX_REQ_PAGES;
+		*pos = e->pos % (vol_pages - *nr + 1);
+		return;
+	}
+
+	*op = xorshift(&w->rand) % 100 < cur->write_pct ? REQ_OP_WRITE : REQ_OP_READ;
+	*nr = cur->pages;
+	n = vol_pages / cur->pages;
+	if (cur->random)
+		*pos = xorshift(&w->rand) % n * cur->pages;
+	else
+		*pos = __atomic_fetch_add(&cursor, 1, __ATOMIC_RELAXED) % n * cur->pages;
+}
+
+// Same arithmetic as map_page(), over the candidate layout
+static void do_io(struct worker *w, int op, uint64_t pos, unsigned int nr)
+{
+	uint64_t addr = pos * PAGE_SIZE, end = addr + (uint64_t)nr * PAGE_SIZE;
+	uint64_t stripe, len;
+	char *buf = w->buf;
+	ssize_t ret;
+	off_t off;
+	int dev;
+
+	for (; addr < end; addr += len, buf += len) {
+		stripe = addr / cur_stripe;
+		dev = stripe % cur_ndev;
+		off = scratch_off + (stripe / cur_ndev) * cur_stripe + addr % cur_stripe;
+		len = cur_stripe - addr % cur_stripe;
+		if (len > end - addr)
+			len = end - addr;
+
+		if (op == REQ_OP_WRITE)
+			ret = pwrite(fds[dev], buf, len, off);
+		else
+			ret = pread(fds[dev], buf, len, off);
+		if (ret != (ssize_t)len)
+			w->errors++;
+	}
+
+	w->ios++;
+	w->bytes += (uint64_t)nr * PAGE_SIZE;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int nr;
+	uint64_t pos;
+	int op;
+
+	while (!done) {
+		next_req(w, &op, &pos, &nr);
+		do_io(w, op, pos, nr);
+	}
+
+	return NULL;
+}
+
+// MB/s of the current point
+static double measure(struct worker *workers)
+{
+	struct timespec start, end, tick = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+	uint64_t bytes = 0, errors = 0;
+	double sec;
+	int i;
+
+	done = false;
+	cursor = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < AUTOTUNE_QD; i++) {
+		workers[i].ios = workers[i].bytes = workers[i].errors = 0;
+		if (pthread_create(&workers[i].thread, NULL, worker_main, workers + i)) {
+			perror("autotune: failed to start a worker");
+			exit(1);
+		}
+	}
+
+	do {
+		nanosleep(&tick, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+	} while (!interrupted && end.tv_sec - start.tv_sec < AUTOTUNE_SEC);
+
+	done = true;
+	for (i = 0; i < AUTOTUNE_QD; i++) {
+		pthread_join(workers[i].thread, NULL);
+		bytes += workers[i].bytes;
+		errors += workers[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (errors)
+		fprintf(stderr, "autotune: %lu I/O errors\n", errors);
+
+	sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	return sec > 0 ? bytes / sec / 1e6 : 0;
+}
+
+static int load_trace(const char *path)
+{
+	const struct record_hdr *hdr;
+	struct stat sb;
+	uint64_t i;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &sb) || sb.st_size <= (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = map;
+	if (memcmp(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != RECORD_VERSION) {
+		fprintf(stderr, "autotune: %s is not a cheedon trace\n", path);
+		munmap(map, sb.st_size);
+		return -EINVAL;
+	}
+
+	trace = (const struct record_ent *)(hdr + 1);
+	nr_trace = (sb.st_size - sizeof(*hdr)) / sizeof(*trace);
+	for (i = 0; i < nr_trace; i++) {
+		if ((trace[i].op == REQ_OP_READ || trace[i].op == REQ_OP_WRITE) && trace[i].pages) {
+			printf("autotune: %lu requests from %s\n", nr_trace, path);
+			return 0;
+		}
+	}
+	nr_trace = 0;	// nothing to replay
+
+	return -EINVAL;
+}
+
+// Saves or restores the scratch region of every device
+static int scratch_copy(char **save, bool restore)
+{
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (restore)
+			ret = pwrite(fds[i], save[i], SCRATCH_SIZE, scratch_off);
+		else
+			ret = pread(fds[i], save[i], SCRATCH_SIZE, scratch_off);
+		if (ret != (ssize_t)SCRATCH_SIZE) {
+			fprintf(stderr, "autotune: failed to %s the scratch region of device %d\n",
+				restore ? "restore" : "save", i);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+// The copy on disk is what a crash leaves to restore from
+static int scratch_persist(const char *path, char **save)
+{
+	struct scratch_hdr h = {
+		.magic = SCRATCH_MAGIC,
+		.nr_devs = NUM_DEVICE,
+		.mb = AUTOTUNE_MB,
+		.off = scratch_off,
+	};
+	char *dir;
+	int fd, i;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror(path);
+		return -errno;
+	}
+	if (write(fd, &h, sizeof(h)) != sizeof(h))
+		goto err;
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (write(fd, save[i], SCRATCH_SIZE) != (ssize_t)SCRATCH_SIZE)
+			goto err;
+	}
+	if (fsync(fd))
+		goto err;
+	close(fd);
+
+	// And the name of it
+	dir = strdup(path);
+	if (!dir)
+		return -ENOMEM;
+	fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+
+	return 0;
+
+err:
+	perror(path);
+	close(fd);
+	unlink(path);
+	return -EIO;
+}
+
+// Puts back what a run that didn't finish left on the devices
+static int scratch_recover(const char *path, char *buf)
+{
+	struct scratch_hdr h;
+	int fd, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != SCRATCH_MAGIC ||
+	    h.nr_devs != NUM_DEVICE || h.mb != AUTOTUNE_MB) {
+		fprintf(stderr, "autotune: %s is from another setup, restore it by hand\n", path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	printf("autotune: restoring the scratch regions left at %s\n", humanSize(h.off));
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (read(fd, buf, SCRATCH_SIZE) != (ssize_t)SCRATCH_SIZE ||
+		    pwrite(fds[i], buf, SCRATCH_SIZE, h.off) != (ssize_t)SCRATCH_SIZE) {
+			fprintf(stderr, "autotune: failed to restore device %d from %s\n", i, path);
+			close(fd);
+			return -EIO;
+		}
+		fsync(fds[i]);
+	}
+	close(fd);
+	unlink(path);
+
+	return 0;
+}
+
+#ifdef AUTOTUNE_SAVE
+static int save_results(const char *path, const int *best, double (*mbps)[NR_CANDIDATES])
+{
+	unsigned int c;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		return -errno;
+	}
+
+	fprintf(fp, "CHEEDTUNE %d %d\n", NUM_DEVICE, AUTOTUNE_MB);
+	for (c = 0; c < NR_CLASSES; c++) {
+		if (best[c] < 0)
+			continue;
+		fprintf(fp, "%s %d %u %.1f\n", classes[c].name,
+			best[c] / NR_STRIPES + 1, stripes[best[c] % NR_STRIPES], mbps[c][best[c]]);
+	}
+
+	if (fflush(fp) || fsync(fileno(fp))) {
+		perror(path);
+		fclose(fp);
+		return -EIO;
+	}
+	fclose(fp);
+
+	return 0;
+}
+#endif
+
+int autotune(const int *devfds, const uint64_t *lens)
+{
+	static double mbps[NR_CLASSES][NR_CANDIDATES];
+	struct worker workers[AUTOTUNE_QD];
+	char *save[NUM_DEVICE] = { NULL };
+	int best[NR_CLASSES];
+	struct sigaction sa;
+	uint64_t min = UINT64_MAX;
+	unsigned int c, k;
+	char path[64];
+	int i, ret = 0;
+
+	memset(workers, 0, sizeof(workers));
+
+	for (k = 0; k < NR_STRIPES; k++) {
+		if (!stripes[k] || stripes[k] % (PAGE_SIZE / 1024) ||
+		    stripes[k] * 1024ULL > SCRATCH_SIZE) {
+			fprintf(stderr, "autotune: bad stripe size %uK\n", stripes[k]);
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (lens[i] < min)
+			min = lens[i];
+	}
+	if (min < SCRATCH_SIZE) {
+		fprintf(stderr, "autotune: backends are smaller than AUTOTUNE_MB\n");
+		return -ENOSPC;
+	}
+	scratch_off = (min - SCRATCH_SIZE) & ~(off_t)(1024 * 1024 - 1);
+
+	// Measure the devices, not the page cache
+	for (i = 0; i < NUM_DEVICE; i++) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", devfds[i]);
+		fds[i] = open(path, O_RDWR | O_DIRECT);
+		if (fds[i] < 0)
+			fds[i] = devfds[i];
+	}
+
+	if (load_trace(AUTOTUNE_TRACE))
+		printf("autotune: no trace at %s, synthetic workloads only\n", AUTOTUNE_TRACE);
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		save[i] = aligned_alloc(PAGE_SIZE, SCRATCH_SIZE);
+		if (!save[i]) {
+			fprintf(stderr, "autotune: out of memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	for (i = 0; i < AUTOTUNE_QD; i++) {
+		workers[i].rand = 0x9e3779b97f4a7c15ULL * (i + 1);
+		workers[i].buf = aligned_alloc(PAGE_SIZE, MAX_REQ_SIZE);
+		if (!workers[i].buf) {
+			fprintf(stderr, "autotune: out of memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+		memset(workers[i].buf, 0x5a + i, MAX_REQ_SIZE);
+	}
+
+	ret = scratch_recover(AUTOTUNE_SCRATCH_PATH, save[0]);
+	if (ret)
+		goto out;
+	ret = scratch_copy(save, false);
+	if (ret)
+		goto out;
+	ret = scratch_persist(AUTOTUNE_SCRATCH_PATH, save);
+	if (ret)
+		goto out;
+
+	// Stop early but still put the scratch region back
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = interrupt_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("autotune: %d MiB of scratch at %s on every device, %d s per point\n",
+	       AUTOTUNE_MB, humanSize(scratch_off), AUTOTUNE_SEC);
+
+	printf("%-12s", "layout");
+	for (c = 0; c < NR_CLASSES; c++) {
+		if (classes[c].pages || nr_trace)
+			printf(" %10s", classes[c].name);
+	}
+	printf("    (MB/s)\n");
+
+	for (k = 0; k < NR_CANDIDATES && !interrupted; k++) {
+		cur_ndev = k / NR_STRIPES + 1;
+		cur_stripe = stripes[k % NR_STRIPES] * 1024ULL;
+		vol_pages = SCRATCH_SIZE / cur_stripe * cur_stripe * cur_ndev / PAGE_SIZE;
+
+		printf("%u x %4uK  ", cur_ndev, stripes[k % NR_STRIPES]);
+		for (c = 0; c < NR_CLASSES && !interrupted; c++) {
+			cur = classes + c;
+			if (!cur->pages && !nr_trace)
+				continue;
+			mbps[c][k] = measure(workers);
+			printf(" %10.1f", mbps[c][k]);
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	for (c = 0; c < NR_CLASSES; c++) {
+		best[c] = -1;
+		for (k = 0; k < NR_CANDIDATES; k++) {
+			if (mbps[c][k] > 0 && (best[c] < 0 || mbps[c][k] > mbps[c][best[c]]))
+				best[c] = k;
+		}
+		if (best[c] < 0)
+			continue;
+		printf("autotune: %-10s best with %d devices of %uK stripes, %.1f MB/s\n",
+		       classes[c].name, best[c] / NR_STRIPES + 1,
+		       stripes[best[c] % NR_STRIPES], mbps[c][best[c]]);
+	}
+
+	ret = scratch_copy(save, true);
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (fsync(fds[i]))
+			ret = -EIO;
+	}
+	// Left for the next start to retry otherwise
+	if (!ret)
+		unlink(AUTOTUNE_SCRATCH_PATH);
+
+#ifdef AUTOTUNE_SAVE
+	if (!ret && !interrupted)
+		ret = save_results(AUTOTUNE_PATH, best, mbps);
+#endif
+
+out:
+	for (i = 0; i < NUM_DEVICE; i++) {
+		free(save[i]);
+		if (fds[i] != devfds[i])
+			close(fds[i]);
+	}
+	for (i = 0; i < AUTOTUNE_QD; i++)
+		free(workers[i].buf);
+
+	return ret;
+}
+
+#endif
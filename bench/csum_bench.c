@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Checksum microbenchmark
+ *
+ * Runs every checksum variant the CPU supports on one core, over pages
+ * that stay in the cache and over a buffer well past it, and checks that
+ * the variants of an algorithm agree.
+ *
+ * gcc -O3 -Wall -DCSUM -I. bench/csum_bench.c csum.c meta.c
+ * gcc -O3 -Wall -DCSUM -DCSUM_XXH3 -I. bench/csum_bench.c csum.c meta.c -lxxhash
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "user.h"
+
+#define BENCH_HOT_PAGES		64		// 256K, within L2
+#define BENCH_COLD_PAGES	(64 * 1024)	// 256M
+#define BENCH_BYTES		(4ULL * 1024 * 1024 * 1024)
+
+const char *humanSize(uint64_t bytes)
+{
+	static char output[200];
+
+	char *suffix[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	char length = sizeof(suffix) / sizeof(suffix[0]);
+
+	int i = 0;
+	double dblBytes = bytes;
+	if (bytes > 1024) {
+		for (i = 0; (bytes / 1024) > 0 && i < length - 1;
+		     i++, bytes /= 1024)
+			dblBytes = bytes / 1024.0;
+	}
+
+	sprintf(output, "%.02lf %s", dblBytes, suffix[i]);
+
+	return output;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000L + ts.tv_nsec;
+}
+
+// GB/s over BENCH_BYTES, cycling through nr pages
+static double bench(const struct csum_impl *impl, const char *pages, unsigned int nr)
+{
+	uint64_t start, ns, i, n = BENCH_BYTES / PAGE_SIZE;
+	uint32_t sum = 0;
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		sum += impl->page(pages + (i % nr) * PAGE_SIZE);
+	ns = now_ns() - start;
+
+	// Keeps the loop from being optimized out
+	if (sum == 0x12345678)
+		printf(" ");
+
+	return (double)BENCH_BYTES / ns;
+}
+
+int main()
+{
+	const struct csum_impl *impl, *best, *ref;
+	uint64_t *p, seed = 1;
+	char *pages;
+	unsigned int i, bad = 0;
+
+	pages = aligned_alloc(PAGE_SIZE, (uint64_t)BENCH_COLD_PAGES * PAGE_SIZE);
+	if (!pages) {
+		perror("Failed to allocate pages");
+		return 1;
+	}
+	p = (uint64_t *)pages;
+	for (i = 0; i < BENCH_COLD_PAGES * (PAGE_SIZE / 8); i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		p[i] = seed;
+	}
+
+	best = csum_setup();
+	printf("daemon uses %s\n", best->name);
+	for (ref = csum_impls; ref[1].name; ref++)
+		;
+
+	for (impl = csum_impls; impl->name; impl++) {
+		if (!impl->usable()) {
+			printf("%-16s unsupported\n", impl->name);
+			continue;
+		}
+
+		// The portable variant goes last, the others have to match it
+		for (i = 0; impl != ref && i < BENCH_COLD_PAGES; i += 97) {
+			if (impl->page(pages + (uint64_t)i * PAGE_SIZE) !=
+			    ref->page(pages + (uint64_t)i * PAGE_SIZE))
+				bad++;
+		}
+
+		printf("%-16s %6.2f GB/s in cache, %6.2f GB/s from memory\n", impl->name,
+		       bench(impl, pages, BENCH_HOT_PAGES), bench(impl, pages, BENCH_COLD_PAGES));
+	}
+
+	free(pages);
+
+	if (bad) {
+		fprintf(stderr, "%u pages summed differently\n", bad);
+		return 1;
+	}
+
+	return 0;
+}
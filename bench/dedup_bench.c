@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Dedup path microbenchmark
+ *
+ * Runs dedup_write() on synthetic pages with the backends in memory, so
+ * only hashing, index lookups, hit verification and map updates are
+ * measured.
+ *
+ * gcc -O3 -Wall -DDEDUP -I. bench/dedup_bench.c dedup.c meta.c -lxxhash
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <xxhash.h>
+
+#include "user.h"
+
+#define BENCH_DISKSIZE	(4ULL * 1024 * 1024 * 1024)
+#define BENCH_PAGES	(256 * 1024)
+#define BENCH_REQ_PAGES	64
+#define BENCH_PHYS	(2ULL * BENCH_PAGES * PAGE_SIZE)
+#define BENCH_MAP	"/tmp/cheedon_bench.dmap"
+
+static char *backend;
+
+const char *humanSize(uint64_t bytes)
+{
+	static char output[200];
+
+	char *suffix[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	char length = sizeof(suffix) / sizeof(suffix[0]);
+
+	int i = 0;
+	double dblBytes = bytes;
+	if (bytes > 1024) {
+		for (i = 0; (bytes / 1024) > 0 && i < length - 1;
+		     i++, bytes /= 1024)
+			dblBytes = bytes / 1024.0;
+	}
+
+	sprintf(output, "%.02lf %s", dblBytes, suffix[i]);
+
+	return output;
+}
+
+// Hits are read back, so the backends keep what was written
+void phys_read(uint64_t ppn, char *buf, unsigned int nr)
+{
+	memcpy(buf, backend + ppn * PAGE_SIZE, (size_t)nr * PAGE_SIZE);
+}
+
+void phys_write(uint64_t ppn, const char *buf, unsigned int nr)
+{
+	memcpy(backend + ppn * PAGE_SIZE, buf, (size_t)nr * PAGE_SIZE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000L + ts.tv_nsec;
+}
+
+// dup_pct of the pages repeat one of 1024 templates, the rest are unique
+static void fill(char *buf, int dup_pct, uint64_t *seed)
+{
+	uint64_t *p = (uint64_t *)buf;
+	int i;
+
+	*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	if ((int)(*seed >> 33) % 100 < dup_pct) {
+		memset(buf, 0, PAGE_SIZE);
+		p[0] = (*seed >> 20) % 1024 + 1;
+		return;
+	}
+
+	for (i = 0; i < PAGE_SIZE / 8; i++) {
+		*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		p[i] = *seed;
+	}
+}
+
+static void bench_hash(char *pages)
+{
+	uint64_t start, ns, sum = 0;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_PAGES; i++)
+		sum += XXH3_128bits(pages + (uint64_t)i * PAGE_SIZE, PAGE_SIZE).low64;
+	ns = now_ns() - start;
+
+	printf("xxh3-128: %.2f GB/s, %.1f ns/page (%lx)\n",
+	       (double)BENCH_PAGES * PAGE_SIZE / ns, (double)ns / BENCH_PAGES,
+	       sum & 0xf);
+}
+
+static void bench_write(char *pages, int dup_pct)
+{
+	uint64_t start, ns, lpn, seed = dup_pct;
+	int i;
+
+	for (i = 0; i < BENCH_PAGES; i++)
+		fill(pages + (uint64_t)i * PAGE_SIZE, dup_pct, &seed);
+
+	unlink(BENCH_MAP);
+	unlink(DEDUP_INDEX_PATH);
+	if (dedup_init(BENCH_MAP, BENCH_DISKSIZE, BENCH_PHYS)) {
+		fprintf(stderr, "dedup_init() failed\n");
+		exit(1);
+	}
+
+	// Requests land all over the volume, as after a while of random writes
+	start = now_ns();
+	for (i = 0; i < BENCH_PAGES; i += BENCH_REQ_PAGES) {
+		lpn = (uint64_t)i * 7919 % (BENCH_DISKSIZE / PAGE_SIZE - BENCH_REQ_PAGES);
+		dedup_write(lpn, pages + (uint64_t)i * PAGE_SIZE, BENCH_REQ_PAGES);
+	}
+	ns = now_ns() - start;
+
+	printf("\n%d%% duplicates: %.2f GB/s, %.1f ns/page\n", dup_pct,
+	       (double)BENCH_PAGES * PAGE_SIZE / ns, (double)ns / BENCH_PAGES);
+	dedup_stats();
+
+	dedup_exit();
+	unlink(BENCH_MAP);
+	unlink(DEDUP_INDEX_PATH);
+}
+
+int main()
+{
+	static const int dup_pct[] = { 0, 25, 50, 90 };
+	char *pages;
+	uint64_t seed = 1;
+	unsigned int i;
+
+	pages = aligned_alloc(PAGE_SIZE, (uint64_t)BENCH_PAGES * PAGE_SIZE);
+	if (!pages) {
+		perror("Failed to allocate pages");
+		return 1;
+	}
+	// Only the pages written get allocated
+	backend = mmap(NULL, BENCH_PHYS, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (backend == MAP_FAILED) {
+		perror("Failed to map the backend");
+		return 1;
+	}
+
+	for (i = 0; i < BENCH_PAGES; i++)
+		fill(pages + (uint64_t)i * PAGE_SIZE, 0, &seed);
+	bench_hash(pages);
+
+	for (i = 0; i < sizeof(dup_pct) / sizeof(dup_pct[0]); i++)
+		bench_write(pages, dup_pct[i]);
+
+	munmap(backend, BENCH_PHYS);
+	free(pages);
+
+	return 0;
+}
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Request handoff microbenchmark
+ *
+ * Builds queue.c against the kernel shim in bench/shim. Producer threads
+ * play blk.c's do_request() and consumer threads play the daemon reading
+ * and acking through chr.c, so the push/peek/pop path can be measured and
+ * compared against other queue designs without loading the module.
+ *
+ * gcc -O2 -Wall -Wno-address-of-packed-member -pthread -D__KERNEL__ \
+ *     -Ibench/shim -I. bench/queue_bench.c queue.c
+ */
+
+#include "kshim.h"
+
+#include "cheedon.h"
+
+#define BENCH_REQS	(1 << 20)
+#define HIST_BUCKETS	(4 * 40)
+
+struct producer {
+	pthread_t thread;
+	unsigned int nr;
+	uint32_t hist[HIST_BUCKETS];
+};
+
+static struct request stop_rq;
+// Stands in for the daemon's chardev file
+static char daemon_file;
+#define DAEMON ((struct file *)&daemon_file)
+
+// chr.c isn't built, no io_uring fetch waits for a request
+void cheedon_chr_kick(void)
+{
+}
+
+// Quarter octaves of nanoseconds
+static unsigned int hist_bucket(uint64_t ns)
+{
+	unsigned int e, m;
+
+	if (!ns)
+		return 0;
+	e = 63 - __builtin_clzll(ns);
+	m = e >= 2 ? (ns >> (e - 2)) & 3 : (ns << (2 - e)) & 3;
+
+	return e * 4 + m < HIST_BUCKETS ? e * 4 + m : HIST_BUCKETS - 1;
+}
+
+static double hist_us(const uint32_t *hist, uint64_t total, unsigned int permille)
+{
+	uint64_t sum = 0;
+	unsigned int b;
+
+	for (b = 0; b < HIST_BUCKETS - 1; b++) {
+		sum += hist[b];
+		if (sum * 1000 >= total * permille)
+			break;
+	}
+
+	return ((4ULL + b % 4 + 1) << (b / 4)) / 4 / 1000.0;
+}
+
+// As blk.c's do_request(), minus the data copy
+static void submit(struct request *rq)
+{
+	int id = cheedon_push(rq);
+
+	wait_for_completion(&reqs[id].acked);
+	cheedon_pop(id);
+}
+
+static void *producer_fn(void *arg)
+{
+	struct producer *p = arg;
+	struct request rq = { 0 };
+	uint64_t start;
+	unsigned int i;
+
+	for (i = 0; i < p->nr; i++) {
+		// A mix of classes, so the class lists get exercised too
+		rq.cmd_flags = i % 4 ? REQ_OP_READ : REQ_OP_WRITE;
+		rq.sector = (uint64_t)i * 8;
+		rq.bytes = PAGE_SIZE;
+
+		start = ktime_get_ns();
+		submit(&rq);
+		p->hist[hist_bucket(ktime_get_ns() - start)]++;
+	}
+
+	return NULL;
+}
+
+// As the daemon's read() and ack write() on the chardev
+static void *consumer_fn(void *arg)
+{
+	struct cheedon_req *req;
+	bool last;
+
+	do {
+		req = cheedon_peek(DAEMON);
+		last = req->rq == &stop_rq;
+		cheedon_ack(req, DAEMON);
+		complete(&req->acked);
+	} while (!last);
+
+	return NULL;
+}
+
+static void run(unsigned int nr_prod, unsigned int nr_cons)
+{
+	static uint32_t hist[HIST_BUCKETS];
+	struct producer *prod;
+	pthread_t *cons;
+	uint64_t start, ns, total = 0;
+	unsigned int i, b;
+
+	prod = calloc(nr_prod, sizeof(*prod));
+	cons = calloc(nr_cons, sizeof(*cons));
+	memset(hist, 0, sizeof(hist));
+
+	cheedon_queue_init();
+	for (i = 0; i < nr_cons; i++)
+		pthread_create(cons + i, NULL, consumer_fn, NULL);
+
+	start = ktime_get_ns();
+	for (i = 0; i < nr_prod; i++) {
+		prod[i].nr = BENCH_REQS / nr_prod;
+		total += prod[i].nr;
+		pthread_create(&prod[i].thread, NULL, producer_fn, prod + i);
+	}
+	for (i = 0; i < nr_prod; i++) {
+		pthread_join(prod[i].thread, NULL);
+		for (b = 0; b < HIST_BUCKETS; b++)
+			hist[b] += prod[i].hist[b];
+	}
+	ns = ktime_get_ns() - start;
+
+	stop_rq.cmd_flags = REQ_OP_READ;
+	for (i = 0; i < nr_cons; i++)
+		submit(&stop_rq);
+	for (i = 0; i < nr_cons; i++)
+		pthread_join(cons[i], NULL);
+	cheedon_queue_exit();
+
+	printf("%2u producers, %2u consumers: %6.2f M req/s, round trip p50 %.2f us, p99 %.2f us\n",
+	       nr_prod, nr_cons, (double)total / ns * 1000,
+	       hist_us(hist, total, 500), hist_us(hist, total, 990));
+
+	free(prod);
+	free(cons);
+}
+
+int main()
+{
+	static const unsigned int nr_prod[] = { 1, 4, 16, 64 };
+	static const unsigned int nr_cons[] = { 1, 2, 4 };
+	unsigned int i, j;
+
+	reqs = kzalloc(sizeof(struct cheedon_req) * CHEEDON_NR_REQS, GFP_KERNEL);
+	if (!reqs) {
+		perror("Failed to allocate requests");
+		return 1;
+	}
+	for (i = 0; i < CHEEDON_NR_REQS; i++)
+		init_completion(&reqs[i].acked);
+
+	for (i = 0; i < sizeof(nr_prod) / sizeof(nr_prod[0]); i++) {
+		for (j = 0; j < sizeof(nr_cons) / sizeof(nr_cons[0]); j++)
+			run(nr_prod[i], nr_cons[j]);
+	}
+
+	free(reqs);
+
+	return 0;
+}
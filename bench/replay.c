@@ -0,0 +1,314 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Request trace replay
+ *
+ * Issues a trace taken with -DRECORD against a block device or file, e.g.
+ * /dev/cheedon0 in front of another daemon config, at the recorded pace
+ * or faster. Written data is filler, the trace keeps no contents.
+ *
+ * gcc -O2 -Wall -I. bench/replay.c -luring
+ * ./a.out cheedon.rec /dev/cheedon0 [speed]
+ *
+ * speed 1 keeps the recorded timing, 4 replays four times as fast and 0
+ * issues as fast as REPLAY_QD requests in flight allow.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <liburing.h>
+
+#include "user.h"
+
+#ifndef REPLAY_QD
+#define REPLAY_QD 32
+#endif
+#define HIST_BUCKETS (4 * 32)
+
+struct slot {
+	char *buf;
+	uint64_t start_ns;
+	int op;
+	bool busy;
+};
+
+static struct slot slots[REPLAY_QD];
+static unsigned int nr_inflight;
+static struct io_uring ring;
+
+static struct {
+	uint64_t ios, bytes, errors;
+	uint32_t hist[HIST_BUCKETS];
+} st[4];			// read, write, discard, flush
+static uint64_t skipped, late_ns;
+
+const char *humanSize(uint64_t bytes)
+{
+	static char output[200];
+
+	char *suffix[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	char length = sizeof(suffix) / sizeof(suffix[0]);
+
+	int i = 0;
+	double dblBytes = bytes;
+	if (bytes > 1024) {
+		for (i = 0; (bytes / 1024) > 0 && i < length - 1;
+		     i++, bytes /= 1024)
+			dblBytes = bytes / 1024.0;
+	}
+
+	sprintf(output, "%.02lf %s", dblBytes, suffix[i]);
+
+	return output;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000L + ts.tv_nsec;
+}
+
+// Quarter octaves of microseconds, as in sched.c
+static unsigned int hist_bucket(uint64_t us)
+{
+	unsigned int e, m;
+
+	if (!us)
+		return 0;
+	e = 63 - __builtin_clzll(us);
+	m = e >= 2 ? (us >> (e - 2)) & 3 : (us << (2 - e)) & 3;
+
+	return e * 4 + m < HIST_BUCKETS ? e * 4 + m : HIST_BUCKETS - 1;
+}
+
+static double hist_ms(const uint32_t *hist, uint64_t total, unsigned int permille)
+{
+	uint64_t sum = 0;
+	unsigned int b;
+
+	for (b = 0; b < HIST_BUCKETS - 1; b++) {
+		sum += hist[b];
+		if (sum * 1000 >= total * permille)
+			break;
+	}
+
+	return ((4ULL + b % 4 + 1) << (b / 4)) / 4 / 1000.0;
+}
+
+static int op_index(int op)
+{
+	switch (op) {
+	case REQ_OP_READ:
+		return 0;
+	case REQ_OP_WRITE:
+		return 1;
+	case REQ_OP_DISCARD:
+		return 2;
+	case REQ_OP_FLUSH:
+		return 3;
+	}
+
+	return -1;
+}
+
+static void reap(struct io_uring_cqe *cqe)
+{
+	struct slot *s = io_uring_cqe_get_data(cqe);
+	int i = op_index(s->op);
+
+	if (cqe->res < 0)
+		st[i].errors++;
+	st[i].hist[hist_bucket((now_ns() - s->start_ns) / 1000)]++;
+
+	s->busy = false;
+	nr_inflight--;
+	io_uring_cqe_seen(&ring, cqe);
+}
+
+// Waits for a completion, but no longer than until the deadline if any
+static void wait_one(uint64_t deadline)
+{
+	struct io_uring_cqe *cqe;
+	struct __kernel_timespec ts;
+	uint64_t now = now_ns();
+	int ret;
+
+	if (deadline) {
+		if (deadline <= now)
+			return;
+		ts.tv_sec = (deadline - now) / 1000000000L;
+		ts.tv_nsec = (deadline - now) % 1000000000L;
+
+		ret = io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+	} else {
+		ret = io_uring_wait_cqe(&ring, &cqe);
+	}
+	if (ret)
+		return;
+
+	do {
+		reap(cqe);
+	} while (!io_uring_peek_cqe(&ring, &cqe));
+}
+
+static void issue(int fd, const struct record_ent *e)
+{
+	struct io_uring_sqe *sqe;
+	struct slot *s;
+	int i;
+
+	for (i = 0; slots[i].busy; i++)
+		;
+	s = slots + i;
+
+	sqe = io_uring_get_sqe(&ring);
+	switch (e->op) {
+	case REQ_OP_READ:
+		io_uring_prep_read(sqe, fd, s->buf, e->pages * PAGE_SIZE,
+				   (uint64_t)e->pos * PAGE_SIZE);
+		break;
+	case REQ_OP_WRITE:
+		io_uring_prep_write(sqe, fd, s->buf, e->pages * PAGE_SIZE,
+				    (uint64_t)e->pos * PAGE_SIZE);
+		break;
+	case REQ_OP_DISCARD:
+		io_uring_prep_fallocate(sqe, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					(uint64_t)e->pos * PAGE_SIZE,
+					(uint64_t)e->pages * PAGE_SIZE);
+		break;
+	case REQ_OP_FLUSH:
+		io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+		break;
+	}
+	io_uring_sqe_set_data(sqe, s);
+
+	s->op = e->op;
+	s->busy = true;
+	s->start_ns = now_ns();
+	nr_inflight++;
+
+	i = op_index(e->op);
+	st[i].ios++;
+	st[i].bytes += (uint64_t)e->pages * PAGE_SIZE;
+
+	io_uring_submit(&ring);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *names[] = { "read", "write", "discard", "flush" };
+	const struct record_hdr *hdr;
+	const struct record_ent *ents;
+	uint64_t nr, i, start, due, elapsed, size;
+	double speed = 1;
+	struct stat sb;
+	char *map;
+	int tfd, fd, j;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <trace> <device> [speed]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		speed = atof(argv[3]);
+
+	tfd = open(argv[1], O_RDONLY);
+	if (tfd < 0 || fstat(tfd, &sb) || sb.st_size < (off_t)sizeof(*hdr)) {
+		perror(argv[1]);
+		return 1;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, tfd, 0);
+	if (map == MAP_FAILED) {
+		perror(argv[1]);
+		return 1;
+	}
+	hdr = (const struct record_hdr *)map;
+	if (memcmp(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != RECORD_VERSION) {
+		fprintf(stderr, "%s is not a cheedon trace\n", argv[1]);
+		return 1;
+	}
+	ents = (const struct record_ent *)(hdr + 1);
+	nr = (sb.st_size - sizeof(*hdr)) / sizeof(*ents);
+	printf("%lu requests recorded with %u devices of %uK stripes\n",
+	       nr, hdr->nr_dev, hdr->stripe_k);
+
+	fd = open(argv[2], O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	size = lseek(fd, 0, SEEK_END);
+
+	if (io_uring_queue_init(REPLAY_QD, &ring, 0)) {
+		fprintf(stderr, "Failed to set up io_uring\n");
+		return 1;
+	}
+	for (j = 0; j < REPLAY_QD; j++) {
+		slots[j].buf = aligned_alloc(PAGE_SIZE, MAX_REQ_SIZE);
+		if (!slots[j].buf) {
+			perror("Failed to allocate buffers");
+			return 1;
+		}
+		memset(slots[j].buf, 0x5a + j, MAX_REQ_SIZE);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		const struct record_ent *e = ents + i;
+
+		// Flushes carry no range
+		if (op_index(e->op) < 0 || e->pages > MAX_REQ_PAGES ||
+		    (!e->pages && e->op != REQ_OP_FLUSH) ||
+		    ((uint64_t)e->pos + e->pages) * PAGE_SIZE > size) {
+			skipped++;
+			continue;
+		}
+
+		due = speed > 0 ? start + e->ns / speed : 0;
+		while (nr_inflight == REPLAY_QD || (due && now_ns() < due))
+			wait_one(nr_inflight == REPLAY_QD ? 0 : due);
+
+		if (due && now_ns() > due)
+			late_ns += now_ns() - due;
+		issue(fd, e);
+	}
+	while (nr_inflight)
+		wait_one(0);
+	elapsed = now_ns() - start;
+
+	printf("replayed in %.2f s", elapsed / 1e9);
+	if (speed > 0)
+		printf(", %.2f ms behind schedule on average", nr ? late_ns / 1e6 / nr : 0);
+	printf(", %lu skipped\n", skipped);
+	for (j = 0; j < 4; j++) {
+		if (!st[j].ios)
+			continue;
+		printf("%s: %lu I/Os, %s, %lu errors, ", names[j], st[j].ios,
+		       humanSize(st[j].bytes), st[j].errors);
+		printf("p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms\n",
+		       hist_ms(st[j].hist, st[j].ios, 500),
+		       hist_ms(st[j].hist, st[j].ios, 990),
+		       hist_ms(st[j].hist, st[j].ios, 999));
+	}
+
+	io_uring_queue_exit(&ring);
+
+	return 0;
+}
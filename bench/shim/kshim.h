@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Just enough of the kernel API for queue.c to build in userspace
+ *
+ * Spinlocks, semaphores and completions map onto pthreads and POSIX
+ * semaphores, so the queue logic runs as is under real contention.
+ */
+
+#ifndef __CHEEDON_KSHIM_H
+#define __CHEEDON_KSHIM_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef u64 sector_t;
+typedef u8 blk_status_t;
+
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define pr_info(fmt, ...)	printf(fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_debug(fmt, ...)	((void)0)
+
+#define GFP_KERNEL 0
+#define kzalloc(size, gfp)	calloc(1, size)
+#define kfree(p)		free(p)
+
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (u64) 1000000000L + ts.tv_nsec;
+}
+
+// Lists
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(head, type, member) list_entry((head)->next, type, member)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = entry->prev = NULL;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_move(struct list_head *list, struct list_head *head)
+{
+	list->next->prev = list->prev;
+	list->prev->next = list->next;
+	list_add(list, head);
+}
+
+static inline void list_move_tail(struct list_head *list, struct list_head *head)
+{
+	list->next->prev = list->prev;
+	list->prev->next = list->next;
+	list_add_tail(list, head);
+}
+
+static inline bool list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_prev_entry(pos, member) \
+	list_entry((pos)->member.prev, __typeof__(*(pos)), member)
+#define list_for_each_entry_safe_reverse(pos, n, head, member)		\
+	for (pos = list_entry((head)->prev, __typeof__(*pos), member),	\
+	     n = list_prev_entry(pos, member);				\
+	     &pos->member != (head);					\
+	     pos = n, n = list_prev_entry(n, member))
+
+// Locking
+typedef pthread_spinlock_t spinlock_t;
+
+#define spin_lock_init(lock)	pthread_spin_init(lock, PTHREAD_PROCESS_PRIVATE)
+#define spin_lock_irqsave(lock, flags) \
+	do { (void)(flags); pthread_spin_lock(lock); } while (0)
+#define spin_unlock_irqrestore(lock, flags) \
+	do { (void)(flags); pthread_spin_unlock(lock); } while (0)
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define mutex_init(lock)	pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_lock(lock)	pthread_mutex_lock(&(lock)->m)
+#define mutex_unlock(lock)	pthread_mutex_unlock(&(lock)->m)
+
+struct semaphore {
+	sem_t sem;
+};
+
+static inline void sema_init(struct semaphore *s, int val)
+{
+	sem_init(&s->sem, 0, val);
+}
+
+static inline int down_interruptible(struct semaphore *s)
+{
+	while (sem_wait(&s->sem)) {
+		if (errno != EINTR)
+			return -EINTR;
+	}
+
+	return 0;
+}
+
+// 0 if taken, as the kernel's
+static inline int down_trylock(struct semaphore *s)
+{
+	return sem_trywait(&s->sem) ? 1 : 0;
+}
+
+static inline void up(struct semaphore *s)
+{
+	sem_post(&s->sem);
+}
+
+// struct cheedon_req is packed, so the futex backed state lives out of line
+struct completion {
+	struct completion_state {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		unsigned int done;
+	} *s;
+};
+
+static inline void init_completion(struct completion *c)
+{
+	c->s = calloc(1, sizeof(*c->s));
+	pthread_mutex_init(&c->s->lock, NULL);
+	pthread_cond_init(&c->s->cond, NULL);
+}
+
+static inline void reinit_completion(struct completion *c)
+{
+	c->s->done = 0;
+}
+
+static inline void complete(struct completion *c)
+{
+	pthread_mutex_lock(&c->s->lock);
+	c->s->done++;
+	pthread_cond_signal(&c->s->cond);
+	pthread_mutex_unlock(&c->s->lock);
+}
+
+static inline void wait_for_completion(struct completion *c)
+{
+	pthread_mutex_lock(&c->s->lock);
+	while (!c->s->done)
+		pthread_cond_wait(&c->s->cond, &c->s->lock);
+	c->s->done--;
+	pthread_mutex_unlock(&c->s->lock);
+}
+
+// CPUs, whatever sched_getcpu() says folded into a fixed count
+#define SHIM_NR_CPUS	64
+#define nr_cpu_ids	SHIM_NR_CPUS
+#define raw_smp_processor_id()	((unsigned int)sched_getcpu() % SHIM_NR_CPUS)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < SHIM_NR_CPUS; (cpu)++)
+#define DEFINE_PER_CPU(type, name)	__typeof__(type) name[SHIM_NR_CPUS]
+#define per_cpu(var, cpu)	((var)[cpu])
+
+// Requests, only what cheedon_push() looks at
+enum req_opf {
+	REQ_OP_READ = 0,
+	REQ_OP_WRITE = 1,
+	REQ_OP_FLUSH = 2,
+	REQ_OP_DISCARD = 3,
+	REQ_OP_WRITE_ZEROES = 9,
+};
+
+#define REQ_SYNC	(1U << 8)
+#define REQ_META	(1U << 9)
+#define REQ_PREFLUSH	(1U << 10)
+#define REQ_FUA		(1U << 11)
+
+struct request {
+	unsigned int cmd_flags;	// op in the low byte, as in the kernel
+	unsigned short ioprio;
+	sector_t sector;
+	unsigned int bytes;
+};
+
+#define req_op(rq)		((rq)->cmd_flags & 0xff)
+#define req_get_ioprio(rq)	((rq)->ioprio)
+#define blk_rq_pos(rq)		((rq)->sector)
+#define blk_rq_bytes(rq)	((rq)->bytes)
+
+static inline bool op_is_sync(unsigned int flags)
+{
+	return (flags & 0xff) == REQ_OP_READ || (flags & (REQ_SYNC | REQ_FUA | REQ_PREFLUSH));
+}
+
+#define IOPRIO_PRIO_CLASS(ioprio)	((ioprio) >> 13)
+#define IOPRIO_CLASS_RT		1
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+
+struct gendisk;
+struct page;
+struct file;
+
+// Tracepoints compile away
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+	static inline void trace_##name(proto) {}
+
+#endif
@@ -0,0 +1,2 @@
+// linux/ioctl.h is a uapi header
+#include <asm/ioctl.h>
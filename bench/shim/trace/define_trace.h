@@ -0,0 +1 @@
+// Tracepoints compile away, see kshim.h
@@ -13,39 +13,57 @@
 // #define DEBUG
 
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/blkdev.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
 #include <linux/genhd.h>
+#endif
 #include <linux/backing-dev.h>
 #include <linux/delay.h>
 #include <linux/completion.h>
 #include <linux/blk-mq.h>
+#include <linux/log2.h>
 
 #include "cheedon.h"
+#include "cheedon_trace.h"
 
 // cheedon is intentionally designed to expose 1 disk only
 
 /* Globals */
 static int cheedon_major;
-static struct gendisk *cheedon_disk;
+struct gendisk *cheedon_disk;
 static u64 cheedon_disksize;
 static struct page *swap_header_page;
 static struct blk_mq_tag_set tag_set;
 
 struct class *cheedon_chr_class;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static int cheedon_open(struct gendisk *gdisk, blk_mode_t mode)
+#else
 static int cheedon_open(struct block_device *dev, fmode_t mode)
+#endif
 {
 	pr_info("%s\n", __func__);
 	return 0;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static void cheedon_release(struct gendisk *gdisk)
+#else
 static void cheedon_release(struct gendisk *gdisk, fmode_t mode)
+#endif
 {
 	pr_info("%s\n", __func__);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static int cheedon_ioctl(struct block_device *bdev, blk_mode_t mode, unsigned cmd,
+		   unsigned long arg)
+#else
 static int cheedon_ioctl(struct block_device *bdev, fmode_t mode, unsigned cmd,
 		   unsigned long arg)
+#endif
 {
 	pr_info("ioctl cmd 0x%08x\n", cmd);
 
@@ -64,12 +82,14 @@ static int do_request(struct request *rq)
 			return 0;
 		return id;
 	}
+	cheedon_heat_account(blk_rq_pos(rq), blk_rq_bytes(rq), req_op(rq));
 
 	req = reqs + id;
 
 	wait_for_completion(&req->acked);
 
 	ret = req->ret;
+	trace_cheedon_complete(req, ret);
 	cheedon_pop(id);
 
 	return ret;
@@ -80,11 +100,26 @@ static blk_status_t queue_rq(struct blk_mq_hw_ctx *hctx,
 			     const struct blk_mq_queue_data *bd)
 {
 	int ret;
+	blk_status_t status;
 	struct request *rq = bd->rq;
+	sector_t pos = blk_rq_pos(rq);
+	unsigned int bytes = blk_rq_bytes(rq);
+	int op = req_op(rq);
 
 	/* Start request serving procedure */
 	blk_mq_start_request(rq);
 
+	/*
+	 * Completed by the backends themselves, maybe before this returns, so
+	 * what to count is taken above. Not counted when blk-mq retries it.
+	 */
+	if (cheedon_remap_ok(rq)) {
+		status = cheedon_remap(rq);
+		if (status == BLK_STS_OK)
+			cheedon_heat_account(pos, bytes, op);
+		return status;
+	}
+
 	ret = do_request(rq);
 
 	/* Stop request serving procedure */
@@ -97,10 +132,40 @@ static const struct blk_mq_ops mq_ops = {
 	.queue_rq = queue_rq,
 };
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+/*
+ * Single pages straight from swap and the page cache, without a struct
+ * request. An error makes the caller fall back to a bio.
+ */
+static int cheedon_rw_page(struct block_device *bdev, sector_t sector,
+			   struct page *page, unsigned int op)
+{
+	bool is_write = op_is_write(op);
+	int ret;
+
+	// The kernel remaps these itself, with bios
+	if (PageTransHuge(page) || cheedon_remap_active())
+		return -EOPNOTSUPP;
+
+	// Counted once served, a failure comes back as a bio
+	ret = cheedon_push_page(page, sector, is_write ? REQ_OP_WRITE : REQ_OP_READ);
+	if (ret)
+		return ret;
+	cheedon_heat_account(sector, PAGE_SIZE, is_write ? REQ_OP_WRITE : REQ_OP_READ);
+
+	page_endio(page, is_write, 0);
+
+	return 0;
+}
+#endif
+
 static const struct block_device_operations cheedon_fops = {
 	.owner = THIS_MODULE,
 	.open = cheedon_open,
 	.release = cheedon_release,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	.rw_page = cheedon_rw_page,
+#endif
 	.ioctl = cheedon_ioctl
 };
 
@@ -136,10 +201,48 @@ static ssize_t disksize_store(struct device *dev,
 	}
 
 	set_capacity(cheedon_disk, cheedon_disksize >> SECTOR_SHIFT);
+	cheedon_heat_resize(cheedon_disksize);
 
 	return len;
 }
 
+/*
+ * Advertised for filesystems to align to, and chunk_sectors has the block
+ * layer split requests on stripe units so the daemon maps each one to a
+ * single device.
+ *
+ * The queue isn't frozen, as requests already queued wait for a daemon to
+ * serve them, and this comes from a daemon before it does. The limits are
+ * plain stores, requests split before the change still reach the daemon
+ * whole and just take more backend I/Os.
+ */
+int cheedon_set_geometry(const struct cheedon_geometry_user *u)
+{
+	struct request_queue *q = cheedon_disk->queue;
+	unsigned int stripe_sectors = u->stripe_k * 2;
+
+	if (!u->nr || !u->stripe_k || u->stripe_k % (PAGE_SIZE / 1024) ||
+	    u->stripe_k > UINT_MAX / 1024 / u->nr)
+		return -EINVAL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	if (!is_power_of_2(stripe_sectors))
+		return -EINVAL;
+#endif
+
+	// Every daemon restart passes the same one
+	if (q->limits.chunk_sectors == stripe_sectors &&
+	    q->limits.io_opt == u->stripe_k * 1024 * u->nr)
+		return 0;
+
+	blk_queue_io_min(q, u->stripe_k * 1024);
+	blk_queue_io_opt(q, u->stripe_k * 1024 * u->nr);
+	blk_queue_chunk_sectors(q, stripe_sectors);
+
+	pr_info("%uK stripe units, %u per full stripe\n", u->stripe_k, u->nr);
+
+	return 0;
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR, disksize_show, disksize_store);
 
 static struct attribute *cheedon_disk_attrs[] = {
@@ -151,10 +254,42 @@ static const struct attribute_group cheedon_disk_attr_group = {
 	.attrs = cheedon_disk_attrs,
 };
 
+// The disk along with its queue, after del_gendisk() if it was added
+static void free_disk(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	put_disk(cheedon_disk);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	blk_cleanup_disk(cheedon_disk);
+#else
+	blk_cleanup_queue(cheedon_disk->queue);
+	put_disk(cheedon_disk);
+#endif
+	blk_mq_free_tag_set(&tag_set);
+}
+
 static int create_device(void)
 {
 	int ret;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	ret = blk_mq_alloc_sq_tag_set(&tag_set, &mq_ops, 128, BLK_MQ_F_SHOULD_MERGE);
+	if (ret) {
+		pr_err("%s %d: Error allocating tag set for device\n",
+		       __func__, __LINE__);
+		goto out;
+	}
+
+	/* gendisk structure, along with its queue */
+	cheedon_disk = blk_mq_alloc_disk(&tag_set, NULL);
+	if (IS_ERR(cheedon_disk)) {
+		pr_err("%s %d: Error allocating disk structure for device\n",
+		       __func__, __LINE__);
+		ret = PTR_ERR(cheedon_disk);
+		goto out_free_tags;
+	}
+	cheedon_disk->minors = 1;
+#else
 	/* gendisk structure */
 	cheedon_disk = alloc_disk(1);
 	if (!cheedon_disk) {
@@ -165,12 +300,13 @@ static int create_device(void)
 	}
 
 	cheedon_disk->queue = blk_mq_init_sq_queue(&tag_set, &mq_ops, 128, BLK_MQ_F_SHOULD_MERGE);
-	if (!cheedon_disk->queue) {
+	if (IS_ERR(cheedon_disk->queue)) {
 		pr_err("%s %d: Error allocating disk queue for device\n",
 		       __func__, __LINE__);
-		ret = -ENOMEM;
+		ret = PTR_ERR(cheedon_disk->queue);
 		goto out_put_disk;
 	}
+#endif
 
 	// blk_queue_make_request(cheedon_disk->queue, cheedon_make_request);
 
@@ -193,13 +329,30 @@ static int create_device(void)
 	blk_queue_io_min(cheedon_disk->queue, PAGE_SIZE);
 	blk_queue_max_hw_sectors(cheedon_disk->queue, 4096); // 512 * 4096 = 2MiB
 
-	// Set discard capability
+	// Set discard capability, a non-zero limit is all it takes since 5.19
 	cheedon_disk->queue->limits.discard_granularity = PAGE_SIZE;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
 	blk_queue_flag_set(QUEUE_FLAG_DISCARD, cheedon_disk->queue);
+#endif
 	blk_queue_max_discard_sectors(cheedon_disk->queue, 4096); // 512 * 4096 = 2MiB
 	blk_queue_max_write_zeroes_sectors(cheedon_disk->queue, 4096); // 512 * 4096 = 2MiB
 
+	/*
+	 * Writes are acked once the daemon has their data, before it reaches
+	 * the backends, so flushes have to be passed on. Without FUA the block
+	 * layer follows FUA writes with a flush.
+	 */
+	blk_queue_write_cache(cheedon_disk->queue, true, false);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	ret = add_disk(cheedon_disk);
+	if (ret) {
+		pr_err("%s %d: Error adding disk\n", __func__, __LINE__);
+		goto out_free_disk;
+	}
+#else
 	add_disk(cheedon_disk);
+#endif
 
 	cheedon_disksize = 0;
 
@@ -208,21 +361,42 @@ static int create_device(void)
 	if (ret < 0) {
 		pr_err("%s %d: Error creating sysfs group\n",
 		       __func__, __LINE__);
-		goto out_free_queue;
+		goto out_del_disk;
 	}
 
 	/* cheedon devices sort of resembles non-rotational disks */
 	blk_queue_flag_set(QUEUE_FLAG_NONROT, cheedon_disk->queue);
+
+	// Swap reads then skip readahead and go through rw_page() one by one
+#if defined(QUEUE_FLAG_SYNCHRONOUS)
+	blk_queue_flag_set(QUEUE_FLAG_SYNCHRONOUS, cheedon_disk->queue);
+#elif defined(BDI_CAP_SYNCHRONOUS_IO)
+	cheedon_disk->queue->backing_dev_info->capabilities |= BDI_CAP_SYNCHRONOUS_IO;
+#endif
+
 	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, cheedon_disk->queue);
 
 out:
 	return ret;
 
-out_free_queue:
-	blk_cleanup_queue(cheedon_disk->queue);
+out_del_disk:
+	del_gendisk(cheedon_disk);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+out_free_disk:
+#endif
+	free_disk();
+	cheedon_disk = NULL;
+
+	return ret;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+out_free_tags:
+	blk_mq_free_tag_set(&tag_set);
+#else
 out_put_disk:
 	put_disk(cheedon_disk);
+#endif
+	cheedon_disk = NULL;
 
 	return ret;
 }
@@ -237,11 +411,8 @@ static void destroy_device(void)
 	sysfs_remove_group(&disk_to_dev(cheedon_disk)->kobj,
 			   &cheedon_disk_attr_group);
 
-	if (cheedon_disk->queue)
-		blk_cleanup_queue(cheedon_disk->queue);
-
 	del_gendisk(cheedon_disk);
-	put_disk(cheedon_disk);
+	free_disk();
 
 	cheedon_disk = NULL;
 }
@@ -265,7 +436,11 @@ static int __init cheedon_init(void)
 		goto free_devices;
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	cheedon_chr_class = class_create("cheedon_chr");
+#else
 	cheedon_chr_class = class_create(THIS_MODULE, "cheedon_chr");
+#endif
 	if (IS_ERR(cheedon_chr_class)) {
 		ret = PTR_ERR(cheedon_chr_class);
 		pr_warn("Failed to register class cheedon_chr\n");
@@ -276,19 +451,31 @@ static int __init cheedon_init(void)
 	if (ret)
 		goto destroy_chr;
 
-	reqs = kzalloc(sizeof(struct cheedon_req) * CHEEDON_QUEUE_SIZE, GFP_KERNEL);
+	ret = cheedon_remap_init();
+	if (ret)
+		goto remap_fail;
+
+	ret = cheedon_heat_init();
+	if (ret)
+		goto heat_fail;
+
+	reqs = kzalloc(sizeof(struct cheedon_req) * CHEEDON_NR_REQS, GFP_KERNEL);
 	if (reqs == NULL) {
 		pr_err("%s %d: Unable to allocate memory for cheedon_req\n", __func__, __LINE__);
 		ret = -ENOMEM;
 		goto nomem;
 	}
 	cheedon_queue_init();
-	for (i = 0; i < CHEEDON_QUEUE_SIZE; i++)
+	for (i = 0; i < CHEEDON_NR_REQS; i++)
 		init_completion(&reqs[i].acked);
 
 	return 0;
 
 nomem:
+	cheedon_heat_exit();
+heat_fail:
+	cheedon_remap_exit();
+remap_fail:
 	cheedon_chr_cleanup_module();
 destroy_chr:
 	class_destroy(cheedon_chr_class);
@@ -302,6 +489,10 @@ out:
 
 static void __exit cheedon_exit(void)
 {
+	cheedon_remap_exit();
+
+	cheedon_heat_exit();
+
 	cheedon_queue_exit();
 
 	kfree(reqs);
@@ -1,5 +1,6 @@
 #!/bin/bash
 
-#gcc -O2 -g -Wall -fsanitize=address -static-libasan user.c -luring
-gcc -O3 -s -Wall user.c -luring
+SRCS="user.c meta.c thin.c zero.c compress.c dedup.c lfs.c zoned.c layout.c overlay.c journal.c record.c autotune.c reshape.c mmap.c csum.c prof.c"
 
+#gcc -O2 -g -Wall -fsanitize=address -static-libasan -pthread $SRCS -luring "$@"
+gcc -O3 -s -Wall -pthread $SRCS -luring "$@"
@@ -6,6 +6,8 @@
 #ifndef __CHEEDON_H
 #define __CHEEDON_H
 
+#include <linux/ioctl.h>
+
 #define SECTOR_SHIFT		9
 #define SECTOR_SIZE		(1 << SECTOR_SHIFT)
 #define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
@@ -16,6 +18,12 @@
 	(CHEEDON_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
 #define CHEEDON_QUEUE_SIZE 4096
+// Plus one descriptor per CPU for rw_page()
+#define CHEEDON_NR_REQS (CHEEDON_QUEUE_SIZE + nr_cpu_ids)
+
+// Access heat map, regions over the whole disk
+#define CHEEDON_HEAT_REGIONS 1024
+#define CHEEDON_HEAT_DECAY_SEC 60
 
 #define SKIP INT_MIN
 
@@ -35,12 +43,69 @@ struct cheedon_req_user {
 	char *buf;
 	unsigned int pos; // sector_t but divided by 4096
 	unsigned int len;
-	unsigned int pad[2];
+	unsigned short ioprio; // req_get_ioprio()
+	unsigned char flags; // CHEEDON_REQ_*
+	unsigned char prio_class; // CHEEDON_CLASS_*
+	unsigned int pad;
+};
+
+// Request flags passed on to the daemon
+#define CHEEDON_REQ_SYNC	(1 << 0)
+#define CHEEDON_REQ_META	(1 << 1)
+#define CHEEDON_REQ_PREFLUSH	(1 << 2)	// on REQ_OP_FLUSH
+
+// Dispatch classes, served in this order
+enum {
+	CHEEDON_CLASS_URGENT,		// RT ioprio, metadata and flushes
+	CHEEDON_CLASS_NORMAL,		// reads and sync writes
+	CHEEDON_CLASS_BACKGROUND,	// writeback, discards and IDLE ioprio
+	CHEEDON_NR_CLASSES,
 };
 
+// Requests of a class passed over before one of them goes first anyway
+#define CHEEDON_CLASS_BURST 32
+
+#define CHEEDON_MAX_DEVS 16
+
+// CHEEDON_IOC_REMAP, plain striping served in the kernel
+struct cheedon_remap_user {
+	unsigned int stripe_k;
+	unsigned int nr;
+	int fds[CHEEDON_MAX_DEVS];
+};
+
+// CHEEDON_IOC_GEOMETRY, stripe units of nr at a time make a full stripe
+struct cheedon_geometry_user {
+	unsigned int stripe_k;
+	unsigned int nr;
+};
+
+#define CHEEDON_IOC_MAGIC 0xCE
+#define CHEEDON_IOC_REMAP _IOW(CHEEDON_IOC_MAGIC, 1, struct cheedon_remap_user)
+#define CHEEDON_IOC_GEOMETRY _IOW(CHEEDON_IOC_MAGIC, 2, struct cheedon_geometry_user)
+// Fails the fetches of this file still waiting for a request
+#define CHEEDON_IOC_CANCEL_FETCH _IO(CHEEDON_IOC_MAGIC, 3)
+
+/*
+ * io_uring commands (IORING_OP_URING_CMD) in place of read() and write(),
+ * with addr pointing to a struct cheedon_req_user of the daemon. FETCH
+ * completes once a request was copied there, COMMIT acks the one it holds
+ * like write() does and COMMIT_AND_FETCH fetches the next one into it.
+ * Fetches still waiting fail with -ECANCELED on CHEEDON_IOC_CANCEL_FETCH
+ * and once the chardev is closed.
+ */
+struct cheedon_uring_cmd {
+	unsigned long long addr;
+};
+
+#define CHEEDON_URING_CMD_FETCH _IOR(CHEEDON_IOC_MAGIC, 0x20, struct cheedon_uring_cmd)
+#define CHEEDON_URING_CMD_COMMIT _IOW(CHEEDON_IOC_MAGIC, 0x21, struct cheedon_uring_cmd)
+#define CHEEDON_URING_CMD_COMMIT_AND_FETCH _IOWR(CHEEDON_IOC_MAGIC, 0x22, struct cheedon_uring_cmd)
+
 #ifdef __KERNEL__
 
 #include <linux/list.h>
+#include <linux/blk_types.h>
 
 struct cheedon_queue_item {
 	int id;
@@ -51,26 +116,51 @@ struct cheedon_req {
 	int ret;
 	bool is_rw;
 	struct request *rq;
+	struct page *page;	// rw_page() instead of rq
+	struct file *owner;	// chardev file which peeked it
 	struct cheedon_req_user user;
 	struct completion acked;
 	struct cheedon_queue_item *item;
+	u64 pushed_ns;		// for the tracepoints
 } __attribute__((aligned(8), packed));
 
 // blk.c
+extern struct gendisk *cheedon_disk;
+int cheedon_set_geometry(const struct cheedon_geometry_user *u);
 void cheedon_io(struct cheedon_req_user *user); // Called by koo
 extern struct class *cheedon_chr_class;
 // extern struct mutex cheedon_mutex;
 void cheedon_chr_cleanup_module(void);
 int cheedon_chr_init_module(void);
+void cheedon_chr_kick(void);
 
 // queue.c
 extern struct cheedon_req *reqs;
 int cheedon_push(struct request *rq);
-struct cheedon_req *cheedon_peek(void);
+struct cheedon_req *cheedon_peek(struct file *owner);
+struct cheedon_req *cheedon_try_peek(struct file *owner);
+int cheedon_ack(struct cheedon_req *req, struct file *owner);
+void cheedon_requeue(struct file *owner);
 void cheedon_pop(int id);
+int cheedon_push_page(struct page *page, sector_t sector, int op);
 void cheedon_queue_init(void);
 void cheedon_queue_exit(void);
 
+// remap.c
+bool cheedon_remap_active(void);
+bool cheedon_remap_ok(struct request *rq);
+blk_status_t cheedon_remap(struct request *rq);
+int cheedon_remap_set(struct file *owner, const struct cheedon_remap_user *u);
+void cheedon_remap_clear(struct file *owner);
+int cheedon_remap_init(void);
+void cheedon_remap_exit(void);
+
+// heat.c
+void cheedon_heat_account(sector_t sector, unsigned int bytes, int op);
+void cheedon_heat_resize(u64 disksize);
+int cheedon_heat_init(void);
+void cheedon_heat_exit(void);
+
 #endif
 
 #endif
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Request lifetime tracepoints
+ *
+ * echo 1 > /sys/kernel/tracing/events/cheedon/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cheedon
+
+#if !defined(_CHEEDON_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CHEEDON_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "cheedon.h"
+
+DECLARE_EVENT_CLASS(cheedon_req_class,
+
+	TP_PROTO(struct cheedon_req *req),
+
+	TP_ARGS(req),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(int, op)
+		__field(unsigned int, pos)
+		__field(unsigned int, len)
+		__field(unsigned char, prio_class)
+	),
+
+	TP_fast_assign(
+		__entry->id = req->user.id;
+		__entry->op = req->user.op;
+		__entry->pos = req->user.pos;
+		__entry->len = req->user.len;
+		__entry->prio_class = req->user.prio_class;
+	),
+
+	TP_printk("tag=%d op=%d pos=%u len=%u class=%u",
+		  __entry->id, __entry->op, __entry->pos, __entry->len,
+		  __entry->prio_class)
+);
+
+// Queued for the daemon
+DEFINE_EVENT(cheedon_req_class, cheedon_push,
+	TP_PROTO(struct cheedon_req *req),
+	TP_ARGS(req)
+);
+
+// Read by the daemon
+DEFINE_EVENT(cheedon_req_class, cheedon_peek,
+	TP_PROTO(struct cheedon_req *req),
+	TP_ARGS(req)
+);
+
+// Left unacked by a daemon which went away, pending again
+DEFINE_EVENT(cheedon_req_class, cheedon_requeue,
+	TP_PROTO(struct cheedon_req *req),
+	TP_ARGS(req)
+);
+
+DECLARE_EVENT_CLASS(cheedon_done_class,
+
+	TP_PROTO(struct cheedon_req *req, int ret),
+
+	TP_ARGS(req, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(int, op)
+		__field(unsigned int, pos)
+		__field(unsigned int, len)
+		__field(int, ret)
+		__field(u64, lat_ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = req->user.id;
+		__entry->op = req->user.op;
+		__entry->pos = req->user.pos;
+		__entry->len = req->user.len;
+		__entry->ret = ret;
+		__entry->lat_ns = ktime_get_ns() - req->pushed_ns;
+	),
+
+	TP_printk("tag=%d op=%d pos=%u len=%u ret=%d lat=%llu ns",
+		  __entry->id, __entry->op, __entry->pos, __entry->len,
+		  __entry->ret, __entry->lat_ns)
+);
+
+// Acked by the daemon, data copied
+DEFINE_EVENT(cheedon_done_class, cheedon_ack,
+	TP_PROTO(struct cheedon_req *req, int ret),
+	TP_ARGS(req, ret)
+);
+
+// Handed back to blk-mq
+DEFINE_EVENT(cheedon_done_class, cheedon_complete,
+	TP_PROTO(struct cheedon_req *req, int ret),
+	TP_ARGS(req, ret)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cheedon_trace
+
+#include <trace/define_trace.h>
@@ -7,18 +7,28 @@
 
 #include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/highmem.h>
 #include <linux/cdev.h>
 #include <linux/completion.h>
 #include <linux/blkdev.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
 #include <linux/genhd.h>
+#endif
 #include <linux/backing-dev.h>
 #include <linux/blk-mq.h>
 #include <linux/sched/signal.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
 
 #include "cheedon.h"
+#include "cheedon_trace.h"
 
 #define CHEEDON_CHR_MAJOR 510
 #define CHEEDON_CHR_MINOR 11
@@ -35,6 +45,23 @@ static int do_request(struct cheedon_req *req)
 	void *b_buf;
 	struct request *rq;
 
+	// A single page from cheedon_rw_page(), there's no request to walk
+	if (req->page) {
+		b_buf = kmap(req->page);
+		if (req->user.op == REQ_OP_WRITE)
+			b_len = copy_to_user(req->user.buf, b_buf, PAGE_SIZE);
+		else
+			b_len = copy_from_user(b_buf, req->user.buf, PAGE_SIZE);
+		kunmap(req->page);
+
+		if (unlikely(b_len)) {
+			WARN_ON(1);
+			pr_err("%s: page copy failed\n", __func__);
+			return -EFAULT;
+		}
+		return 0;
+	}
+
 	rq = req->rq;
 
 	pr_debug("%s++\n", __func__);
@@ -83,8 +110,53 @@ static int cheedon_chr_open(struct inode *inode, struct file *filp)
 
 static int cheedon_chr_release(struct inode *inode, struct file *filp)
 {
+	cheedon_remap_clear(filp);
+	// A daemon started after this one picks them up, nothing gets lost
+	cheedon_requeue(filp);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+static void cheedon_cancel_fetches(struct file *file);
+
+/*
+ * Every close, a killed daemon's too. Its ring holds the file while fetches
+ * are parked and waits for them when torn down, and before Linux 6.7 they
+ * can't be canceled from there, so the release above would never come.
+ */
+static int cheedon_chr_flush(struct file *filp, fl_owner_t id)
+{
+	cheedon_cancel_fetches(filp);
+
 	return 0;
 }
+#endif
+
+static long cheedon_chr_ioctl(struct file *filp, unsigned int cmd,
+			      unsigned long arg)
+{
+	struct cheedon_remap_user remap;
+	struct cheedon_geometry_user geo;
+
+	switch (cmd) {
+	case CHEEDON_IOC_REMAP:
+		if (copy_from_user(&remap, (void __user *)arg, sizeof(remap)))
+			return -EFAULT;
+		return cheedon_remap_set(filp, &remap);
+	case CHEEDON_IOC_GEOMETRY:
+		if (copy_from_user(&geo, (void __user *)arg, sizeof(geo)))
+			return -EFAULT;
+		return cheedon_set_geometry(&geo);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	case CHEEDON_IOC_CANCEL_FETCH:
+		cheedon_cancel_fetches(filp);
+		return 0;
+#endif
+	}
+
+	return -ENOTTY;
+}
 
 static ssize_t cheedon_chr_read(struct file *filp, char *buf, size_t count,
 			    loff_t * f_pos)
@@ -98,7 +170,7 @@ static ssize_t cheedon_chr_read(struct file *filp, char *buf, size_t count,
 		return -EINVAL;
 	}
 
-	req = cheedon_peek();
+	req = cheedon_peek(filp);
 	if (unlikely(req == NULL)) {
 		pr_err("%s: failed to peek queue\n", __func__);
 		return -ERESTARTSYS;
@@ -112,11 +184,44 @@ static ssize_t cheedon_chr_read(struct file *filp, char *buf, size_t count,
 	return count;
 }
 
+// write() and the io_uring commits, ureq carries the request and its buffer
+static int cheedon_commit(struct file *file, const struct cheedon_req_user *ureq)
+{
+	struct cheedon_req *req;
+
+	pr_debug("write: req[%d]\n"
+		"  buf=%px\n"
+		"  pos=%u\n"
+		"  len=%u\n",
+			ureq->id, ureq->buf, ureq->pos, ureq->len);
+
+	if (unlikely(ureq->id < 0 || ureq->id >= CHEEDON_NR_REQS))
+		return -EINVAL;
+	req = reqs + ureq->id;
+	// Not taken through this file, or acked already
+	if (unlikely(cheedon_ack(req, file))) {
+		pr_err("%s: req[%d] isn't in flight here\n", __func__, ureq->id);
+		return -EINVAL;
+	}
+	req->user.buf = ureq->buf;
+
+	// Process bio
+	if (likely(req->is_rw))
+		req->ret = do_request(req);
+	else
+		req->ret = 0;
+
+	trace_cheedon_ack(req, req->ret);
+	complete(&req->acked);
+
+	return 0;
+}
+
 static ssize_t cheedon_chr_write(struct file *file, const char __user *buf,
 			    size_t count, loff_t *ppos)
 {
-	struct cheedon_req *req;
 	struct cheedon_req_user ureq;
+	int ret;
 
 	if (unlikely(count != sizeof(struct cheedon_req_user))) {
 		pr_err("%s: size mismatch: %ld vs %ld\n",
@@ -129,31 +234,213 @@ static ssize_t cheedon_chr_write(struct file *file, const char __user *buf,
 		return -EFAULT;
 	}
 
-	pr_debug("write: req[%d]\n"
-		"  buf=%px\n"
-		"  pos=%u\n"
-		"  len=%u\n",
-			ureq.id, ureq.buf, ureq.pos, ureq.len);
+	ret = cheedon_commit(file, &ureq);
+	if (unlikely(ret))
+		return ret;
 
-	req = reqs + ureq.id;
-	req->user.buf = ureq.buf;
+	return (ssize_t)count;
+}
 
-	// Process bio
-	if (likely(req->is_rw))
-		req->ret = do_request(req);
-	else
-		req->ret = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/*
+ * io_uring fetches with no request pending wait here, in the order they
+ * came. Every request announced by queue.c hands the first one over to
+ * its task, where the request gets copied out.
+ */
+struct cheedon_cmd_pdu {
+	struct list_head list;
+	struct io_uring_cmd *cmd;
+	struct cheedon_req_user __user *addr;
+};
 
-	complete(&req->acked);
+static LIST_HEAD(cheedon_parked);
+static DEFINE_SPINLOCK(cheedon_park_lock);
 
-	return (ssize_t)count;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define cheedon_cmd_done(cmd, ret, issue_flags) io_uring_cmd_done(cmd, ret, 0, issue_flags)
+#else
+#define cheedon_cmd_done(cmd, ret, issue_flags) io_uring_cmd_done(cmd, ret, 0)
+#endif
+
+static inline struct cheedon_cmd_pdu *cheedon_cmd_pdu(struct io_uring_cmd *cmd)
+{
+	BUILD_BUG_ON(sizeof(struct cheedon_cmd_pdu) > sizeof(cmd->pdu));
+	return (struct cheedon_cmd_pdu *)cmd->pdu;
+}
+
+static inline const struct cheedon_uring_cmd *cheedon_cmd_payload(struct io_uring_cmd *cmd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	return io_uring_sqe_cmd(cmd->sqe);
+#else
+	return cmd->cmd;
+#endif
+}
+
+// The result, or -EIOCBQUEUED once parked
+static int cheedon_fetch(struct io_uring_cmd *cmd)
+{
+	struct cheedon_cmd_pdu *pdu = cheedon_cmd_pdu(cmd);
+	struct cheedon_req *req;
+	unsigned long irqflags;
+
+	// Held across the try, so a request announced meanwhile still finds it
+	spin_lock_irqsave(&cheedon_park_lock, irqflags);
+	req = cheedon_try_peek(cmd->file);
+	if (!req) {
+		list_add_tail(&pdu->list, &cheedon_parked);
+		spin_unlock_irqrestore(&cheedon_park_lock, irqflags);
+		return -EIOCBQUEUED;
+	}
+	spin_unlock_irqrestore(&cheedon_park_lock, irqflags);
+
+	// Left in flight on failure, the release requeues it
+	if (unlikely(copy_to_user(pdu->addr, &req->user, sizeof(req->user)))) {
+		pr_err("%s: copy_to_user() failed\n", __func__);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static void cheedon_fetch_in_task(struct io_uring_cmd *cmd, unsigned int issue_flags)
+#else
+static void cheedon_fetch_in_task(struct io_uring_cmd *cmd)
+#endif
+{
+	int ret = cheedon_fetch(cmd);
+
+	if (ret != -EIOCBQUEUED)
+		cheedon_cmd_done(cmd, ret, issue_flags);
+}
+
+// A request is pending, queue.c calls this after announcing it
+void cheedon_chr_kick(void)
+{
+	struct cheedon_cmd_pdu *pdu;
+	struct io_uring_cmd *cmd = NULL;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&cheedon_park_lock, irqflags);
+	pdu = list_first_entry_or_null(&cheedon_parked, struct cheedon_cmd_pdu, list);
+	if (pdu) {
+		list_del_init(&pdu->list);
+		cmd = pdu->cmd;
+	}
+	spin_unlock_irqrestore(&cheedon_park_lock, irqflags);
+
+	if (cmd)
+		io_uring_cmd_complete_in_task(cmd, cheedon_fetch_in_task);
+}
+
+// Parked fetches of file, or only cmd if given, taken off the list
+static void cheedon_unpark(struct file *file, struct io_uring_cmd *cmd,
+			   struct list_head *out)
+{
+	struct cheedon_cmd_pdu *pdu, *next;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&cheedon_park_lock, irqflags);
+	list_for_each_entry_safe(pdu, next, &cheedon_parked, list) {
+		if (pdu->cmd->file == file && (!cmd || pdu->cmd == cmd))
+			list_move_tail(&pdu->list, out);
+	}
+	spin_unlock_irqrestore(&cheedon_park_lock, irqflags);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static void cheedon_cancel_in_task(struct io_uring_cmd *cmd, unsigned int issue_flags)
+#else
+static void cheedon_cancel_in_task(struct io_uring_cmd *cmd)
+#endif
+{
+	cheedon_cmd_done(cmd, -ECANCELED, issue_flags);
+}
+
+// The ioctl and flush come from outside the ring, the fetches fail in their task
+static void cheedon_cancel_fetches(struct file *file)
+{
+	struct cheedon_cmd_pdu *pdu, *next;
+	LIST_HEAD(cancel);
+
+	cheedon_unpark(file, NULL, &cancel);
+
+	list_for_each_entry_safe(pdu, next, &cancel, list) {
+		list_del_init(&pdu->list);
+		io_uring_cmd_complete_in_task(pdu->cmd, cheedon_cancel_in_task);
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+// The ring cancels cmd itself, it can complete right away
+static void cheedon_cancel_fetch(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	struct cheedon_cmd_pdu *pdu, *next;
+	LIST_HEAD(cancel);
+
+	cheedon_unpark(cmd->file, cmd, &cancel);
+
+	list_for_each_entry_safe(pdu, next, &cancel, list) {
+		list_del_init(&pdu->list);
+		cheedon_cmd_done(pdu->cmd, -ECANCELED, issue_flags);
+	}
+}
+#endif
+
+static int cheedon_chr_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	const struct cheedon_uring_cmd *ucmd = cheedon_cmd_payload(cmd);
+	struct cheedon_cmd_pdu *pdu = cheedon_cmd_pdu(cmd);
+	struct cheedon_req_user ureq;
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	// The ring goes away with fetches still parked
+	if (unlikely(issue_flags & IO_URING_F_CANCEL)) {
+		cheedon_cancel_fetch(cmd, issue_flags);
+		return 0;
+	}
+#endif
+
+	pdu->cmd = cmd;
+	pdu->addr = u64_to_user_ptr(READ_ONCE(ucmd->addr));
+	INIT_LIST_HEAD(&pdu->list);
+
+	switch (cmd->cmd_op) {
+	case CHEEDON_URING_CMD_COMMIT:
+	case CHEEDON_URING_CMD_COMMIT_AND_FETCH:
+		if (unlikely(copy_from_user(&ureq, pdu->addr, sizeof(ureq))))
+			return -EFAULT;
+		ret = cheedon_commit(cmd->file, &ureq);
+		if (ret || cmd->cmd_op == CHEEDON_URING_CMD_COMMIT)
+			return ret;
+		fallthrough;
+	case CHEEDON_URING_CMD_FETCH:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+		io_uring_cmd_mark_cancelable(cmd, issue_flags);
+#endif
+		return cheedon_fetch(cmd);
+	}
+
+	return -ENOTTY;
+}
+#else
+void cheedon_chr_kick(void)
+{
 }
+#endif
 
 static const struct file_operations cheedon_chr_fops = {
 	.read = cheedon_chr_read,
 	.write = cheedon_chr_write,
 	.open = cheedon_chr_open,
 	.release = cheedon_chr_release,
+	.unlocked_ioctl = cheedon_chr_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	.flush = cheedon_chr_flush,
+	.uring_cmd = cheedon_chr_uring_cmd,
+#endif
 };
 
 void cheedon_chr_cleanup_module(void)
@@ -0,0 +1,670 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Inline compression
+ *
+ * The volume is split into COMPRESS_K chunks. Each chunk is compressed as a
+ * whole and stored as an extent of whole pages in the striped backend space,
+ * found through a persistent map of one 64-bit entry per chunk:
+ *
+ *   bit 63     mapped (unmapped chunks read as zeroes)
+ *   bit 62     stored raw, as compression didn't save a single page
+ *   bit 40-57  stored length in bytes
+ *   bit 0-39   first backend page
+ *
+ * Chunks of a request are (de)compressed in parallel by a small thread pool.
+ * Extents are never overwritten in place; the old extent is released only
+ * after the map pointing away from it has been flushed.
+ *
+ * Build with -DCOMPRESS -llz4, or -DCOMPRESS -DCOMPRESS_ZSTD -lzstd.
+ */
+
+#ifdef COMPRESS
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef COMPRESS_ZSTD
+#include <zstd.h>
+#else
+#include <lz4.h>
+#endif
+
+#include "user.h"
+
+#if COMPRESS_K < 16 || COMPRESS_K > 128 || (COMPRESS_K & (COMPRESS_K - 1))
+#error "COMPRESS_K must be a power of two between 16 and 128"
+#endif
+
+#define CMAP_MAGIC	0x5052434445454843ULL	// "CHEEDCRP"
+#define CMAP_VERSION	1
+#define CMAP_HDR_SIZE	PAGE_SIZE
+
+#define E_MAPPED	(1ULL << 63)
+#define E_RAW		(1ULL << 62)
+#define E_LEN_SHIFT	40
+#define E_LEN_MASK	((1ULL << 18) - 1)
+#define E_PPN_MASK	((1ULL << 40) - 1)
+
+#define E_LEN(e)	(((e) >> E_LEN_SHIFT) & E_LEN_MASK)
+#define E_PPN(e)	((e) & E_PPN_MASK)
+#define E_PAGES(e)	((E_LEN(e) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+#define MAX_JOBS	(MAX_REQ_PAGES / COMPRESS_PAGES_PER_CHUNK + 2)
+
+struct cmap_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t chunk_size;
+	uint64_t nr_chunks;
+};
+
+struct cjob {
+	uint64_t chunk;
+	unsigned int off;	// first page of the chunk covered by the request
+	unsigned int nr;	// number of pages covered by the request
+	char *data;		// request buffer at off, NULL for zeroes
+	const char *src;	// full chunk to be stored
+	uint64_t old;		// map entry before the request
+	int clen;		// compressed length, 0 for raw, -1 for nothing
+	char *raw;
+	char *out;
+};
+
+static struct meta meta;
+static struct cmap_hdr *hdr;
+static uint64_t *map;
+
+// Backend space, one bit per page
+static uint64_t *space;
+static uint64_t nr_phys, cursor;
+
+static struct {
+	uint64_t *ppn;
+	unsigned int *nr;
+	size_t len, cap;
+} pending_free;
+
+static struct cjob jobs[MAX_JOBS];
+
+static struct {
+	uint64_t mapped;	// chunks holding data
+	uint64_t raw;		// chunks stored uncompressed
+	uint64_t stored;	// backend pages used
+	uint64_t bytes_in;	// logical bytes written
+	uint64_t bytes_out;	// backend bytes written
+	uint64_t bypass;	// incompressible chunks written
+	uint64_t zero;		// all-zero chunks written
+} cstats;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	pthread_t *threads;
+	int nr_threads;
+	void (*fn)(struct cjob *);
+	int nr, next, pending;
+	unsigned long gen;
+	bool stop;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static inline int codec_compress(const char *src, char *dst, int cap)
+{
+#ifdef COMPRESS_ZSTD
+	size_t ret = ZSTD_compress(dst, cap, src, COMPRESS_CHUNK_SIZE, 1);
+
+	return ZSTD_isError(ret) ? 0 : (int)ret;
+#else
+	return LZ4_compress_default(src, dst, COMPRESS_CHUNK_SIZE, cap);
+#endif
+}
+
+static inline int codec_decompress(const char *src, char *dst, int len)
+{
+#ifdef COMPRESS_ZSTD
+	size_t ret = ZSTD_decompress(dst, COMPRESS_CHUNK_SIZE, src, len);
+
+	return ZSTD_isError(ret) ? -1 : (int)ret;
+#else
+	return LZ4_decompress_safe(src, dst, len, COMPRESS_CHUNK_SIZE);
+#endif
+}
+
+/* Thread pool */
+
+// Called with pool.lock held
+static void pool_work(struct cjob *jobs)
+{
+	struct cjob *job;
+
+	while (pool.next < pool.nr) {
+		job = jobs + pool.next++;
+		pthread_mutex_unlock(&pool.lock);
+		pool.fn(job);
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	unsigned long gen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (!pool.stop && pool.gen == gen)
+			pthread_cond_wait(&pool.start, &pool.lock);
+		if (pool.stop)
+			break;
+		gen = pool.gen;
+		pool_work(jobs);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static void run_jobs(void (*fn)(struct cjob *), int nr)
+{
+	int i;
+
+	if (nr == 1 || !pool.nr_threads) {
+		for (i = 0; i < nr; i++)
+			fn(jobs + i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.nr = nr;
+	pool.next = 0;
+	pool.pending = nr;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.start);
+
+	// The daemon thread takes its share as well
+	pool_work(jobs);
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Backend space allocator */
+
+static inline bool page_used(uint64_t p)
+{
+	return space[p / 64] & (1ULL << (p % 64));
+}
+
+static void mark_space(uint64_t p, unsigned int n, bool used)
+{
+	for (; n; p++, n--) {
+		if (used)
+			space[p / 64] |= 1ULL << (p % 64);
+		else
+			space[p / 64] &= ~(1ULL << (p % 64));
+	}
+}
+
+// Next-fit search for n contiguous free pages
+static uint64_t alloc_extent(unsigned int n)
+{
+	uint64_t p = cursor, scanned = 0, run = 0;
+
+	while (scanned < nr_phys + n) {
+		if (p >= nr_phys) {
+			p = 0;
+			run = 0;
+		}
+		if (p % 64 == 0 && p + 64 <= nr_phys && space[p / 64] == ~0ULL) {
+			p += 64;
+			scanned += 64;
+			run = 0;
+			continue;
+		}
+
+		if (page_used(p)) {
+			run = 0;
+		} else if (++run == n) {
+			p = p + 1 - n;
+			mark_space(p, n, true);
+			cursor = p + n;
+			return p;
+		}
+		p++;
+		scanned++;
+	}
+
+	return UINT64_MAX;
+}
+
+static void defer_free(uint64_t e)
+{
+	if (pending_free.len == pending_free.cap) {
+		pending_free.cap = pending_free.cap ? pending_free.cap * 2 : 1024;
+		pending_free.ppn = realloc(pending_free.ppn,
+					   pending_free.cap * sizeof(uint64_t));
+		pending_free.nr = realloc(pending_free.nr,
+					  pending_free.cap * sizeof(unsigned int));
+		if (!pending_free.ppn || !pending_free.nr) {
+			perror("compress: failed to grow free list");
+			exit(1);
+		}
+	}
+
+	pending_free.ppn[pending_free.len] = E_PPN(e);
+	pending_free.nr[pending_free.len] = E_PAGES(e);
+	pending_free.len++;
+}
+
+static void set_entry(uint64_t chunk, uint64_t e)
+{
+	uint64_t old = map[chunk];
+
+	if (old & E_MAPPED) {
+		cstats.mapped--;
+		cstats.stored -= E_PAGES(old);
+		if (old & E_RAW)
+			cstats.raw--;
+		defer_free(old);
+	}
+	if (e & E_MAPPED) {
+		cstats.mapped++;
+		cstats.stored += E_PAGES(e);
+		if (e & E_RAW)
+			cstats.raw++;
+	}
+
+	map[chunk] = e;
+	meta_dirty(&meta, CMAP_HDR_SIZE + chunk * sizeof(uint64_t));
+}
+
+/* Request handling */
+
+// The map covers the disksize seen at startup, not a disk grown since
+static bool in_map(uint64_t lpn, uint64_t nr)
+{
+	if (likely(lpn + nr <= hdr->nr_chunks * COMPRESS_PAGES_PER_CHUNK))
+		return true;
+
+	fprintf(stderr, "compress: pages %lu-%lu past the map\n", lpn, lpn + nr - 1);
+	return false;
+}
+
+static int build_jobs(uint64_t lpn, char *buf, unsigned int nr)
+{
+	struct cjob *job;
+	int n = 0;
+
+	while (nr) {
+		job = jobs + n++;
+		job->chunk = lpn / COMPRESS_PAGES_PER_CHUNK;
+		job->off = lpn % COMPRESS_PAGES_PER_CHUNK;
+		job->nr = COMPRESS_PAGES_PER_CHUNK - job->off;
+		if (job->nr > nr)
+			job->nr = nr;
+		job->data = buf;
+		job->old = map[job->chunk];
+		job->clen = -1;
+
+		lpn += job->nr;
+		nr -= job->nr;
+		if (buf)
+			buf += job->nr * PAGE_SIZE;
+	}
+
+	return n;
+}
+
+static bool chunk_is_zero(const char *src)
+{
+#ifdef ZERO_DETECT
+	int i;
+
+	for (i = 0; i < COMPRESS_PAGES_PER_CHUNK; i++) {
+		if (!page_is_zero(src + i * PAGE_SIZE))
+			return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+static void compress_job(struct cjob *job)
+{
+	int len;
+
+	if (job->nr < COMPRESS_PAGES_PER_CHUNK) {
+		// Merge the request into what is already stored
+		if (!(job->old & E_MAPPED)) {
+			memset(job->raw, 0, COMPRESS_CHUNK_SIZE);
+		} else if (!(job->old & E_RAW)) {
+			len = codec_decompress(job->out, job->raw, E_LEN(job->old));
+			if (unlikely(len != COMPRESS_CHUNK_SIZE)) {
+				fprintf(stderr, "compress: chunk %lu is corrupted\n",
+					job->chunk);
+				memset(job->raw, 0, COMPRESS_CHUNK_SIZE);
+			}
+		}
+
+		if (job->data)
+			memcpy(job->raw + job->off * PAGE_SIZE, job->data,
+			       job->nr * PAGE_SIZE);
+		else
+			memset(job->raw + job->off * PAGE_SIZE, 0,
+			       job->nr * PAGE_SIZE);
+		job->src = job->raw;
+	} else if (!job->data) {
+		job->clen = -1;
+		return;
+	} else {
+		job->src = job->data;
+	}
+
+	if (chunk_is_zero(job->src)) {
+		job->clen = -1;
+		return;
+	}
+
+	// Anything not saving at least a page is stored as-is
+	job->clen = codec_compress(job->src, job->out,
+				   COMPRESS_CHUNK_SIZE - PAGE_SIZE);
+	if (job->clen > 0 && job->clen % PAGE_SIZE)
+		memset(job->out + job->clen, 0, PAGE_SIZE - job->clen % PAGE_SIZE);
+}
+
+static void decompress_job(struct cjob *job)
+{
+	char *dst;
+	int len;
+
+	if (job->clen <= 0)
+		return;
+
+	dst = job->nr == COMPRESS_PAGES_PER_CHUNK ? job->data : job->raw;
+	len = codec_decompress(job->out, dst, job->clen);
+	if (unlikely(len != COMPRESS_CHUNK_SIZE)) {
+		fprintf(stderr, "compress: chunk %lu is corrupted\n", job->chunk);
+		memset(dst, 0, COMPRESS_CHUNK_SIZE);
+	}
+
+	if (dst != job->data)
+		memcpy(job->data, job->raw + job->off * PAGE_SIZE,
+		       job->nr * PAGE_SIZE);
+}
+
+static void store_job(struct cjob *job)
+{
+	uint64_t p, e;
+	unsigned int n;
+	const char *src;
+
+	if (job->clen < 0) {
+		if (job->data)
+			cstats.zero++;
+		set_entry(job->chunk, 0);
+		return;
+	}
+
+	if (job->clen == 0) {
+		n = COMPRESS_PAGES_PER_CHUNK;
+		src = job->src;
+		e = E_MAPPED | E_RAW | ((uint64_t)COMPRESS_CHUNK_SIZE << E_LEN_SHIFT);
+		cstats.bypass++;
+	} else {
+		n = (job->clen + PAGE_SIZE - 1) / PAGE_SIZE;
+		src = job->out;
+		e = E_MAPPED | ((uint64_t)job->clen << E_LEN_SHIFT);
+	}
+
+	p = alloc_extent(n);
+	if (unlikely(p == UINT64_MAX)) {
+		fprintf(stderr, "compress: out of backend space, chunk %lu lost\n",
+			job->chunk);
+		return;
+	}
+
+	phys_write(p, src, n);
+	set_entry(job->chunk, e | p);
+	cstats.bytes_out += n * PAGE_SIZE;
+}
+
+void compress_write(uint64_t lpn, char *buf, unsigned int nr)
+{
+	struct cjob *job;
+	int i, n;
+
+	if (unlikely(!in_map(lpn, nr)))
+		return;
+
+	n = build_jobs(lpn, buf, nr);
+
+	// Partially written chunks need their old contents
+	for (i = 0; i < n; i++) {
+		job = jobs + i;
+		if (job->nr == COMPRESS_PAGES_PER_CHUNK || !(job->old & E_MAPPED))
+			continue;
+		if (job->old & E_RAW)
+			phys_read(E_PPN(job->old), job->raw, COMPRESS_PAGES_PER_CHUNK);
+		else
+			phys_read(E_PPN(job->old), job->out, E_PAGES(job->old));
+	}
+
+	run_jobs(compress_job, n);
+
+	for (i = 0; i < n; i++)
+		store_job(jobs + i);
+
+	if (buf)
+		cstats.bytes_in += nr * PAGE_SIZE;
+}
+
+void compress_discard(uint64_t lpn, uint64_t nr)
+{
+	uint64_t nr_pages = hdr->nr_chunks * COMPRESS_PAGES_PER_CHUNK;
+	unsigned int n;
+
+	if (lpn >= nr_pages)
+		return;
+	if (nr > nr_pages - lpn)
+		nr = nr_pages - lpn;
+
+	for (; nr; lpn += n, nr -= n) {
+		n = nr > MAX_REQ_PAGES ? MAX_REQ_PAGES : nr;
+		compress_write(lpn, NULL, n);
+	}
+}
+
+void compress_read(uint64_t lpn, char *buf, unsigned int nr)
+{
+	struct cjob *job;
+	uint64_t e;
+	int i, n;
+
+	if (unlikely(!in_map(lpn, nr))) {
+		memset(buf, 0, nr * PAGE_SIZE);
+		return;
+	}
+
+	n = build_jobs(lpn, buf, nr);
+
+	for (i = 0; i < n; i++) {
+		job = jobs + i;
+		e = job->old;
+
+		if (!(e & E_MAPPED))
+			memset(job->data, 0, job->nr * PAGE_SIZE);
+		else if (e & E_RAW)
+			phys_read(E_PPN(e) + job->off, job->data, job->nr);
+		else {
+			phys_read(E_PPN(e), job->out, E_PAGES(e));
+			job->clen = E_LEN(e);
+		}
+	}
+
+	run_jobs(decompress_job, n);
+}
+
+// Old extents become reusable once the map no longer points at them
+void compress_flush(void)
+{
+	size_t i;
+
+	meta_flush(&meta);
+
+	for (i = 0; i < pending_free.len; i++)
+		mark_space(pending_free.ppn[i], pending_free.nr[i], false);
+	pending_free.len = 0;
+}
+
+void compress_stats(void)
+{
+	uint64_t logical = cstats.mapped * COMPRESS_CHUNK_SIZE;
+	uint64_t stored = cstats.stored * PAGE_SIZE;
+
+	printf("compress: %lu chunks mapped, %lu stored raw, ", cstats.mapped, cstats.raw);
+	printf("%s logical, ", humanSize(logical));
+	printf("%s stored, ratio %.2f\n", humanSize(stored),
+	       stored ? (double)logical / stored : 1.0);
+	printf("compress: %lu incompressible writes, ", cstats.bypass);
+	printf("%s written, ", humanSize(cstats.bytes_in));
+	printf("%s sent to backends\n", humanSize(cstats.bytes_out));
+#ifdef ZERO_DETECT
+	printf("compress: %lu all-zero chunks unmapped\n", cstats.zero);
+#endif
+}
+
+int compress_init(const char *path, uint64_t disksize, uint64_t physsize)
+{
+	uint64_t nr_chunks, i, e;
+	bool fresh;
+	int ret;
+
+	if (!disksize) {
+		fprintf(stderr, "compress: no disksize set for %s\n", CHEEDON_DISKSIZE_PATH);
+		return -EINVAL;
+	}
+
+	nr_chunks = (disksize + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+	nr_phys = physsize / PAGE_SIZE;
+	if (nr_phys > E_PPN_MASK)
+		nr_phys = E_PPN_MASK;
+
+	ret = meta_open(&meta, path, CMAP_HDR_SIZE + nr_chunks * sizeof(uint64_t), &fresh);
+	if (ret)
+		return ret;
+
+	hdr = (struct cmap_hdr *)meta.map;
+	map = (uint64_t *)(meta.map + CMAP_HDR_SIZE);
+
+	if (fresh || hdr->magic != CMAP_MAGIC) {
+		memset(meta.map, 0, meta.len);
+		hdr->magic = CMAP_MAGIC;
+		hdr->version = CMAP_VERSION;
+		hdr->chunk_size = COMPRESS_CHUNK_SIZE;
+	} else if (hdr->version != CMAP_VERSION || hdr->chunk_size != COMPRESS_CHUNK_SIZE) {
+		fprintf(stderr, "%s: chunk size mismatch: %u vs %u, refusing to reuse\n",
+			path, hdr->chunk_size, COMPRESS_CHUNK_SIZE);
+		meta_close(&meta);
+		return -EINVAL;
+	}
+	if (nr_chunks > hdr->nr_chunks)
+		hdr->nr_chunks = nr_chunks;
+	meta_flush_all(&meta);
+
+	// The allocator state is rebuilt from the map instead of being stored
+	memset(&cstats, 0, sizeof(cstats));
+	space = calloc((nr_phys + 63) / 64, sizeof(uint64_t));
+	if (!space)
+		goto nomem;
+	for (i = 0; i < hdr->nr_chunks; i++) {
+		e = map[i];
+		if (!(e & E_MAPPED))
+			continue;
+		if (E_PPN(e) + E_PAGES(e) > nr_phys) {
+			fprintf(stderr, "compress: chunk %lu is beyond the backends\n", i);
+			continue;
+		}
+		mark_space(E_PPN(e), E_PAGES(e), true);
+		cstats.mapped++;
+		cstats.stored += E_PAGES(e);
+		if (e & E_RAW)
+			cstats.raw++;
+	}
+
+	for (i = 0; i < MAX_JOBS; i++) {
+		jobs[i].raw = aligned_alloc(PAGE_SIZE, COMPRESS_CHUNK_SIZE);
+		jobs[i].out = aligned_alloc(PAGE_SIZE, COMPRESS_CHUNK_SIZE);
+		if (!jobs[i].raw || !jobs[i].out)
+			goto nomem;
+	}
+
+	pool.nr_threads = COMPRESS_THREADS;
+	if (pool.nr_threads < 0)
+		pool.nr_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (pool.nr_threads > 0) {
+		pool.threads = calloc(pool.nr_threads, sizeof(pthread_t));
+		if (!pool.threads)
+			goto nomem;
+	}
+	for (i = 0; i < (uint64_t)pool.nr_threads; i++) {
+		if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL)) {
+			perror("compress: failed to start worker");
+			pool.nr_threads = i;
+			break;
+		}
+	}
+
+	printf("compress: %dK chunks, %d threads, ", COMPRESS_K, pool.nr_threads + 1);
+	printf("%s of backend space\n", humanSize(nr_phys * PAGE_SIZE));
+
+	return 0;
+
+nomem:
+	fprintf(stderr, "compress: out of memory\n");
+	meta_close(&meta);
+	return -ENOMEM;
+}
+
+void compress_exit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < pool.nr_threads; i++)
+		pthread_join(pool.threads[i], NULL);
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.stop = false;
+
+	compress_flush();
+	meta_close(&meta);
+
+	for (i = 0; i < MAX_JOBS; i++) {
+		free(jobs[i].raw);
+		free(jobs[i].out);
+	}
+	free(space);
+}
+
+#endif
@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Per-page checksums
+ *
+ * Every logical page written gets a 32 bit checksum, kept in a metadata
+ * file next to the other maps. A request's checksums are computed in one
+ * pass and land in the same pages of the mapping, which are written back
+ * with the rest of the metadata. Reads verify CSUM_VERIFY_PCT percent of
+ * their pages and report mismatches, the data is still passed on as is.
+ *
+ * CRC32C uses the SSE4.2 crc32 instruction on three interleaved streams
+ * per page where the CPU has it. With -DCSUM_XXH3 -lxxhash, the low half
+ * of XXH3 is stored instead.
+ *
+ * Pages never written or discarded since have no checksum. Checksums are
+ * only as durable as the metadata, so right after a crash a mismatch can
+ * also be a page whose write and checksum were torn apart.
+ */
+
+#ifdef CSUM
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef CSUM_XXH3
+#include <xxhash.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "user.h"
+
+#define CSUM_MAGIC	0x4d53434445454843ULL	// "CHEEDCSM"
+#define CSUM_VERSION	1
+#define CSUM_HDR_SIZE	PAGE_SIZE
+
+#define CSUM_CRC32C	1
+#define CSUM_XXH3_LOW	2
+
+#ifdef CSUM_XXH3
+#define CSUM_ALGO	CSUM_XXH3_LOW
+#else
+#define CSUM_ALGO	CSUM_CRC32C
+#endif
+
+// Mismatches printed before only counting them
+#define CSUM_MAX_REPORTS 32
+
+struct csum_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t algo;
+	uint64_t nr_pages;
+};
+
+static struct meta meta;
+static struct csum_hdr *hdr;
+static uint32_t *sums;
+static const struct csum_impl *impl;
+static uint64_t rnd = 0x9e3779b97f4a7c15ULL;
+
+static struct {
+	uint64_t written, verified, mismatches;
+} cstats;
+
+#ifndef CSUM_XXH3
+// Castagnoli, reflected
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_tab[8][256];
+
+// Slicing by 8, for CPUs without the instruction
+static uint32_t crc32c_generic(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t v;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = crc_tab[7][v & 0xff] ^ crc_tab[6][(v >> 8) & 0xff] ^
+		      crc_tab[5][(v >> 16) & 0xff] ^ crc_tab[4][(v >> 24) & 0xff] ^
+		      crc_tab[3][(v >> 32) & 0xff] ^ crc_tab[2][(v >> 40) & 0xff] ^
+		      crc_tab[1][(v >> 48) & 0xff] ^ crc_tab[0][v >> 56];
+	}
+	while (len--)
+		crc = crc_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static uint32_t page_crc32c_generic(const void *page)
+{
+	return ~crc32c_generic(~0U, page, PAGE_SIZE);
+}
+
+#if defined(__x86_64__)
+/*
+ * The instruction takes 3 cycles but issues every cycle, so a page is
+ * split in three lanes summed at once. Each lane's CRC is then shifted
+ * over the ones after it, by multiplying with x^(8 * LANE) through a table.
+ */
+#define LANE		(PAGE_SIZE / 24 * 8)
+
+static uint32_t shift_tab[4][256];
+
+static inline uint32_t crc_shift(uint32_t crc)
+{
+	return shift_tab[0][crc & 0xff] ^ shift_tab[1][(crc >> 8) & 0xff] ^
+	       shift_tab[2][(crc >> 16) & 0xff] ^ shift_tab[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t page_crc32c_sse42(const void *page)
+{
+	const uint64_t *a = page, *b = a + LANE / 8, *c = b + LANE / 8;
+	uint64_t ca = ~0U, cb = 0, cc = 0;
+	unsigned int i;
+
+	for (i = 0; i < LANE / 8; i++) {
+		ca = _mm_crc32_u64(ca, a[i]);
+		cb = _mm_crc32_u64(cb, b[i]);
+		cc = _mm_crc32_u64(cc, c[i]);
+	}
+	ca = crc_shift(ca) ^ cb;
+	ca = crc_shift(ca) ^ cc;
+
+	for (i = 3 * LANE / 8; i < PAGE_SIZE / 8; i++)
+		ca = _mm_crc32_u64(ca, a[i]);
+
+	return ~(uint32_t)ca;
+}
+
+static bool have_sse42(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+static void crc_tables(void)
+{
+	uint32_t crc, bit[32];
+	int i, j, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc_tab[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++)
+			crc_tab[j][i] = crc_tab[0][crc_tab[j - 1][i] & 0xff] ^ (crc_tab[j - 1][i] >> 8);
+	}
+
+#if defined(__x86_64__)
+	// Shifting is linear, so a table per byte of the CRC does
+	for (k = 0; k < 32; k++) {
+		crc = 1U << k;
+		for (i = 0; i < LANE; i++)
+			crc = crc_tab[0][crc & 0xff] ^ (crc >> 8);
+		bit[k] = crc;
+	}
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < 256; i++) {
+			crc = 0;
+			for (k = 0; k < 8; k++) {
+				if (i & (1 << k))
+					crc ^= bit[j * 8 + k];
+			}
+			shift_tab[j][i] = crc;
+		}
+	}
+#else
+	(void)bit;
+	(void)k;
+#endif
+}
+#else
+static uint32_t page_xxh3(const void *page)
+{
+	return (uint32_t)XXH3_64bits(page, PAGE_SIZE);
+}
+#endif
+
+static bool always(void)
+{
+	return true;
+}
+
+// Preferred first, the last one runs anywhere
+const struct csum_impl csum_impls[] = {
+#ifdef CSUM_XXH3
+	{ "xxh3", page_xxh3, always },
+#else
+#if defined(__x86_64__)
+	{ "crc32c-sse4.2", page_crc32c_sse42, have_sse42 },
+#endif
+	{ "crc32c-generic", page_crc32c_generic, always },
+#endif
+	{ NULL, NULL, NULL },
+};
+
+// Picks the fastest variant, without any metadata
+const struct csum_impl *csum_setup(void)
+{
+	const struct csum_impl *i;
+
+#ifndef CSUM_XXH3
+	crc_tables();
+#endif
+	for (i = csum_impls; !i->usable(); i++)
+		;
+	impl = i;
+
+	return impl;
+}
+
+// 0 is for pages without one
+static inline uint32_t page_sum(const void *page)
+{
+	uint32_t sum = impl->page(page);
+
+	return sum ? sum : 1;
+}
+
+int csum_init(const char *path, uint64_t disksize)
+{
+	uint64_t nr_pages = disksize / PAGE_SIZE;
+	bool fresh;
+	int ret;
+
+	csum_setup();
+	memset(&cstats, 0, sizeof(cstats));
+
+	ret = meta_open(&meta, path, CSUM_HDR_SIZE + nr_pages * sizeof(uint32_t), &fresh);
+	if (ret)
+		return ret;
+
+	hdr = (struct csum_hdr *)meta.map;
+	sums = (uint32_t *)(meta.map + CSUM_HDR_SIZE);
+
+	if (fresh || hdr->magic != CSUM_MAGIC) {
+		memset(meta.map, 0, meta.len);
+		hdr->magic = CSUM_MAGIC;
+		hdr->version = CSUM_VERSION;
+		hdr->algo = CSUM_ALGO;
+	} else if (hdr->version != CSUM_VERSION || hdr->algo != CSUM_ALGO) {
+		fprintf(stderr, "%s: checksums of another kind, refusing to reuse\n", path);
+		meta_close(&meta);
+		return -EINVAL;
+	}
+	// Growing the disk only appends pages without checksums
+	hdr->nr_pages = nr_pages;
+	meta_flush_all(&meta);
+
+	printf("csum: %s over %lu pages, verifying %d%% of reads\n",
+	       impl->name, nr_pages, CSUM_VERIFY_PCT);
+
+	return 0;
+}
+
+void csum_exit(void)
+{
+	meta_close(&meta);
+}
+
+void csum_write(uint64_t lpn, const char *buf, unsigned int nr)
+{
+	unsigned int i;
+
+	if (unlikely(lpn + nr > hdr->nr_pages))
+		return;
+
+	for (i = 0; i < nr; i++)
+		sums[lpn + i] = page_sum(buf + (size_t)i * PAGE_SIZE);
+	cstats.written += nr;
+
+	// Pages of the mapping covered by the request, usually just one
+	for (i = 0; i < nr; i += PAGE_SIZE / sizeof(uint32_t))
+		meta_dirty(&meta, CSUM_HDR_SIZE + (lpn + i) * sizeof(uint32_t));
+	meta_dirty(&meta, CSUM_HDR_SIZE + (lpn + nr - 1) * sizeof(uint32_t));
+}
+
+static inline bool sampled(void)
+{
+#if CSUM_VERIFY_PCT >= 100
+	return true;
+#else
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+
+	return rnd % 100 < CSUM_VERIFY_PCT;
+#endif
+}
+
+void csum_verify(uint64_t lpn, const char *buf, unsigned int nr)
+{
+	uint32_t sum;
+	unsigned int i;
+
+	if (unlikely(lpn + nr > hdr->nr_pages))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		if (!sums[lpn + i] || !sampled())
+			continue;
+
+		sum = page_sum(buf + (size_t)i * PAGE_SIZE);
+		cstats.verified++;
+		if (likely(sum == sums[lpn + i]))
+			continue;
+
+		if (cstats.mismatches++ < CSUM_MAX_REPORTS)
+			fprintf(stderr, "csum: page %lu reads %08x, written as %08x\n",
+				lpn + i, sum, sums[lpn + i]);
+	}
+}
+
+void csum_discard(uint64_t lpn, uint64_t nr)
+{
+	uint64_t i;
+
+	if (lpn >= hdr->nr_pages)
+		return;
+	if (nr > hdr->nr_pages - lpn)
+		nr = hdr->nr_pages - lpn;
+
+	for (i = 0; i < nr; i++) {
+		if (!sums[lpn + i])
+			continue;
+		sums[lpn + i] = 0;
+		meta_dirty(&meta, CSUM_HDR_SIZE + (lpn + i) * sizeof(uint32_t));
+	}
+}
+
+void csum_flush(void)
+{
+	meta_flush(&meta);
+}
+
+void csum_stats(void)
+{
+	printf("csum: %s, %lu pages written, %lu verified, %lu mismatches\n",
+	       impl->name, cstats.written, cstats.verified, cstats.mismatches);
+}
+
+#endif
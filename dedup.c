@@ -0,0 +1,589 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Inline deduplication
+ *
+ * Every logical page maps to a backend page through a persistent map, and
+ * backend pages are reference counted. Written pages are hashed with XXH3
+ * and looked up in an in-memory open-addressing fingerprint index; a hit
+ * only bumps the reference count of the existing page.
+ *
+ * Index entries keep 96 bits of the 128-bit hash. XXH3 is no cryptographic
+ * hash and colliding pages can be crafted, so a hit is read back and
+ * compared before it is shared; a mismatch is stored as a new page.
+ *
+ * DEDUP_INDEX_MB bounds all of the memory: the reference count, index
+ * back-pointer and allocation bit of every backend page come first, the
+ * index gets the rest. It simply forgets the oldest entry of a full probe
+ * window, which only costs dedup opportunities, never correctness.
+ *
+ * Reference counts are rebuilt from the map at startup. The index is saved
+ * on a clean exit and dropped after a crash.
+ *
+ * Build with -DDEDUP -lxxhash.
+ */
+
+#ifdef DEDUP
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <xxhash.h>
+
+#include "user.h"
+
+#define DMAP_MAGIC	0x5044454445454843ULL	// "CHEEDEDP"
+#define DIDX_MAGIC	0x5844494445454843ULL	// "CHEEDIDX"
+#define DMAP_VERSION	1
+#define DMAP_HDR_SIZE	PAGE_SIZE
+
+// Slots looked at for a single fingerprint, 4 cache lines
+#define DEDUP_PROBE	16
+
+#define SLOT_EMPTY	0
+#define SLOT_TOMB	UINT32_MAX
+
+struct dmap_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t pad;
+	uint64_t nr_pages;
+};
+
+struct fp_entry {
+	uint64_t tag;		// high half of the hash
+	uint32_t tag2;		// low 32 bits of the low half, the rest picks the bucket
+	uint32_t ppn;		// backend page + 1, or SLOT_*
+};
+
+struct didx_hdr {
+	uint64_t magic;
+	uint64_t nr_slots;
+	uint64_t nr_phys;
+};
+
+static struct meta meta;
+static struct dmap_hdr *hdr;
+static uint32_t *map;		// backend page + 1, 0 for unmapped
+
+static struct fp_entry *fpidx;
+static uint64_t index_mask;
+
+static uint32_t *refcount;
+static uint32_t *backptr;	// index slot of each backend page
+static uint64_t *space;		// allocated or waiting to be freed
+static uint64_t *dropped;	// lost a reference since the last flush
+static uint64_t nr_phys, cursor;
+
+static struct {
+	uint32_t *ppn;
+	size_t len, cap;
+} pending_free;
+
+// Backend pages being written out, merged while contiguous
+static struct {
+	uint64_t ppn;
+	const char *buf;
+	unsigned int nr;
+} run;
+
+static struct {
+	uint64_t written;	// pages written
+	uint64_t dups;		// pages turned into a reference
+	uint64_t zero;		// all-zero pages unmapped
+	uint64_t inplace;	// unshared pages overwritten in place
+	uint64_t used;		// backend pages referenced
+	uint64_t indexed;	// live index entries
+	uint64_t evicted;	// index entries forgotten for lack of room
+	uint64_t collisions;	// hits on different data
+} dstats;
+
+static char *vbuf;		// a hit read back
+
+/* Fingerprint index */
+
+static inline uint64_t bucket(const XXH128_hash_t *h)
+{
+	return (h->low64 >> 32) & index_mask;
+}
+
+// Returns the backend page holding the same data, or UINT64_MAX
+static uint64_t index_lookup(const XXH128_hash_t *h)
+{
+	uint64_t s = bucket(h);
+	struct fp_entry *e;
+	int i;
+
+	for (i = 0; i < DEDUP_PROBE; i++, s = (s + 1) & index_mask) {
+		e = fpidx + s;
+		if (e->ppn == SLOT_EMPTY)
+			break;
+		if (e->ppn != SLOT_TOMB && e->tag == h->high64 && e->tag2 == (uint32_t)h->low64)
+			return e->ppn - 1;
+	}
+
+	return UINT64_MAX;
+}
+
+static void index_insert(const XXH128_hash_t *h, uint64_t ppn)
+{
+	uint64_t s = bucket(h), first = s;
+	struct fp_entry *e;
+	int i;
+
+	for (i = 0; i < DEDUP_PROBE; i++, s = (s + 1) & index_mask) {
+		e = fpidx + s;
+		if (e->ppn == SLOT_EMPTY || e->ppn == SLOT_TOMB)
+			goto found;
+	}
+
+	// Window is full, forget the entry at the home slot
+	s = first;
+	e = fpidx + s;
+	dstats.evicted++;
+	dstats.indexed--;
+
+found:
+	e->tag = h->high64;
+	e->tag2 = (uint32_t)h->low64;
+	e->ppn = ppn + 1;
+	backptr[ppn] = s;
+	dstats.indexed++;
+}
+
+static void index_remove(uint64_t ppn)
+{
+	struct fp_entry *e = fpidx + backptr[ppn];
+
+	if (e->ppn == ppn + 1) {
+		e->ppn = SLOT_TOMB;
+		dstats.indexed--;
+	}
+}
+
+/* Backend pages */
+
+static uint64_t alloc_page(void)
+{
+	uint64_t p = cursor, scanned;
+
+	for (scanned = 0; scanned < nr_phys; scanned++, p++) {
+		if (p >= nr_phys)
+			p = 0;
+		if (p % 64 == 0 && p + 64 <= nr_phys && space[p / 64] == ~0ULL) {
+			p += 63;
+			scanned += 63;
+			continue;
+		}
+		if (!(space[p / 64] & (1ULL << (p % 64)))) {
+			space[p / 64] |= 1ULL << (p % 64);
+			cursor = p + 1;
+			return p;
+		}
+	}
+
+	return UINT64_MAX;
+}
+
+static void put_page(uint64_t ppn)
+{
+	dropped[ppn / 64] |= 1ULL << (ppn % 64);
+	if (--refcount[ppn])
+		return;
+
+	index_remove(ppn);
+	dstats.used--;
+
+	// Reusable once the map pointing away from it is on disk
+	if (pending_free.len == pending_free.cap) {
+		pending_free.cap = pending_free.cap ? pending_free.cap * 2 : 4096;
+		pending_free.ppn = realloc(pending_free.ppn,
+					   pending_free.cap * sizeof(uint32_t));
+		if (!pending_free.ppn) {
+			perror("dedup: failed to grow free list");
+			exit(1);
+		}
+	}
+	pending_free.ppn[pending_free.len++] = ppn;
+}
+
+static void set_map(uint64_t lpn, uint32_t e)
+{
+	map[lpn] = e;
+	meta_dirty(&meta, DMAP_HDR_SIZE + lpn * sizeof(uint32_t));
+}
+
+static void run_flush(void)
+{
+	if (!run.nr)
+		return;
+
+	phys_write(run.ppn, run.buf, run.nr);
+	run.nr = 0;
+}
+
+static void run_add(uint64_t ppn, const char *buf)
+{
+	if (run.nr && run.ppn + run.nr == ppn && run.buf + run.nr * PAGE_SIZE == buf) {
+		run.nr++;
+		return;
+	}
+
+	run_flush();
+	run.ppn = ppn;
+	run.buf = buf;
+	run.nr = 1;
+}
+
+/* Request handling */
+
+// Whether backend page ppn holds buf, maybe still waiting in the run
+static bool same_page(uint64_t ppn, const char *buf)
+{
+	const char *data = vbuf;
+
+	if (run.nr && ppn >= run.ppn && ppn < run.ppn + run.nr)
+		data = run.buf + (ppn - run.ppn) * PAGE_SIZE;
+	else
+		phys_read(ppn, vbuf, 1);
+
+	return !memcmp(data, buf, PAGE_SIZE);
+}
+
+static void dedup_write_page(uint64_t lpn, const char *buf)
+{
+	XXH128_hash_t h;
+	uint64_t old, hit, p;
+
+	old = map[lpn] ? map[lpn] - 1 : UINT64_MAX;
+	dstats.written++;
+
+#ifdef ZERO_DETECT
+	if (page_is_zero(buf)) {
+		dstats.zero++;
+		if (old != UINT64_MAX) {
+			set_map(lpn, 0);
+			put_page(old);
+		}
+		return;
+	}
+#endif
+
+	h = XXH3_128bits(buf, PAGE_SIZE);
+	hit = index_lookup(&h);
+	if (hit != UINT64_MAX && !same_page(hit, buf)) {
+		dstats.collisions++;
+		hit = UINT64_MAX;
+	}
+
+	if (hit != UINT64_MAX && refcount[hit] < UINT32_MAX) {
+		dstats.dups++;
+		if (hit == old)
+			return;
+
+		refcount[hit]++;
+		set_map(lpn, hit + 1);
+		if (old != UINT64_MAX)
+			put_page(old);
+		return;
+	}
+
+	/*
+	 * Nobody else sees the old page, so it can be reused as-is. Unless a
+	 * reference went away only in memory, the map on disk still has it.
+	 */
+	if (old != UINT64_MAX && refcount[old] == 1 &&
+	    !(dropped[old / 64] & (1ULL << (old % 64)))) {
+		index_remove(old);
+		run_add(old, buf);
+		index_insert(&h, old);
+		dstats.inplace++;
+		return;
+	}
+
+	p = alloc_page();
+	if (unlikely(p == UINT64_MAX)) {
+		fprintf(stderr, "dedup: out of backend space, page %lu lost\n", lpn);
+		return;
+	}
+
+	run_add(p, buf);
+	refcount[p] = 1;
+	dstats.used++;
+	index_insert(&h, p);
+	set_map(lpn, p + 1);
+	if (old != UINT64_MAX)
+		put_page(old);
+}
+
+void dedup_write(uint64_t lpn, const char *buf, unsigned int nr)
+{
+	unsigned int i;
+
+	// The map covers the disksize seen at startup, not a disk grown since
+	if (unlikely(lpn + nr > hdr->nr_pages)) {
+		fprintf(stderr, "dedup: pages %lu-%lu past the map\n", lpn, lpn + nr - 1);
+		return;
+	}
+
+	for (i = 0; i < nr; i++)
+		dedup_write_page(lpn + i, buf + i * PAGE_SIZE);
+	run_flush();
+}
+
+void dedup_read(uint64_t lpn, char *buf, unsigned int nr)
+{
+	unsigned int i, n;
+	uint32_t e;
+
+	if (unlikely(lpn + nr > hdr->nr_pages)) {
+		memset(buf, 0, nr * PAGE_SIZE);
+		return;
+	}
+
+	for (i = 0; i < nr; i += n) {
+		e = map[lpn + i];
+		if (!e) {
+			memset(buf + i * PAGE_SIZE, 0, PAGE_SIZE);
+			n = 1;
+			continue;
+		}
+
+		for (n = 1; i + n < nr && map[lpn + i + n] == e + n; n++)
+			;
+		phys_read(e - 1, buf + i * PAGE_SIZE, n);
+	}
+}
+
+void dedup_discard(uint64_t lpn, uint64_t nr)
+{
+	uint32_t e;
+
+	if (lpn >= hdr->nr_pages)
+		return;
+	if (nr > hdr->nr_pages - lpn)
+		nr = hdr->nr_pages - lpn;
+
+	for (; nr; lpn++, nr--) {
+		e = map[lpn];
+		if (!e)
+			continue;
+		set_map(lpn, 0);
+		put_page(e - 1);
+	}
+}
+
+void dedup_flush(void)
+{
+	size_t i;
+	uint32_t p;
+
+	meta_flush(&meta);
+	memset(dropped, 0, (nr_phys + 63) / 64 * sizeof(uint64_t));
+
+	for (i = 0; i < pending_free.len; i++) {
+		p = pending_free.ppn[i];
+		space[p / 64] &= ~(1ULL << (p % 64));
+	}
+	pending_free.len = 0;
+}
+
+uint64_t dedup_memory(void)
+{
+	return (index_mask + 1) * sizeof(struct fp_entry) +
+	       nr_phys * (sizeof(*refcount) + sizeof(*backptr)) +
+	       (nr_phys + 63) / 64 * 2 * sizeof(uint64_t);
+}
+
+void dedup_stats(void)
+{
+	uint64_t mem = dedup_memory();
+	double tb = (double)nr_phys * PAGE_SIZE / (1ULL << 40);
+
+	printf("dedup: %lu pages written, %lu duplicates, ", dstats.written, dstats.dups);
+	printf("%s saved, ", humanSize(dstats.dups * PAGE_SIZE));
+	printf("%lu in place, %lu zero, ", dstats.inplace, dstats.zero);
+	printf("%lu collisions\n", dstats.collisions);
+	printf("dedup: %s referenced, ", humanSize(dstats.used * PAGE_SIZE));
+	printf("%lu/%lu index entries, %lu evicted\n",
+	       dstats.indexed, index_mask + 1, dstats.evicted);
+	printf("dedup: %s in memory, ", humanSize(mem));
+	printf("%s per TiB of backend\n", humanSize(tb > 0 ? mem / tb : 0));
+}
+
+/* Index persistence across clean restarts */
+
+static void index_save(const char *path)
+{
+	struct didx_hdr h = {
+		.magic = DIDX_MAGIC,
+		.nr_slots = index_mask + 1,
+		.nr_phys = nr_phys,
+	};
+	size_t len = (index_mask + 1) * sizeof(struct fp_entry);
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror(path);
+		return;
+	}
+	if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+	    write(fd, fpidx, len) != (ssize_t)len) {
+		perror(path);
+		close(fd);
+		unlink(path);
+		return;
+	}
+	fsync(fd);
+	close(fd);
+}
+
+// The saved index is only trusted once, it goes stale as soon as we write
+static void index_load(const char *path)
+{
+	struct didx_hdr h;
+	size_t len = (index_mask + 1) * sizeof(struct fp_entry);
+	uint64_t s, p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	unlink(path);
+
+	if (read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != DIDX_MAGIC ||
+	    h.nr_slots != index_mask + 1 || h.nr_phys != nr_phys ||
+	    read(fd, fpidx, len) != (ssize_t)len) {
+		fprintf(stderr, "dedup: ignoring stale index %s\n", path);
+		memset(fpidx, 0, len);
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	for (s = 0; s <= index_mask; s++) {
+		if (fpidx[s].ppn == SLOT_EMPTY || fpidx[s].ppn == SLOT_TOMB)
+			continue;
+		p = fpidx[s].ppn - 1;
+		if (p >= nr_phys || !refcount[p]) {
+			fpidx[s].ppn = SLOT_TOMB;
+			continue;
+		}
+		backptr[p] = s;
+		dstats.indexed++;
+	}
+}
+
+int dedup_init(const char *path, uint64_t disksize, uint64_t physsize)
+{
+	uint64_t nr_pages, nr_slots, i, p, budget, fixed;
+	bool fresh;
+	int ret;
+
+	if (disksize < PAGE_SIZE) {
+		fprintf(stderr, "dedup: no disksize set for %s\n", CHEEDON_DISKSIZE_PATH);
+		return -EINVAL;
+	}
+
+	nr_pages = disksize / PAGE_SIZE;
+	nr_phys = physsize / PAGE_SIZE;
+	if (nr_phys >= UINT32_MAX)
+		nr_phys = UINT32_MAX - 1;
+
+	budget = DEDUP_INDEX_MB * 1024ULL * 1024;
+	fixed = nr_phys * (sizeof(*refcount) + sizeof(*backptr)) +
+		(nr_phys + 63) / 64 * 2 * sizeof(uint64_t);
+	if (fixed + 1024 * sizeof(struct fp_entry) > budget) {
+		fprintf(stderr, "dedup: %s of backends need more than DEDUP_INDEX_MB=%d\n",
+			humanSize(nr_phys * PAGE_SIZE), DEDUP_INDEX_MB);
+		return -ENOMEM;
+	}
+
+	ret = meta_open(&meta, path, DMAP_HDR_SIZE + nr_pages * sizeof(uint32_t), &fresh);
+	if (ret)
+		return ret;
+
+	hdr = (struct dmap_hdr *)meta.map;
+	map = (uint32_t *)(meta.map + DMAP_HDR_SIZE);
+
+	if (fresh || hdr->magic != DMAP_MAGIC) {
+		memset(meta.map, 0, meta.len);
+		hdr->magic = DMAP_MAGIC;
+		hdr->version = DMAP_VERSION;
+	} else if (hdr->version != DMAP_VERSION) {
+		fprintf(stderr, "%s: unknown version %u\n", path, hdr->version);
+		meta_close(&meta);
+		return -EINVAL;
+	}
+	if (nr_pages > hdr->nr_pages)
+		hdr->nr_pages = nr_pages;
+	meta_flush_all(&meta);
+
+	// Enough slots to index every backend page, in what the rest leaves
+	nr_slots = 1024;
+	while (nr_slots < nr_phys &&
+	       fixed + nr_slots * 2 * sizeof(struct fp_entry) <= budget)
+		nr_slots *= 2;
+	index_mask = nr_slots - 1;
+
+	memset(&dstats, 0, sizeof(dstats));
+	fpidx = calloc(nr_slots, sizeof(struct fp_entry));
+	refcount = calloc(nr_phys, sizeof(uint32_t));
+	backptr = calloc(nr_phys, sizeof(uint32_t));
+	space = calloc((nr_phys + 63) / 64, sizeof(uint64_t));
+	dropped = calloc((nr_phys + 63) / 64, sizeof(uint64_t));
+	vbuf = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	if (!fpidx || !refcount || !backptr || !space || !dropped || !vbuf) {
+		fprintf(stderr, "dedup: out of memory\n");
+		meta_close(&meta);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < hdr->nr_pages; i++) {
+		if (!map[i])
+			continue;
+		p = map[i] - 1;
+		if (p >= nr_phys) {
+			fprintf(stderr, "dedup: page %lu is beyond the backends\n", i);
+			continue;
+		}
+		if (!refcount[p]++) {
+			space[p / 64] |= 1ULL << (p % 64);
+			dstats.used++;
+		}
+	}
+
+	index_load(DEDUP_INDEX_PATH);
+
+	printf("dedup: %lu index slots, ", nr_slots);
+	printf("%s of backend space\n", humanSize(nr_phys * PAGE_SIZE));
+
+	return 0;
+}
+
+void dedup_exit(void)
+{
+	dedup_flush();
+	index_save(DEDUP_INDEX_PATH);
+	meta_close(&meta);
+
+	free(fpidx);
+	free(refcount);
+	free(backptr);
+	free(space);
+	free(dropped);
+	free(vbuf);
+}
+
+#endif
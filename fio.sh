@@ -16,9 +16,10 @@ for i in 1 2 3 4; do
     insmod cheedon.ko
     echo $((64 * 1024 * 1024 * 1024)) > /sys/block/cheedon0/disksize
 
-    gcc -O3 -s -DNUM_DEVICE=$i -DSTRIPE_K=$s user.c 2>/dev/null
-    #gcc -O3 -s -DNUM_DEVICE=$i -DSTRIPE_K=$s uring.c -luring 2>/dev/null
-    ./build.sh
+    gcc -O3 -s -DNUM_DEVICE=$i -DSTRIPE_K=$s -pthread user.c meta.c thin.c zero.c compress.c dedup.c lfs.c zoned.c layout.c overlay.c journal.c record.c autotune.c reshape.c mmap.c csum.c prof.c 2>/dev/null
+    #gcc -O3 -s -DNUM_DEVICE=$i -DSTRIPE_K=$s uring.c sched.c layout.c record.c prof.c -luring 2>/dev/null
+    # PROFILE=1 ./fio.sh adds per stage counters after every job
+    ./build.sh ${PROFILE:+-DPROFILE}
     ./a.out &
     sleep 0.5
 
@@ -26,6 +27,10 @@ for i in 1 2 3 4; do
     ls */* | while read a; do
       flush
       echo -n $a; fio $a | grep 'B/s' | tail -n1; echo
+      if [ -n "$PROFILE" ]; then
+        killall -USR1 a.out
+        sleep 0.5
+      fi
     done
     cd ..
 
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+#define pr_fmt(fmt) "cheedon: " fmt
+
+/*
+ * Access heat map
+ *
+ * Reads and writes are counted in pages over CHEEDON_HEAT_REGIONS equal
+ * LBA regions. Requests only bump per-CPU counters, which are never reset,
+ * so nothing is shared on the I/O path. A delayed work folds what they
+ * gained into the map every CHEEDON_HEAT_DECAY_SEC after halving it, which
+ * makes a region's heat its recent traffic with older traffic fading out.
+ *
+ * cat /sys/kernel/debug/cheedon/heatmap > heat.txt
+ */
+
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
+
+#include "cheedon.h"
+
+struct heat_cpu {
+	unsigned long pages[CHEEDON_HEAT_REGIONS][2];	// read, write
+};
+
+static struct heat_cpu __percpu *counts;
+static unsigned long seen[CHEEDON_HEAT_REGIONS][2];	// CPU sums at the last fold
+static u64 heat[CHEEDON_HEAT_REGIONS][2];
+static unsigned int region_shift = 20 - SECTOR_SHIFT;	// in sectors
+static DEFINE_MUTEX(heat_mutex);
+static struct delayed_work decay_work;
+static struct dentry *heat_dir;
+
+void cheedon_heat_account(sector_t sector, unsigned int bytes, int op)
+{
+	unsigned long r;
+
+	if (op != REQ_OP_READ && op != REQ_OP_WRITE)
+		return;
+
+	r = sector >> READ_ONCE(region_shift);
+	if (unlikely(r >= CHEEDON_HEAT_REGIONS))
+		r = CHEEDON_HEAT_REGIONS - 1;
+
+	this_cpu_add(counts->pages[r][op == REQ_OP_WRITE], bytes >> PAGE_SHIFT);
+}
+
+static unsigned long heat_sum(unsigned int r, unsigned int w)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(counts, cpu)->pages[r][w];
+
+	return sum;
+}
+
+// Called with heat_mutex held
+static void heat_fold(bool decay)
+{
+	unsigned long sum;
+	unsigned int r, w;
+
+	for (r = 0; r < CHEEDON_HEAT_REGIONS; r++) {
+		for (w = 0; w < 2; w++) {
+			sum = heat_sum(r, w);
+			if (decay)
+				heat[r][w] >>= 1;
+			heat[r][w] += sum - seen[r][w];
+			seen[r][w] = sum;
+		}
+	}
+}
+
+static void heat_decay(struct work_struct *work)
+{
+	mutex_lock(&heat_mutex);
+	heat_fold(true);
+	mutex_unlock(&heat_mutex);
+
+	schedule_delayed_work(&decay_work, CHEEDON_HEAT_DECAY_SEC * HZ);
+}
+
+// Regions are sized for the disk, at least 1 MiB
+void cheedon_heat_resize(u64 disksize)
+{
+	u64 sectors = DIV_ROUND_UP(disksize >> SECTOR_SHIFT, CHEEDON_HEAT_REGIONS);
+	unsigned int shift = 20 - SECTOR_SHIFT, r, w;
+
+	if (sectors > 1)
+		shift = max_t(unsigned int, shift, order_base_2(sectors));
+
+	mutex_lock(&heat_mutex);
+	if (shift != region_shift) {
+		WRITE_ONCE(region_shift, shift);
+		// What was counted so far belongs to the old regions
+		for (r = 0; r < CHEEDON_HEAT_REGIONS; r++) {
+			for (w = 0; w < 2; w++) {
+				seen[r][w] = heat_sum(r, w);
+				heat[r][w] = 0;
+			}
+		}
+	}
+	mutex_unlock(&heat_mutex);
+}
+
+static int heatmap_show(struct seq_file *m, void *v)
+{
+	u64 nr = get_capacity(cheedon_disk);
+	unsigned int r;
+
+	mutex_lock(&heat_mutex);
+	heat_fold(false);
+
+	nr = min_t(u64, (nr + (1ULL << region_shift) - 1) >> region_shift,
+		   CHEEDON_HEAT_REGIONS);
+	seq_printf(m, "# %u KiB regions, halved every %u s, in pages\n",
+		   1U << (region_shift + SECTOR_SHIFT - 10), CHEEDON_HEAT_DECAY_SEC);
+	seq_puts(m, "# sector read_heat write_heat reads writes\n");
+	for (r = 0; r < nr; r++)
+		seq_printf(m, "%llu %llu %llu %lu %lu\n",
+			   (u64)r << region_shift, heat[r][0], heat[r][1],
+			   seen[r][0], seen[r][1]);
+	mutex_unlock(&heat_mutex);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(heatmap);
+
+int cheedon_heat_init(void)
+{
+	counts = alloc_percpu(struct heat_cpu);
+	if (!counts)
+		return -ENOMEM;
+
+	// The map is optional, I/O is counted without debugfs too
+	heat_dir = debugfs_create_dir("cheedon", NULL);
+	debugfs_create_file("heatmap", 0444, heat_dir, NULL, &heatmap_fops);
+
+	INIT_DELAYED_WORK(&decay_work, heat_decay);
+	schedule_delayed_work(&decay_work, CHEEDON_HEAT_DECAY_SEC * HZ);
+
+	return 0;
+}
+
+void cheedon_heat_exit(void)
+{
+	cancel_delayed_work_sync(&decay_work);
+	debugfs_remove_recursive(heat_dir);
+	free_percpu(counts);
+}
@@ -0,0 +1,557 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Write-back staging journal
+ *
+ * Writes are appended to a log on a small, fast device or file instead of
+ * going to the striped backends, so the daemon is back reading the chardev
+ * after a single sequential write. Every record is a header page followed
+ * by its data pages:
+ *
+ *   magic, seq, type, lpn, nr, checksum of the data
+ *
+ * An in-memory table maps each journaled page to its newest copy in the log
+ * and serves read-after-write. Once the log is JOURNAL_DESTAGE_PCT full, all
+ * of it is destaged to the backends sorted by address and merged into runs,
+ * the backends are synced and the tail recorded in the journal header moves
+ * up to the head.
+ *
+ * REQ_OP_FLUSH only syncs the journal. After a crash the records past the
+ * tail are replayed into the table and destaged before serving requests.
+ * A destage which can't read the log back keeps the tail where it was,
+ * for the next one to retry.
+ *
+ * Records never wrap around the end of the log; one which doesn't fit
+ * starts the next lap, and replay follows it there.
+ */
+
+#ifdef JOURNAL
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "user.h"
+
+#define JNL_MAGIC	0x4c4e4a4445454843ULL	// "CHEEDJNL"
+#define JREC_MAGIC	0x43455244454a4843ULL	// "CHJEDREC"
+#define JNL_VERSION	1
+
+#define JNL_EMPTY	UINT64_MAX
+
+enum {
+	JREC_WRITE,
+	JREC_DISCARD,
+};
+
+struct jnl_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t pad;
+	uint64_t nr_pages;	// of the log, the header page excluded
+	uint64_t tail;		// first record not destaged yet
+	uint64_t tail_seq;
+};
+
+struct jrec {
+	uint64_t magic;
+	uint64_t seq;
+	uint32_t type;
+	uint32_t pad;
+	uint64_t lpn;
+	uint64_t nr;
+	uint64_t sum;
+};
+
+// Newest log position of each journaled page, open addressing
+struct jent {
+	uint64_t lpn;
+	uint64_t lsn;
+};
+
+static int fd = -1;
+static struct jnl_hdr *hdr;
+static char *rec_page;
+static char *dbuf;
+
+// Log sequence numbers count pages, the log position is lsn % nr_pages
+static uint64_t nr_pages, head, tail, seq;
+
+static struct jent *table;
+static uint64_t index_mask, nr_entries;
+
+static void (*store)(uint64_t lpn, char *buf, unsigned int nr);
+static void (*sync_store)(void);
+
+static struct {
+	uint64_t records;	// appended
+	uint64_t pages;		// data pages appended
+	uint64_t destages;
+	uint64_t destaged;	// pages written to the backends
+	uint64_t runs;		// merged writes doing so
+	uint64_t read_hits;	// pages served from the log
+	uint64_t syncs;
+} jstats;
+
+static uint64_t data_sum(const char *buf, uint64_t nr)
+{
+	const uint64_t *p = (const uint64_t *)buf;
+	uint64_t h = 0x9e3779b97f4a7c15ULL, i;
+
+	for (i = 0; i < nr * PAGE_SIZE / sizeof(uint64_t); i++)
+		h = (h ^ p[i]) * 0xff51afd7ed558ccdULL;
+
+	return h ^ (h >> 32);
+}
+
+static inline off_t lsn_off(uint64_t lsn)
+{
+	return (1 + lsn % nr_pages) * PAGE_SIZE;
+}
+
+/* Index */
+
+static inline uint64_t slot_of(uint64_t lpn)
+{
+	return (lpn * 0x9e3779b97f4a7c15ULL >> 20) & index_mask;
+}
+
+static struct jent *index_find(uint64_t lpn)
+{
+	uint64_t i = slot_of(lpn);
+
+	for (; table[i].lpn != JNL_EMPTY; i = (i + 1) & index_mask) {
+		if (table[i].lpn == lpn)
+			return table + i;
+	}
+
+	return NULL;
+}
+
+static void index_set(uint64_t lpn, uint64_t lsn)
+{
+	uint64_t i = slot_of(lpn);
+
+	for (; table[i].lpn != JNL_EMPTY; i = (i + 1) & index_mask) {
+		if (table[i].lpn == lpn) {
+			table[i].lsn = lsn;
+			return;
+		}
+	}
+
+	table[i].lpn = lpn;
+	table[i].lsn = lsn;
+	nr_entries++;
+}
+
+// Backward shift, so lookups never need tombstones
+static void index_del(struct jent *e)
+{
+	uint64_t i = e - table, j = i, home;
+
+	while (1) {
+		j = (j + 1) & index_mask;
+		if (table[j].lpn == JNL_EMPTY)
+			break;
+		home = slot_of(table[j].lpn);
+		// Entry j may fill the hole unless its home lies cyclically in (i, j]
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && (home <= i && home > j))) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+
+	table[i].lpn = JNL_EMPTY;
+	nr_entries--;
+}
+
+static void index_clear(void)
+{
+	uint64_t i;
+
+	for (i = 0; i <= index_mask; i++)
+		table[i].lpn = JNL_EMPTY;
+	nr_entries = 0;
+}
+
+// Drops pages of the range, returns how many were journaled
+static uint64_t index_drop(uint64_t lpn, uint64_t nr)
+{
+	uint64_t dropped = 0, i;
+	struct jent *e;
+
+	if (!nr_entries)
+		return 0;
+
+	if (nr <= nr_entries) {
+		for (i = 0; i < nr; i++) {
+			e = index_find(lpn + i);
+			if (e) {
+				index_del(e);
+				dropped++;
+			}
+		}
+		return dropped;
+	}
+
+	// A large range costs less as a scan of the table
+	for (i = 0; i <= index_mask;) {
+		if (table[i].lpn != JNL_EMPTY && table[i].lpn - lpn < nr) {
+			index_del(table + i);
+			dropped++;
+			continue;	// something else may have shifted in
+		}
+		i++;
+	}
+
+	return dropped;
+}
+
+/* Log */
+
+static int write_hdr(void)
+{
+	if (pwrite(fd, hdr, PAGE_SIZE, 0) != PAGE_SIZE || fdatasync(fd)) {
+		perror("journal: failed to write the header");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int cmp_lpn(const void *a, const void *b)
+{
+	const struct jent *x = a, *y = b;
+
+	return x->lpn < y->lpn ? -1 : x->lpn > y->lpn;
+}
+
+// Everything in the log goes to the backends, sorted and merged
+static int destage(void)
+{
+	struct jent *ents;
+	uint64_t i, j, n, k;
+	int ret = 0;
+
+	if (nr_entries) {
+		ents = malloc(nr_entries * sizeof(*ents));
+		if (!ents) {
+			perror("journal: failed to destage");
+			exit(1);
+		}
+		for (i = 0, n = 0; i <= index_mask; i++) {
+			if (table[i].lpn != JNL_EMPTY)
+				ents[n++] = table[i];
+		}
+		qsort(ents, n, sizeof(*ents), cmp_lpn);
+
+		for (i = 0; i < n; i = j) {
+			// A run of consecutive pages, read back from the log in pieces
+			for (j = i + 1; j < n && j - i < MAX_REQ_PAGES &&
+			     ents[j].lpn == ents[j - 1].lpn + 1; j++)
+				;
+			for (k = i; k < j;) {
+				uint64_t m = 1;
+
+				while (k + m < j && ents[k + m].lsn == ents[k].lsn + m &&
+				       lsn_off(ents[k].lsn) + (off_t)m * PAGE_SIZE ==
+				       lsn_off(ents[k + m].lsn))
+					m++;
+				if (pread(fd, dbuf + (k - i) * PAGE_SIZE, m * PAGE_SIZE,
+					  lsn_off(ents[k].lsn)) != (ssize_t)(m * PAGE_SIZE)) {
+					perror("journal: failed to read the log");
+					ret = -EIO;
+					break;
+				}
+				k += m;
+			}
+			if (ret)
+				break;
+
+			store(ents[i].lpn, dbuf, j - i);
+			jstats.runs++;
+		}
+		free(ents);
+		// Runs stored already were the newest copies, nothing else moved
+		if (ret)
+			return ret;
+		jstats.destaged += n;
+	}
+
+	// The backends hold it all before the log may be overwritten
+	sync_store();
+	index_clear();
+
+	tail = head;
+	hdr->tail = tail;
+	hdr->tail_seq = seq;
+	write_hdr();
+	jstats.destages++;
+
+	return 0;
+}
+
+static void append(uint32_t type, uint64_t lpn, char *buf, uint64_t nr)
+{
+	struct jrec *r = (struct jrec *)rec_page;
+	uint64_t len = 1 + (type == JREC_WRITE ? nr : 0), at, i;
+	struct iovec iov[2];
+
+	// Skip to the next lap rather than wrapping a record
+	at = head;
+	if (at % nr_pages + len > nr_pages)
+		at += nr_pages - at % nr_pages;
+	if (at + len - tail > nr_pages) {
+		if (destage()) {
+			// Still full, so straight to the backends as when appending fails
+			index_drop(lpn, nr);
+			if (type == JREC_WRITE)
+				store(lpn, buf, nr);
+			return;
+		}
+		at = head;
+		if (at % nr_pages + len > nr_pages)
+			at += nr_pages - at % nr_pages;
+	}
+
+	memset(rec_page, 0, PAGE_SIZE);
+	r->magic = JREC_MAGIC;
+	r->seq = seq;
+	r->type = type;
+	r->lpn = lpn;
+	r->nr = nr;
+	r->sum = type == JREC_WRITE ? data_sum(buf, nr) : 0;
+
+	iov[0].iov_base = rec_page;
+	iov[0].iov_len = PAGE_SIZE;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = (len - 1) * PAGE_SIZE;
+	if (pwritev(fd, iov, len > 1 ? 2 : 1, lsn_off(at)) != (ssize_t)(len * PAGE_SIZE)) {
+		// Nothing is lost yet, the data still goes to the backends
+		perror("journal: failed to append");
+		index_drop(lpn, nr);
+		if (type == JREC_WRITE)
+			store(lpn, buf, nr);
+		return;
+	}
+
+	if (type == JREC_WRITE) {
+		for (i = 0; i < nr; i++)
+			index_set(lpn + i, at + 1 + i);
+		jstats.pages += nr;
+	}
+	head = at + len;
+	seq++;
+	jstats.records++;
+
+	if ((head - tail) * 100 >= nr_pages * JOURNAL_DESTAGE_PCT)
+		destage();
+}
+
+/* Request handling */
+
+void journal_write(uint64_t lpn, char *buf, unsigned int nr)
+{
+	append(JREC_WRITE, lpn, buf, nr);
+}
+
+// The backends underneath are discarded by the caller
+void journal_discard(uint64_t lpn, uint64_t nr)
+{
+	// A record keeps replay from bringing the dropped pages back
+	if (index_drop(lpn, nr))
+		append(JREC_DISCARD, lpn, NULL, nr);
+}
+
+// Overlays journaled pages on what was read from the backends
+void journal_read(uint64_t lpn, char *buf, unsigned int nr)
+{
+	struct jent *e;
+	unsigned int i;
+
+	if (!nr_entries)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		e = index_find(lpn + i);
+		if (!e)
+			continue;
+		if (pread(fd, buf + i * PAGE_SIZE, PAGE_SIZE, lsn_off(e->lsn)) != PAGE_SIZE)
+			perror("journal: failed to read the log");
+		jstats.read_hits++;
+	}
+}
+
+void journal_sync(void)
+{
+	if (fdatasync(fd))
+		perror("journal: failed to sync");
+	jstats.syncs++;
+}
+
+void journal_stats(void)
+{
+	printf("journal: %lu records, %s appended, %s in the log\n", jstats.records,
+	       humanSize(jstats.pages * PAGE_SIZE), humanSize(nr_entries * PAGE_SIZE));
+	printf("journal: %lu destages of %lu pages in %lu runs, ", jstats.destages,
+	       jstats.destaged, jstats.runs);
+	printf("%lu read hits, %lu syncs\n", jstats.read_hits, jstats.syncs);
+}
+
+/* Startup */
+
+// Reads the record at lsn into rec_page and dbuf if it is the expected one
+static bool read_rec(uint64_t lsn)
+{
+	struct jrec *r = (struct jrec *)rec_page;
+
+	if (pread(fd, rec_page, PAGE_SIZE, lsn_off(lsn)) != PAGE_SIZE)
+		return false;
+	if (r->magic != JREC_MAGIC || r->seq != seq)
+		return false;
+	if (r->type == JREC_DISCARD)
+		return true;
+	if (r->type != JREC_WRITE || !r->nr || r->nr > MAX_REQ_PAGES ||
+	    lsn % nr_pages + 1 + r->nr > nr_pages)
+		return false;
+
+	// A torn append ends the log
+	if (pread(fd, dbuf, r->nr * PAGE_SIZE, lsn_off(lsn + 1)) != (ssize_t)(r->nr * PAGE_SIZE))
+		return false;
+
+	return data_sum(dbuf, r->nr) == r->sum;
+}
+
+static void replay(void)
+{
+	struct jrec *r = (struct jrec *)rec_page;
+	uint64_t lsn = tail, next, i, nr = 0;
+
+	while (lsn - tail < nr_pages) {
+		if (!read_rec(lsn)) {
+			// The record may have gone on to the next lap
+			next = lsn + nr_pages - lsn % nr_pages;
+			if (lsn % nr_pages == 0 || next - tail >= nr_pages || !read_rec(next))
+				break;
+			lsn = next;
+		}
+
+		if (r->type == JREC_WRITE) {
+			for (i = 0; i < r->nr; i++)
+				index_set(r->lpn + i, lsn + 1 + i);
+			lsn += 1 + r->nr;
+		} else {
+			index_drop(r->lpn, r->nr);
+			lsn++;
+		}
+		seq++;
+		nr++;
+	}
+	head = lsn;
+
+	if (nr) {
+		printf("journal: replaying %lu records, %lu pages\n", nr, nr_entries);
+		destage();
+	}
+}
+
+int journal_init(const char *path, void (*store_fn)(uint64_t, char *, unsigned int),
+		 void (*sync_fn)(void))
+{
+	uint64_t want = (uint64_t)JOURNAL_MB * 1024 * 1024 / PAGE_SIZE, size;
+
+	store = store_fn;
+	sync_store = sync_fn;
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		perror(path);
+		return -errno;
+	}
+
+	hdr = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	rec_page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	dbuf = aligned_alloc(PAGE_SIZE, MAX_REQ_SIZE);
+	if (!hdr || !rec_page || !dbuf)
+		goto nomem;
+
+	if (pread(fd, hdr, PAGE_SIZE, 0) != PAGE_SIZE || hdr->magic != JNL_MAGIC) {
+		// A device keeps its size, a file is grown to JOURNAL_MB
+		size = lseek(fd, 0, SEEK_END);
+		if (size < (want + 1) * PAGE_SIZE && ftruncate(fd, (want + 1) * PAGE_SIZE) == 0)
+			size = (want + 1) * PAGE_SIZE;
+		memset(hdr, 0, PAGE_SIZE);
+		hdr->magic = JNL_MAGIC;
+		hdr->version = JNL_VERSION;
+		hdr->nr_pages = size / PAGE_SIZE - 1;
+		if (hdr->nr_pages > want)
+			hdr->nr_pages = want;
+		// Old records must not look like new ones
+		hdr->tail_seq = (uint64_t)time(NULL) << 24;
+	} else if (hdr->version != JNL_VERSION) {
+		fprintf(stderr, "%s: journal version %u, refusing to reuse\n",
+			path, hdr->version);
+		goto out_close;
+	}
+	if (hdr->nr_pages < 2 * (MAX_REQ_PAGES + 1)) {
+		fprintf(stderr, "%s: journal too small for a request\n", path);
+		goto out_close;
+	}
+
+	nr_pages = hdr->nr_pages;
+	head = tail = hdr->tail;
+	seq = hdr->tail_seq;
+
+	for (index_mask = 1; index_mask < 2 * nr_pages; index_mask <<= 1)
+		;
+	table = malloc(index_mask * sizeof(*table));
+	if (!table)
+		goto nomem;
+	index_mask--;
+	index_clear();
+
+	memset(&jstats, 0, sizeof(jstats));
+	replay();
+	if (write_hdr())
+		goto out_close;
+
+	printf("journal: %s log\n", humanSize(nr_pages * PAGE_SIZE));
+
+	return 0;
+
+nomem:
+	fprintf(stderr, "journal: out of memory\n");
+	close(fd);
+	return -ENOMEM;
+
+out_close:
+	close(fd);
+	return -EINVAL;
+}
+
+void journal_exit(void)
+{
+	destage();
+	close(fd);
+	fd = -1;
+
+	free(table);
+	free(hdr);
+	free(rec_page);
+	free(dbuf);
+	table = NULL;
+}
+
+#endif
@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Bandwidth-weighted striping
+ *
+ * Each device gets stripe units in proportion to its weight. The units of
+ * one period are laid out once in a pattern table, interleaved so that
+ * consecutive units still land on different devices, and map_page() only
+ * needs a division and two table lookups.
+ *
+ * Weights come from STRIPE_WEIGHTS, e.g. -DSTRIPE_WEIGHTS=4,1,1,1, or from
+ * a read-only calibration pass on the first start. Either way they are
+ * saved to LAYOUT_PATH, as any other weights would scramble the array.
+ * Delete it only to recalibrate an array holding no data.
+ */
+
+#ifdef WEIGHTED
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "user.h"
+
+#define CAL_IO_SIZE	(1024 * 1024)
+#define CAL_SPOTS	16
+
+struct layout layout;
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	unsigned int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+// Smooth weighted round-robin, so no device gets a long run of units
+static void layout_build(const unsigned int *weight)
+{
+	int cur[NUM_DEVICE] = { 0 };
+	unsigned int rank[NUM_DEVICE] = { 0 };
+	unsigned int g = 0, k;
+	int i, best;
+
+	for (i = 0; i < NUM_DEVICE; i++)
+		g = gcd(weight[i], g);
+
+	layout.period = 0;
+	for (i = 0; i < NUM_DEVICE; i++) {
+		layout.weight[i] = weight[i] / g;
+		layout.period += layout.weight[i];
+	}
+
+	for (k = 0; k < layout.period; k++) {
+		best = 0;
+		for (i = 0; i < NUM_DEVICE; i++) {
+			cur[i] += layout.weight[i];
+			if (cur[i] > cur[best])
+				best = i;
+		}
+		cur[best] -= layout.period;
+
+		layout.dev[k] = best;
+		layout.rank[k] = rank[best]++;
+	}
+}
+
+#ifndef STRIPE_WEIGHTS
+// Sequential read bandwidth in MB/s, sampled across the whole device
+static double calibrate(int fd, uint64_t len)
+{
+	struct timespec start, end;
+	char path[64], *buf;
+	uint64_t off, done = 0;
+	double sec;
+	int dfd, i, j;
+
+	// Bypass the page cache, whether the daemon uses O_DIRECT or not
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	dfd = open(path, O_RDONLY | O_DIRECT);
+	if (dfd < 0)
+		dfd = fd;
+
+	buf = aligned_alloc(PAGE_SIZE, CAL_IO_SIZE);
+	if (!buf)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < CAL_SPOTS; i++) {
+		off = len / CAL_SPOTS * i / CAL_IO_SIZE * CAL_IO_SIZE;
+		for (j = 0; j < LAYOUT_CAL_MB / CAL_SPOTS; j++) {
+			if (off + CAL_IO_SIZE > len ||
+			    pread(dfd, buf, CAL_IO_SIZE, off) != CAL_IO_SIZE)
+				break;
+			off += CAL_IO_SIZE;
+			done += CAL_IO_SIZE;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	free(buf);
+	if (dfd != fd)
+		close(dfd);
+
+	sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	return sec > 0 ? done / sec / 1e6 : 0;
+}
+
+/*
+ * Weights in quarter steps of the slowest device, so that run to run noise
+ * doesn't make identical devices differ
+ */
+static int weights_from_bw(const double *bw, unsigned int *weight)
+{
+	double min = 0, steps = 4;
+	unsigned int sum;
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (bw[i] <= 0)
+			return -EIO;
+		if (i == 0 || bw[i] < min)
+			min = bw[i];
+	}
+
+	do {
+		sum = 0;
+		for (i = 0; i < NUM_DEVICE; i++) {
+			weight[i] = bw[i] / min * steps + 0.5;
+			if (weight[i] == 0)
+				weight[i] = 1;
+			sum += weight[i];
+		}
+		steps /= 2;
+	} while (sum > LAYOUT_MAX_PERIOD);
+
+	return 0;
+}
+#endif
+
+static int layout_load(const char *path, unsigned int *weight)
+{
+	unsigned int nr, stripe_k;
+	FILE *fp;
+	int i;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -ENOENT;
+
+	if (fscanf(fp, "CHEEDLAY %u %u", &nr, &stripe_k) != 2 ||
+	    nr != NUM_DEVICE || stripe_k != STRIPE_K) {
+		fprintf(stderr, "layout: %s doesn't match %d devices of %dK stripes\n",
+			path, NUM_DEVICE, STRIPE_K);
+		fclose(fp);
+		return -EINVAL;
+	}
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (fscanf(fp, "%u", weight + i) != 1 || !weight[i]) {
+			fprintf(stderr, "layout: bad weights in %s\n", path);
+			fclose(fp);
+			return -EINVAL;
+		}
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static int layout_save(const char *path, const unsigned int *weight)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		return -errno;
+	}
+
+	fprintf(fp, "CHEEDLAY %d %d", NUM_DEVICE, STRIPE_K);
+	for (i = 0; i < NUM_DEVICE; i++)
+		fprintf(fp, " %u", weight[i]);
+	fprintf(fp, "\n");
+
+	if (fflush(fp) || fsync(fileno(fp))) {
+		perror(path);
+		fclose(fp);
+		return -EIO;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+int layout_init(const char *path, const int *fds, const uint64_t *lens)
+{
+	unsigned int weight[NUM_DEVICE];
+	int i, ret;
+
+	ret = layout_load(path, weight);
+	if (ret && ret != -ENOENT)
+		return ret;
+
+#ifdef STRIPE_WEIGHTS
+	{
+		static const unsigned int manual[] = { STRIPE_WEIGHTS };
+
+		if (sizeof(manual) / sizeof(manual[0]) != NUM_DEVICE) {
+			fprintf(stderr, "layout: STRIPE_WEIGHTS needs %d entries\n", NUM_DEVICE);
+			return -EINVAL;
+		}
+		for (i = 0; i < NUM_DEVICE; i++) {
+			if (!manual[i] || (!ret && manual[i] * weight[0] != weight[i] * manual[0])) {
+				fprintf(stderr, "layout: STRIPE_WEIGHTS differ from %s\n", path);
+				return -EINVAL;
+			}
+		}
+		memcpy(weight, manual, sizeof(weight));
+	}
+#else
+	if (ret) {
+		double bw[NUM_DEVICE];
+
+		for (i = 0; i < NUM_DEVICE; i++) {
+			bw[i] = calibrate(fds[i], lens[i]);
+			printf("layout: device %d reads at %.0f MB/s\n", i, bw[i]);
+		}
+		if (weights_from_bw(bw, weight)) {
+			fprintf(stderr, "layout: calibration failed\n");
+			return -EIO;
+		}
+	}
+#endif
+
+	layout_build(weight);
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (layout.weight[i] * STRIPE_SIZE > lens[i]) {
+			fprintf(stderr, "layout: device %d is too small\n", i);
+			return -EINVAL;
+		}
+	}
+
+	if (ret) {
+		ret = layout_save(path, layout.weight);
+		if (ret)
+			return ret;
+	}
+
+	printf("layout: weights");
+	for (i = 0; i < NUM_DEVICE; i++)
+		printf("%c%u", i ? ':' : ' ', layout.weight[i]);
+	printf(", %u stripe units per period\n", layout.period);
+
+	return 0;
+}
+
+// Whole periods fitting on every device
+uint64_t layout_size(const uint64_t *lens)
+{
+	uint64_t periods = UINT64_MAX, n;
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		n = lens[i] / ((uint64_t)layout.weight[i] * STRIPE_SIZE);
+		if (n < periods)
+			periods = n;
+	}
+
+	return periods * layout.period * STRIPE_SIZE;
+}
+
+#endif
@@ -0,0 +1,992 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Log-structured write mode
+ *
+ * Every backend is cut into LFS_SEG_K segments and keeps one open segment.
+ * Written pages are buffered per device and appended to the open segment
+ * as chunks of up to LFS_CHUNK_K, so random writes reach the backends as
+ * large sequential ones. Pages keep going to the device the stripe layout
+ * would have picked, which keeps sequential reads spread over the array.
+ *
+ * Each chunk starts with a summary page listing the logical page and the
+ * sequence number of every entry in it, discards included. The page map
+ * lives in memory and is persisted by checkpoints, written alternately to
+ * two slots of LFS_PATH. After a crash, the chunks appended since the last
+ * checkpoint are found again by following the same deterministic segment
+ * allocation and replayed in sequence order.
+ *
+ * A background thread reclaims segments by cost-benefit. It is paced to
+ * LFS_GC_MBPS while requests are coming in and runs flat out when idle;
+ * writes only wait for it when free segments drop below the low watermark.
+ * Reclaimed segments are reused only after the next checkpoint, as the
+ * previous one may still point into them.
+ *
+ * With -DZONED, segments are zones of the backends, see zoned.c.
+ */
+
+#ifdef LFS
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "user.h"
+
+#define LFS_MAGIC	0x5346444545454843ULL	// "CHEEDEFS"
+#define SUM_MAGIC	0x4d55534445454843ULL	// "CHEEDSUM"
+#define LFS_VERSION	1
+
+#define SEG_SIZE	(LFS_SEG_K * 1024ULL)
+#define PAGES_PER_SEG	(SEG_SIZE / PAGE_SIZE)
+#define CHUNK_PAGES	(LFS_CHUNK_K * 1024 / PAGE_SIZE)
+
+#define SEG_FREE	0
+#define SEG_OPEN	1
+#define SEG_USED	2
+#define SEG_DEAD	3	// empty, free after the next checkpoint
+
+#define ENT_TRIM	(1U << 31)
+
+#define NO_LPN		UINT32_MAX
+
+#if LFS_CHUNK_K > 1024 || LFS_SEG_K % LFS_CHUNK_K
+#error "LFS_CHUNK_K must divide LFS_SEG_K and be at most 1024"
+#endif
+
+struct sum_entry {
+	uint32_t lpn;
+	uint32_t delta;		// sequence number - summary seq, ENT_TRIM
+};
+
+struct summary {
+	uint64_t magic;
+	uint64_t csum;
+	uint64_t uuid;		// of the format, older chunks don't count
+	uint64_t seq;
+	uint32_t seg;
+	uint16_t nr;
+	uint16_t ndata;
+	struct sum_entry e[];
+};
+
+#define SUM_ENTRIES	((PAGE_SIZE - sizeof(struct summary)) / sizeof(struct sum_entry))
+
+struct ckpt_dev {
+	uint32_t seg;
+	uint32_t off;
+	uint32_t cursor;
+	uint32_t pad;
+};
+
+// Followed by one state byte per segment and the page map
+struct ckpt_hdr {
+	uint64_t magic;
+	uint64_t csum;
+	uint32_t version;
+	uint32_t seg_k;
+	uint64_t uuid;
+	uint64_t id;
+	uint64_t seq;
+	uint64_t nr_pages;
+	uint64_t nr_segs;
+	struct ckpt_dev dev[NUM_DEVICE];
+};
+
+// One log per backend, a logical page always goes to the same device
+struct lfs_dev {
+	uint32_t seg;		// open segment
+	uint32_t off;		// first page of the chunk being filled
+	uint32_t cursor;	// where the next segment search starts
+	unsigned int ndata;
+	unsigned int cap;	// data pages fitting in this chunk
+	char *buf;		// summary page, then data
+
+	uint32_t nr_free, nr_dead;
+	uint32_t victim, victim_pos;
+};
+
+struct seg_info {
+	uint32_t valid;
+	uint8_t state;
+	uint64_t mtime;		// sequence number of the last page appended
+};
+
+static pthread_mutex_t lfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t gc_thread;
+static bool gc_stop;
+
+static int ckpt_fd = -1;
+static uint64_t ckpt_id;
+static uint64_t uuid;
+static size_t ckpt_len;
+static char *ckpt_buf;
+
+static uint32_t *map;		// backend page + 1, 0 for unmapped
+static uint32_t *p2l;		// reverse map for the cleaner
+static uint64_t nr_pages;
+
+static struct seg_info *segs;
+static uint32_t nr_segs, segs_per_dev;
+static uint64_t seg_stride = SEG_SIZE;	// zone size on zoned backends
+static uint32_t low_wm, high_wm;	// free segments per device
+
+static struct lfs_dev devs[NUM_DEVICE];
+static unsigned int trim_rr;
+static uint64_t seq;
+
+static uint64_t last_fg_ns;
+
+static struct {
+	uint64_t host;		// pages written by requests
+	uint64_t moved;		// pages copied by the cleaner
+	uint64_t summaries;	// summary pages written
+	uint64_t cleaned;	// segments reclaimed by the cleaner
+	uint64_t ckpts;
+	uint64_t stalls;	// writes which had to clean by themselves
+	uint64_t dropped;	// pages lost to a full log
+} lstats;
+
+static inline uint64_t lfs_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000L + ts.tv_nsec;
+}
+
+static uint64_t fnv1a(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+
+	return h;
+}
+
+static inline int seg_dev(uint32_t seg)
+{
+	return seg % NUM_DEVICE;
+}
+
+static inline off_t seg_offset(uint32_t seg)
+{
+	return (off_t)(seg / NUM_DEVICE) * seg_stride;
+}
+
+static inline uint32_t ppn_seg(uint32_t ppn)
+{
+	return ppn / PAGES_PER_SEG;
+}
+
+static inline int lpn_dev(uint64_t lpn)
+{
+	return (lpn * PAGE_SIZE / STRIPE_SIZE) % NUM_DEVICE;
+}
+
+/* Segments */
+
+// Lowest free segment of the device from its cursor on; replayed on recovery
+static uint32_t alloc_seg(int dev)
+{
+	struct lfs_dev *d = devs + dev;
+	uint32_t i, seg;
+
+	for (i = 0; i < segs_per_dev; i++) {
+		seg = ((d->cursor + i) % segs_per_dev) * NUM_DEVICE + dev;
+		if (segs[seg].state == SEG_FREE) {
+			d->cursor = (seg / NUM_DEVICE + 1) % segs_per_dev;
+			segs[seg].state = SEG_OPEN;
+			d->nr_free--;
+			return seg;
+		}
+	}
+
+	return UINT32_MAX;
+}
+
+static void seg_retire(uint32_t seg)
+{
+	if (segs[seg].valid) {
+		segs[seg].state = SEG_USED;
+	} else {
+		segs[seg].state = SEG_DEAD;
+		devs[seg_dev(seg)].nr_dead++;
+	}
+}
+
+static void map_set(uint64_t lpn, uint32_t e)
+{
+	uint32_t old = map[lpn], seg;
+
+	if (old) {
+		seg = ppn_seg(old - 1);
+		if (--segs[seg].valid == 0 && segs[seg].state == SEG_USED)
+			seg_retire(seg);
+		p2l[old - 1] = NO_LPN;
+	}
+	if (e) {
+		segs[ppn_seg(e - 1)].valid++;
+		p2l[e - 1] = lpn;
+	}
+	map[lpn] = e;
+}
+
+/* Appending */
+
+static void chunk_open(struct lfs_dev *d, uint32_t seg, uint32_t off)
+{
+	d->seg = seg;
+	d->off = off;
+	d->ndata = 0;
+	d->cap = (PAGES_PER_SEG - off < CHUNK_PAGES ? PAGES_PER_SEG - off : CHUNK_PAGES) - 1;
+	memset(d->buf, 0, PAGE_SIZE);
+}
+
+static inline bool seg_is_full(struct lfs_dev *d)
+{
+	return d->off + 2 > PAGES_PER_SEG;
+}
+
+static int next_seg(struct lfs_dev *d)
+{
+	uint32_t seg = alloc_seg(d - devs);
+
+	if (seg == UINT32_MAX)
+		return -ENOSPC;
+
+	if (segs[d->seg].state == SEG_OPEN) {
+#ifdef ZONED
+		zoned_finish(d - devs, seg_offset(d->seg));
+#endif
+		seg_retire(d->seg);
+	}
+#ifdef ZONED
+	// Free since the last checkpoint, nothing durable points into it
+	zoned_reset(d - devs, seg_offset(seg));
+#endif
+	chunk_open(d, seg, 0);
+
+	return 0;
+}
+
+static void chunk_flush(struct lfs_dev *d)
+{
+	struct summary *sum = (struct summary *)d->buf;
+
+	if (!sum->nr)
+		return;
+
+	sum->magic = SUM_MAGIC;
+	sum->uuid = uuid;
+	sum->seg = d->seg;
+	sum->ndata = d->ndata;
+	sum->csum = 0;
+	sum->csum = fnv1a(sum, PAGE_SIZE);
+
+#ifdef ZONED
+	zoned_write(d - devs, d->buf, (1 + d->ndata) * PAGE_SIZE,
+		    seg_offset(d->seg) + (off_t)d->off * PAGE_SIZE);
+#else
+	dev_write(d - devs, d->buf, (1 + d->ndata) * PAGE_SIZE,
+		  seg_offset(d->seg) + (off_t)d->off * PAGE_SIZE);
+#endif
+	lstats.summaries++;
+
+	d->off += 1 + d->ndata;
+	if (!seg_is_full(d))
+		chunk_open(d, d->seg, d->off);
+	else if (next_seg(d))
+		chunk_open(d, d->seg, PAGES_PER_SEG - 1);	// nothing fits
+}
+
+static inline bool chunk_full(struct lfs_dev *d)
+{
+	struct summary *sum = (struct summary *)d->buf;
+
+	return d->ndata == d->cap || sum->nr == SUM_ENTRIES ||
+	       (sum->nr && seq - sum->seq >= ENT_TRIM - 1);
+}
+
+static void chunk_add_entry(struct lfs_dev *d, uint32_t lpn, uint32_t flags)
+{
+	struct summary *sum = (struct summary *)d->buf;
+
+	if (!sum->nr)
+		sum->seq = seq;
+	sum->e[sum->nr].lpn = lpn;
+	sum->e[sum->nr].delta = (seq - sum->seq) | flags;
+	sum->nr++;
+	seq++;
+}
+
+// Pages still sitting in a chunk buffer are served from memory
+static char *chunk_lookup(uint32_t ppn)
+{
+	struct lfs_dev *d = devs + seg_dev(ppn_seg(ppn));
+	uint32_t first = d->seg * PAGES_PER_SEG + d->off + 1;
+
+	if (ppn >= first && ppn < first + d->ndata)
+		return d->buf + (1 + ppn - first) * PAGE_SIZE;
+
+	return NULL;
+}
+
+static void append_page(uint64_t lpn, const char *data)
+{
+	struct lfs_dev *d = devs + lpn_dev(lpn);
+	uint32_t ppn;
+
+	if (chunk_full(d))
+		chunk_flush(d);
+	if (!d->cap && next_seg(d)) {
+		lstats.dropped++;
+		return;
+	}
+
+	ppn = d->seg * PAGES_PER_SEG + d->off + 1 + d->ndata;
+	memcpy(d->buf + (1 + d->ndata) * PAGE_SIZE, data, PAGE_SIZE);
+	d->ndata++;
+	chunk_add_entry(d, lpn, 0);
+	segs[d->seg].mtime = seq;
+
+	map_set(lpn, ppn + 1);
+}
+
+// Discards are logged too, or a crash would bring the old data back
+static void trim_page(uint64_t lpn)
+{
+	struct lfs_dev *d = devs + trim_rr;
+
+	if (!map[lpn])
+		return;
+
+	trim_rr = (trim_rr + 1) % NUM_DEVICE;
+	if (chunk_full(d))
+		chunk_flush(d);
+	chunk_add_entry(d, lpn, ENT_TRIM);
+	map_set(lpn, 0);
+}
+
+/* Checkpoints */
+
+static size_t ckpt_size(void)
+{
+	size_t len = sizeof(struct ckpt_hdr) + nr_segs + nr_pages * sizeof(uint32_t);
+
+	return (len + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+}
+
+static void checkpoint(void)
+{
+	struct ckpt_hdr *h = (struct ckpt_hdr *)ckpt_buf;
+	uint8_t *state = (uint8_t *)(h + 1);
+	uint32_t i;
+	int d;
+
+	for (d = 0; d < NUM_DEVICE; d++)
+		chunk_flush(devs + d);
+	for (d = 0; d < NUM_DEVICE; d++)
+		dev_sync(d);
+
+	memset(h, 0, sizeof(*h));
+	h->magic = LFS_MAGIC;
+	h->version = LFS_VERSION;
+	h->seg_k = LFS_SEG_K;
+	h->uuid = uuid;
+	h->id = ckpt_id + 1;
+	h->seq = seq;
+	h->nr_pages = nr_pages;
+	h->nr_segs = nr_segs;
+	for (d = 0; d < NUM_DEVICE; d++) {
+		h->dev[d].seg = devs[d].seg;
+		h->dev[d].off = devs[d].off;
+		h->dev[d].cursor = devs[d].cursor;
+	}
+	for (i = 0; i < nr_segs; i++)
+		state[i] = segs[i].state == SEG_DEAD ? SEG_FREE : segs[i].state;
+	memcpy(state + nr_segs, map, nr_pages * sizeof(uint32_t));
+	h->csum = fnv1a(ckpt_buf, ckpt_len);
+
+	if (pwrite(ckpt_fd, ckpt_buf, ckpt_len, (off_t)(h->id % 2) * ckpt_len) != (ssize_t)ckpt_len ||
+	    fdatasync(ckpt_fd)) {
+		perror("lfs: failed to write checkpoint");
+		return;
+	}
+	ckpt_id++;
+
+	// Nothing durable points into dead segments anymore
+	for (i = 0; i < nr_segs; i++) {
+		if (segs[i].state == SEG_DEAD) {
+			segs[i].state = SEG_FREE;
+			devs[seg_dev(i)].nr_free++;
+		}
+	}
+	for (d = 0; d < NUM_DEVICE; d++)
+		devs[d].nr_dead = 0;
+	lstats.ckpts++;
+}
+
+static bool ckpt_load(int slot)
+{
+	struct ckpt_hdr *h = (struct ckpt_hdr *)ckpt_buf;
+	uint64_t csum;
+
+	if (pread(ckpt_fd, ckpt_buf, ckpt_len, (off_t)slot * ckpt_len) != (ssize_t)ckpt_len)
+		return false;
+	if (h->magic != LFS_MAGIC || h->version != LFS_VERSION ||
+	    h->seg_k != LFS_SEG_K || h->nr_pages != nr_pages || h->nr_segs != nr_segs)
+		return false;
+
+	csum = h->csum;
+	h->csum = 0;
+
+	return fnv1a(ckpt_buf, ckpt_len) == csum;
+}
+
+/* Recovery */
+
+struct replay_ent {
+	uint64_t seq;
+	uint32_t lpn;
+	uint32_t ppn;		// backend page + 1, 0 for a discard
+};
+
+static int replay_cmp(const void *a, const void *b)
+{
+	const struct replay_ent *x = a, *y = b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Walks the chunks appended to a device after the checkpoint, opening
+ * segments in the same order the allocator handed them out
+ */
+static size_t roll_forward(struct lfs_dev *d, uint64_t ckpt_seq,
+			   struct replay_ent **ents, size_t *len, size_t *cap)
+{
+	struct summary *sum = (struct summary *)d->buf;
+	size_t found = 0;
+	uint32_t ppn, seg;
+	uint64_t csum;
+	int i;
+
+	while (1) {
+		// Filled segments stay open until all of their entries are replayed
+		if (seg_is_full(d)) {
+			seg = alloc_seg(d - devs);
+			if (seg == UINT32_MAX)
+				break;
+			d->seg = seg;
+			d->off = 0;
+		}
+		chunk_open(d, d->seg, d->off);
+
+		if (dev_read(d - devs, d->buf, PAGE_SIZE,
+			     seg_offset(d->seg) + (off_t)d->off * PAGE_SIZE) != PAGE_SIZE)
+			break;
+
+		csum = sum->csum;
+		sum->csum = 0;
+		if (sum->magic != SUM_MAGIC || fnv1a(sum, PAGE_SIZE) != csum ||
+		    sum->uuid != uuid || sum->seg != d->seg || sum->seq < ckpt_seq ||
+		    sum->nr > SUM_ENTRIES || sum->ndata > d->cap)
+			break;
+
+		ppn = d->seg * PAGES_PER_SEG + d->off + 1;
+		for (i = 0; i < sum->nr; i++) {
+			if (*len == *cap) {
+				*cap = *cap ? *cap * 2 : 65536;
+				*ents = realloc(*ents, *cap * sizeof(**ents));
+				if (!*ents) {
+					perror("lfs: replay");
+					exit(1);
+				}
+			}
+			(*ents)[*len].seq = sum->seq + (sum->e[i].delta & ~ENT_TRIM);
+			(*ents)[*len].lpn = sum->e[i].lpn;
+			(*ents)[*len].ppn = sum->e[i].delta & ENT_TRIM ? 0 : ++ppn;
+			(*len)++;
+		}
+		found++;
+
+		d->off += 1 + sum->ndata;
+	}
+
+	if (!seg_is_full(d))
+		chunk_open(d, d->seg, d->off);
+
+	return found;
+}
+
+static void recover(void)
+{
+	struct ckpt_hdr *h = (struct ckpt_hdr *)ckpt_buf;
+	uint8_t *state = (uint8_t *)(h + 1);
+	struct replay_ent *ents = NULL;
+	size_t len = 0, cap = 0, chunks = 0, i;
+	uint64_t ckpt_seq, id0 = 0, p;
+	struct lfs_dev *d;
+	int slot = -1;
+
+	if (ckpt_load(0)) {
+		slot = 0;
+		id0 = h->id;
+	}
+	if (ckpt_load(1) && (slot < 0 || h->id > id0))
+		slot = 1;
+	else if (slot == 0)
+		ckpt_load(0);
+
+	if (slot < 0) {
+		printf("lfs: no checkpoint, formatting\n");
+		uuid = lfs_now_ns() ^ ((uint64_t)getpid() << 40);
+		ckpt_id = 0;
+		seq = 1;
+		for (i = 0; i < nr_segs; i++)
+			segs[i].state = SEG_FREE;
+		for (i = 0; i < NUM_DEVICE; i++) {
+			devs[i].nr_free = segs_per_dev;
+			devs[i].cursor = 0;
+			devs[i].seg = i;
+			devs[i].off = PAGES_PER_SEG;
+		}
+	} else {
+		uuid = h->uuid;
+		ckpt_id = h->id;
+		seq = h->seq;
+		for (i = 0; i < nr_segs; i++) {
+			segs[i].state = state[i];
+			if (state[i] == SEG_FREE)
+				devs[seg_dev(i)].nr_free++;
+		}
+		memcpy(map, state + nr_segs, nr_pages * sizeof(uint32_t));
+		for (i = 0; i < NUM_DEVICE; i++) {
+			devs[i].seg = h->dev[i].seg;
+			devs[i].off = h->dev[i].off;
+			devs[i].cursor = h->dev[i].cursor;
+		}
+	}
+	ckpt_seq = seq;
+
+	for (p = 0; p < nr_pages; p++) {
+		if (!map[p])
+			continue;
+		segs[ppn_seg(map[p] - 1)].valid++;
+		p2l[map[p] - 1] = p;
+	}
+
+	for (d = devs; d < devs + NUM_DEVICE; d++)
+		chunks += roll_forward(d, ckpt_seq, &ents, &len, &cap);
+
+	qsort(ents, len, sizeof(*ents), replay_cmp);
+	for (i = 0; i < len; i++) {
+		if (ents[i].lpn >= nr_pages)
+			continue;
+		map_set(ents[i].lpn, ents[i].ppn);
+		if (ents[i].ppn)
+			segs[ppn_seg(ents[i].ppn - 1)].mtime = ents[i].seq;
+		if (ents[i].seq >= seq)
+			seq = ents[i].seq + 1;
+	}
+	free(ents);
+
+	for (i = 0; i < nr_segs; i++) {
+		if (segs[i].state == SEG_OPEN && devs[seg_dev(i)].seg != i)
+			seg_retire(i);
+	}
+
+	printf("lfs: checkpoint %lu, %lu chunks replayed\n", ckpt_id, chunks);
+}
+
+/* Cleaner */
+
+// Cost-benefit: prefer segments with little live data which has gone cold
+static uint32_t pick_victim(int dev)
+{
+	uint32_t i, seg, best = UINT32_MAX;
+	double u, score, best_score = -1;
+
+	for (i = 0; i < segs_per_dev; i++) {
+		seg = i * NUM_DEVICE + dev;
+		if (segs[seg].state != SEG_USED || segs[seg].valid == PAGES_PER_SEG)
+			continue;
+
+		u = (double)segs[seg].valid / PAGES_PER_SEG;
+		score = (1 - u) * (double)(seq - segs[seg].mtime) / (1 + u);
+		if (score > best_score) {
+			best_score = score;
+			best = seg;
+		}
+	}
+
+	return best;
+}
+
+// Copies up to budget live pages out of the device's victim, returns how many
+static unsigned int gc_step(int dev, unsigned int budget)
+{
+	static char page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+	struct lfs_dev *d = devs + dev;
+	unsigned int moved = 0;
+	uint32_t ppn, lpn;
+
+	if (d->victim == UINT32_MAX || segs[d->victim].state != SEG_USED) {
+		d->victim = pick_victim(dev);
+		d->victim_pos = 0;
+		if (d->victim == UINT32_MAX)
+			return 0;
+	}
+
+	while (moved < budget && d->victim_pos < PAGES_PER_SEG && segs[d->victim].valid) {
+		ppn = d->victim * PAGES_PER_SEG + d->victim_pos++;
+
+		lpn = p2l[ppn];
+		if (lpn == NO_LPN)
+			continue;
+
+		dev_read(dev, page, PAGE_SIZE,
+			 seg_offset(d->victim) + (off_t)(ppn % PAGES_PER_SEG) * PAGE_SIZE);
+		append_page(lpn, page);
+		lstats.moved++;
+		moved++;
+	}
+
+	if (!segs[d->victim].valid)
+		lstats.cleaned++;
+	if (!segs[d->victim].valid || d->victim_pos == PAGES_PER_SEG)
+		d->victim = UINT32_MAX;
+
+	return moved;
+}
+
+// Called with lfs_lock held before appending to the device
+static void make_room(int dev)
+{
+	struct lfs_dev *d = devs + dev;
+
+	if (d->nr_free >= low_wm)
+		return;
+
+	lstats.stalls++;
+	while (d->nr_free < low_wm) {
+		if (d->nr_dead) {
+			checkpoint();
+			continue;
+		}
+		if (!gc_step(dev, PAGES_PER_SEG) && !d->nr_dead)
+			break;
+	}
+}
+
+static void *gc_main(void *arg)
+{
+	const unsigned int busy_pages = (uint64_t)LFS_GC_MBPS * 1024 * 1024 / PAGE_SIZE *
+					LFS_GC_TICK_MS / 1000;
+	struct lfs_dev *d;
+	bool idle;
+
+	while (1) {
+		usleep(LFS_GC_TICK_MS * 1000);
+
+		pthread_mutex_lock(&lfs_lock);
+		if (gc_stop) {
+			pthread_mutex_unlock(&lfs_lock);
+			break;
+		}
+
+		idle = lfs_now_ns() - last_fg_ns > LFS_IDLE_MS * 1000000ULL;
+		for (d = devs; d < devs + NUM_DEVICE; d++) {
+			if (d->nr_free + d->nr_dead >= high_wm)
+				continue;
+			gc_step(d - devs, idle ? PAGES_PER_SEG : (busy_pages ? busy_pages : 1));
+			// Hand emptied segments back before writes have to wait for them
+			if (d->nr_free < low_wm * 2 && d->nr_dead)
+				checkpoint();
+		}
+		pthread_mutex_unlock(&lfs_lock);
+	}
+
+	return NULL;
+}
+
+/* Request handling */
+
+void lfs_read(uint64_t lpn, char *buf, unsigned int nr)
+{
+	unsigned int i, n;
+	uint32_t e;
+	char *buffered;
+
+	// The map covers the disksize seen at startup, not a disk grown since
+	if (unlikely(lpn + nr > nr_pages)) {
+		memset(buf, 0, nr * PAGE_SIZE);
+		return;
+	}
+
+	pthread_mutex_lock(&lfs_lock);
+	last_fg_ns = lfs_now_ns();
+
+	for (i = 0; i < nr; i += n) {
+		n = 1;
+		e = map[lpn + i];
+		if (!e) {
+			memset(buf + i * PAGE_SIZE, 0, PAGE_SIZE);
+			continue;
+		}
+
+		buffered = chunk_lookup(e - 1);
+		if (buffered) {
+			memcpy(buf + i * PAGE_SIZE, buffered, PAGE_SIZE);
+			continue;
+		}
+
+		// Pages appended together come back in a single read
+		while (i + n < nr && map[lpn + i + n] == e + n &&
+		       ppn_seg(e - 1 + n) == ppn_seg(e - 1) && !chunk_lookup(e - 1 + n))
+			n++;
+		dev_read(seg_dev(ppn_seg(e - 1)), buf + i * PAGE_SIZE, n * PAGE_SIZE,
+			 seg_offset(ppn_seg(e - 1)) + (off_t)((e - 1) % PAGES_PER_SEG) * PAGE_SIZE);
+	}
+
+	pthread_mutex_unlock(&lfs_lock);
+}
+
+void lfs_write(uint64_t lpn, const char *buf, unsigned int nr)
+{
+	unsigned int i;
+
+	if (unlikely(lpn + nr > nr_pages)) {
+		fprintf(stderr, "lfs: pages %lu-%lu past the map\n", lpn, lpn + nr - 1);
+		return;
+	}
+
+	pthread_mutex_lock(&lfs_lock);
+	last_fg_ns = lfs_now_ns();
+
+	for (i = 0; i < nr; i++) {
+#ifdef ZERO_DETECT
+		if (page_is_zero(buf + i * PAGE_SIZE)) {
+			trim_page(lpn + i);
+			continue;
+		}
+#endif
+		make_room(lpn_dev(lpn + i));
+		append_page(lpn + i, buf + i * PAGE_SIZE);
+		lstats.host++;
+	}
+
+	pthread_mutex_unlock(&lfs_lock);
+}
+
+void lfs_discard(uint64_t lpn, uint64_t nr)
+{
+	if (lpn >= nr_pages)
+		return;
+	if (nr > nr_pages - lpn)
+		nr = nr_pages - lpn;
+
+	pthread_mutex_lock(&lfs_lock);
+	last_fg_ns = lfs_now_ns();
+
+	for (; nr; lpn++, nr--)
+		trim_page(lpn);
+
+	pthread_mutex_unlock(&lfs_lock);
+}
+
+// Partial chunks go out on every flush, checkpoints only every LFS_CKPT_SEC
+void lfs_flush(void)
+{
+	static uint64_t last_ckpt;
+	uint64_t now = lfs_now_ns();
+	int d;
+
+	pthread_mutex_lock(&lfs_lock);
+	if (now - last_ckpt >= LFS_CKPT_SEC * 1000000000ULL) {
+		checkpoint();
+		last_ckpt = now;
+	} else {
+		for (d = 0; d < NUM_DEVICE; d++)
+			chunk_flush(devs + d);
+	}
+	pthread_mutex_unlock(&lfs_lock);
+}
+
+void lfs_stats(void)
+{
+	uint32_t nr_free = 0, nr_dead = 0;
+	uint64_t written;
+	int d;
+
+	pthread_mutex_lock(&lfs_lock);
+	for (d = 0; d < NUM_DEVICE; d++) {
+		nr_free += devs[d].nr_free;
+		nr_dead += devs[d].nr_dead;
+	}
+	written = lstats.host + lstats.moved + lstats.summaries;
+
+	printf("lfs: %u segments, %u free, %u dead, ", nr_segs, nr_free, nr_dead);
+	printf("%lu cleaned, %lu checkpoints\n", lstats.cleaned, lstats.ckpts);
+	printf("lfs: %lu pages written, %lu moved, %lu summaries, ",
+	       lstats.host, lstats.moved, lstats.summaries);
+	printf("write amplification %.2f, %lu stalls\n",
+	       lstats.host ? (double)written / lstats.host : 1.0, lstats.stalls);
+	if (lstats.dropped)
+		printf("lfs: %lu pages dropped, the log is full\n", lstats.dropped);
+#ifdef ZONED
+	zoned_stats();
+#endif
+	pthread_mutex_unlock(&lfs_lock);
+}
+
+int lfs_init(const char *path, uint64_t disksize, uint64_t devsize)
+{
+	uint64_t stripes, dev_pages, room;
+	int i;
+#ifdef ZONED
+	uint32_t nr_zones;
+	int64_t wp;
+	int ret;
+#endif
+
+	if (disksize < PAGE_SIZE) {
+		fprintf(stderr, "lfs: no disksize set for %s\n", CHEEDON_DISKSIZE_PATH);
+		return -EINVAL;
+	}
+
+	nr_pages = disksize / PAGE_SIZE;
+	segs_per_dev = devsize / SEG_SIZE;
+#ifdef ZONED
+	ret = zoned_init(SEG_SIZE, &seg_stride, &nr_zones);
+	if (ret)
+		return ret;
+	segs_per_dev = nr_zones;
+#endif
+	nr_segs = segs_per_dev * NUM_DEVICE;
+	if ((uint64_t)nr_segs * PAGES_PER_SEG >= UINT32_MAX || nr_pages >= UINT32_MAX) {
+		fprintf(stderr, "lfs: volume or backends are too large\n");
+		return -EINVAL;
+	}
+
+	// Keep a few segments per device for the cleaner to move data into
+	low_wm = segs_per_dev / 100 > 2 ? segs_per_dev / 100 : 2;
+	high_wm = low_wm * 4;
+
+	// Busiest device, with one summary page per chunk
+	stripes = (disksize + STRIPE_SIZE - 1) / STRIPE_SIZE;
+	dev_pages = (stripes + NUM_DEVICE - 1) / NUM_DEVICE * (STRIPE_SIZE / PAGE_SIZE);
+	room = segs_per_dev > high_wm ?
+		(uint64_t)(segs_per_dev - high_wm) * (PAGES_PER_SEG - PAGES_PER_SEG / CHUNK_PAGES) : 0;
+	if (dev_pages > room) {
+		fprintf(stderr, "lfs: backends need %s more to hold the volume\n",
+			humanSize((dev_pages - room) * PAGE_SIZE * NUM_DEVICE));
+		return -ENOSPC;
+	}
+
+	ckpt_fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (ckpt_fd < 0) {
+		perror(path);
+		return -errno;
+	}
+
+	ckpt_len = ckpt_size();
+	ckpt_buf = aligned_alloc(PAGE_SIZE, ckpt_len);
+	map = calloc(nr_pages, sizeof(uint32_t));
+	p2l = malloc((uint64_t)nr_segs * PAGES_PER_SEG * sizeof(uint32_t));
+	segs = calloc(nr_segs, sizeof(struct seg_info));
+	if (!ckpt_buf || !map || !p2l || !segs)
+		goto nomem;
+	memset(p2l, 0xff, (uint64_t)nr_segs * PAGES_PER_SEG * sizeof(uint32_t));
+
+	memset(devs, 0, sizeof(devs));
+	for (i = 0; i < NUM_DEVICE; i++) {
+		devs[i].victim = UINT32_MAX;
+		devs[i].buf = aligned_alloc(PAGE_SIZE, CHUNK_PAGES * PAGE_SIZE);
+		if (!devs[i].buf)
+			goto nomem;
+	}
+	memset(&lstats, 0, sizeof(lstats));
+
+	recover();
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+#ifdef ZONED
+		// A chunk torn by a crash moved the write pointer past the log
+		wp = zoned_wp(i, seg_offset(devs[i].seg));
+		if (!seg_is_full(devs + i) && wp > (int64_t)devs[i].off * PAGE_SIZE) {
+			devs[i].off = wp < (int64_t)SEG_SIZE ? wp / PAGE_SIZE : PAGES_PER_SEG;
+			if (!seg_is_full(devs + i))
+				chunk_open(devs + i, devs[i].seg, devs[i].off);
+		}
+#endif
+		if (seg_is_full(devs + i) && next_seg(devs + i)) {
+			fprintf(stderr, "lfs: no free segment on device %d\n", i);
+			return -ENOSPC;
+		}
+#ifdef ZONED
+		zoned_finish_others(i, seg_offset(devs[i].seg));
+#endif
+	}
+
+	// Start over from a compact log
+	checkpoint();
+
+	gc_stop = false;
+	if (pthread_create(&gc_thread, NULL, gc_main, NULL)) {
+		perror("lfs: failed to start the cleaner");
+		return -EAGAIN;
+	}
+
+	printf("lfs: %u segments of %dK, watermarks %u/%u per device\n",
+	       nr_segs, LFS_SEG_K, low_wm, high_wm);
+
+	return 0;
+
+nomem:
+	fprintf(stderr, "lfs: out of memory\n");
+	return -ENOMEM;
+}
+
+void lfs_exit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lfs_lock);
+	gc_stop = true;
+	pthread_mutex_unlock(&lfs_lock);
+	pthread_join(gc_thread, NULL);
+
+	pthread_mutex_lock(&lfs_lock);
+	checkpoint();
+	pthread_mutex_unlock(&lfs_lock);
+
+	close(ckpt_fd);
+	ckpt_fd = -1;
+	for (i = 0; i < NUM_DEVICE; i++)
+		free(devs[i].buf);
+	free(ckpt_buf);
+	free(map);
+	free(p2l);
+	free(segs);
+#ifdef ZONED
+	zoned_exit();
+	seg_stride = SEG_SIZE;
+#endif
+}
+
+#endif
@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Persistent metadata files
+ *
+ * A metadata file is mmap'd as a whole. Callers mark the bytes they modify
+ * with meta_dirty() and meta_flush() writes back only the touched pages.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "user.h"
+
+// Maps at least len bytes of path, growing the file with zeroes if needed
+int meta_open(struct meta *m, const char *path, size_t len, bool *fresh)
+{
+	struct stat st;
+
+	len = (len + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+
+	m->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (m->fd < 0) {
+		perror(path);
+		return -errno;
+	}
+
+	if (fstat(m->fd, &st)) {
+		perror(path);
+		goto err;
+	}
+	*fresh = st.st_size < PAGE_SIZE;
+
+	if ((uint64_t)st.st_size < len && ftruncate(m->fd, len)) {
+		perror(path);
+		goto err;
+	}
+	// Never hide entries of a volume which has been shrunk
+	if ((uint64_t)st.st_size > len)
+		len = (st.st_size + PAGE_SIZE - 1) & ~((off_t)PAGE_SIZE - 1);
+
+	m->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+	if (m->map == MAP_FAILED) {
+		perror(path);
+		m->map = NULL;
+		goto err;
+	}
+	m->len = len;
+
+	m->nr_dirty_words = ((len >> PAGE_SHIFT) + 63) / 64;
+	m->dirty = calloc(m->nr_dirty_words, sizeof(uint64_t));
+	if (!m->dirty) {
+		munmap(m->map, len);
+		m->map = NULL;
+		goto err;
+	}
+	m->is_dirty = false;
+
+	return 0;
+
+err:
+	close(m->fd);
+	m->fd = -1;
+	return -EINVAL;
+}
+
+void meta_close(struct meta *m)
+{
+	if (!m->map)
+		return;
+
+	meta_flush(m);
+	munmap(m->map, m->len);
+	close(m->fd);
+	free(m->dirty);
+	m->map = NULL;
+	m->fd = -1;
+}
+
+static void meta_sync(struct meta *m, uint64_t start, uint64_t len)
+{
+	if (msync(m->map + (start << PAGE_SHIFT), len << PAGE_SHIFT, MS_SYNC))
+		perror("Failed to sync metadata");
+}
+
+// Write back only the pages touched since the last flush
+void meta_flush(struct meta *m)
+{
+	size_t w;
+	uint64_t bits, page, start = 0, len = 0;
+
+	if (!m->map || !m->is_dirty)
+		return;
+
+	for (w = 0; w < m->nr_dirty_words; w++) {
+		bits = m->dirty[w];
+		m->dirty[w] = 0;
+
+		while (bits) {
+			page = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+
+			if (len && page == start + len) {
+				len++;
+				continue;
+			}
+			if (len)
+				meta_sync(m, start, len);
+			start = page;
+			len = 1;
+		}
+	}
+	if (len)
+		meta_sync(m, start, len);
+
+	m->is_dirty = false;
+}
+
+// Flush everything, e.g. after (re)initializing the contents
+void meta_flush_all(struct meta *m)
+{
+	if (msync(m->map, m->len, MS_SYNC))
+		perror("Failed to sync metadata");
+	memset(m->dirty, 0, m->nr_dirty_words * sizeof(uint64_t));
+	m->is_dirty = false;
+}
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Memory-mapped backends
+ *
+ * With -DMMAP every backend is mapped whole and requests are served with
+ * plain copies, no system call per chunk. Meant for files on tmpfs,
+ * hugetlbfs or a DAX filesystem and for pmem, as a RAM speed tier or a
+ * backend that leaves only the transport to benchmark.
+ *
+ * DAX mappings are asked for MAP_SYNC first. There, writes are streamed
+ * to the media with non-temporal stores, bypassing the cache, so that a
+ * fence is all a flush takes. Other files go through the page cache, and
+ * REQ_OP_FLUSH has msync() write back the range written since the last
+ * one. tmpfs, hugetlbfs and DAX mappings are populated upfront, which
+ * allocates the whole of a sparse tmpfs file.
+ *
+ * Reads use memcpy(): the request buffer is handed to the kernel right
+ * after, so it is better left in the cache.
+ */
+
+#ifdef MMAP
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "user.h"
+
+#ifndef MAP_SYNC
+#define MAP_SHARED_VALIDATE	0x03
+#define MAP_SYNC		0x80000
+#endif
+
+#define CACHELINE	64
+
+struct mdev {
+	char *base;
+	size_t len;
+	bool dax;
+	size_t dirty_start, dirty_end;	// written since the last sync
+};
+
+static struct mdev mdevs[NUM_DEVICE];
+
+// Streams whole 16 byte words past the cache, the rest goes through it
+static void nt_copy(char *dst, const char *src, size_t len, bool dax)
+{
+#ifdef __SSE2__
+	char *start = dst;
+	size_t n;
+
+	// Up to the first aligned word
+	n = -(uintptr_t)dst & 15;
+	if (n > len)
+		n = len;
+	memcpy(dst, src, n);
+	dst += n;
+	src += n;
+	len -= n;
+
+	for (; len >= 64; dst += 64, src += 64, len -= 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+	for (; len >= 16; dst += 16, src += 16, len -= 16)
+		_mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+	memcpy(dst, src, len);
+
+	// Cached bytes at either end have to reach the media too
+	if (dax && (n || len)) {
+		_mm_clflush(start);
+		_mm_clflush(dst + len - 1);
+	}
+	_mm_sfence();
+#else
+	memcpy(dst, src, len);
+	(void)dax;
+#endif
+}
+
+static size_t clamp(int dev, size_t len, off_t off)
+{
+	struct mdev *m = mdevs + dev;
+
+	if (off < 0 || (size_t)off >= m->len)
+		return 0;
+
+	return len < m->len - off ? len : m->len - off;
+}
+
+ssize_t mmap_read(int dev, void *buf, size_t len, off_t off)
+{
+	len = clamp(dev, len, off);
+	memcpy(buf, mdevs[dev].base + off, len);
+
+	return len;
+}
+
+ssize_t mmap_write(int dev, const void *buf, size_t len, off_t off)
+{
+	struct mdev *m = mdevs + dev;
+
+	len = clamp(dev, len, off);
+	nt_copy(m->base + off, buf, len, m->dax);
+
+	if (!m->dax && len) {
+		if (m->dirty_end == m->dirty_start || (size_t)off < m->dirty_start)
+			m->dirty_start = off;
+		if (off + len > m->dirty_end)
+			m->dirty_end = off + len;
+	}
+
+	return len;
+}
+
+// Non-temporal stores are fenced already, DAX has nothing left to do
+int mmap_sync(int dev)
+{
+	struct mdev *m = mdevs + dev;
+	size_t start;
+	int ret;
+
+	if (m->dax || !m->base || m->dirty_end == m->dirty_start)
+		return 0;
+
+	// msync() wants a page aligned start
+	start = m->dirty_start & ~(size_t)(PAGE_SIZE - 1);
+	ret = msync(m->base + start, m->dirty_end - start, MS_SYNC);
+	if (!ret)
+		m->dirty_start = m->dirty_end = 0;
+
+	return ret;
+}
+
+static bool in_memory(int fd)
+{
+	struct statfs sfs;
+
+	if (fstatfs(fd, &sfs))
+		return false;
+
+	return sfs.f_type == TMPFS_MAGIC || sfs.f_type == HUGETLBFS_MAGIC;
+}
+
+int mmap_init(const int *fds, const uint64_t *lens)
+{
+	struct mdev *m;
+	void *p;
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		m = mdevs + i;
+		m->len = lens[i];
+		if (!m->len) {
+			fprintf(stderr, "mmap: device %d is empty\n", i);
+			return -EINVAL;
+		}
+
+		p = mmap(NULL, m->len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED_VALIDATE | MAP_SYNC | MAP_POPULATE, fds[i], 0);
+		m->dax = p != MAP_FAILED;
+		if (p == MAP_FAILED)
+			p = mmap(NULL, m->len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | (in_memory(fds[i]) ? MAP_POPULATE : 0), fds[i], 0);
+		if (p == MAP_FAILED) {
+			fprintf(stderr, "mmap: failed to map device %d: %s\n", i, strerror(errno));
+			return -errno;
+		}
+		m->base = p;
+
+		// Fewer TLB misses where the file allows it, ignored otherwise
+		madvise(m->base, m->len, MADV_HUGEPAGE);
+
+		printf("mmap: device %d, %s %s\n", i, humanSize(m->len),
+		       m->dax ? "DAX" : in_memory(fds[i]) ? "in memory" : "through the page cache");
+	}
+
+	return 0;
+}
+
+void mmap_exit(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (!mdevs[i].base)
+			continue;
+		if (mmap_sync(i))
+			perror("mmap: failed to write back");
+		munmap(mdevs[i].base, mdevs[i].len);
+		mdevs[i].base = NULL;
+	}
+}
+
+#endif
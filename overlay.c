@@ -0,0 +1,527 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Copy-on-write overlay on a shared base image
+ *
+ * The volume is split into OVERLAY_K clusters. A persistent map of one
+ * 32-bit entry per cluster tells where each one lives:
+ *
+ *   0          unmodified, read from the base image
+ *   OVL_ZERO   discarded, reads as zeroes
+ *   n          cluster n - 1 of the delta store, the striped backends
+ *
+ * The base is opened read-only and never written, so any number of daemons
+ * can serve volumes on top of one golden image. It is read through the page
+ * cache, even with -DDIRECT, so blocks shared across volumes are cached once.
+ *
+ * A new volume is a new map on fresh backends: provisioning it costs a map
+ * header instead of a full copy of the base. The map records the size and
+ * modification time of the base and a hash of OVL_SAMPLES pages spread over
+ * all of it, and refuses to start on top of anything else. A base moved to
+ * another file with these intact is taken as the same one.
+ *
+ * The first write to a cluster copies the rest of it from the base into the
+ * delta store. Later writes go in place. Discarded delta clusters are only
+ * reused once the map no longer pointing at them has been flushed.
+ */
+
+#ifdef OVERLAY
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "user.h"
+
+#define OMAP_MAGIC	0x4c564f4445454843ULL	// "CHEEDOVL"
+#define OMAP_VERSION	1
+#define OMAP_HDR_SIZE	PAGE_SIZE
+
+#define OVL_ZERO	UINT32_MAX
+
+// Base pages hashed into its identity
+#define OVL_SAMPLES	256
+
+struct omap_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t cluster_size;
+	uint64_t nr_clusters;
+	// A map is only valid on top of the same base
+	uint64_t base_size;
+	uint64_t base_sum;	// of the sampled pages
+	uint64_t base_dev;
+	uint64_t base_ino;
+	int64_t base_mtime;	// ns
+};
+
+static struct meta meta;
+static struct omap_hdr *hdr;
+static uint32_t *map;
+
+static int basefd = -1;
+static uint64_t base_size;
+
+// Delta store, one bit per cluster
+static uint64_t *space;
+static uint64_t nr_delta, cursor;
+
+static struct {
+	uint32_t *cluster;
+	size_t len, cap;
+} pending_free;
+
+static char *cbuf;
+
+static struct {
+	uint64_t delta;		// clusters in the delta store
+	uint64_t zero;		// clusters discarded
+	uint64_t base_read;	// bytes served from the base
+	uint64_t copied;	// clusters copied up from the base
+	uint64_t copy_bytes;	// base bytes read to copy them
+} ostats;
+
+static uint64_t page_sum(uint64_t h, const char *p)
+{
+	int i;
+
+	for (i = 0; i < PAGE_SIZE; i++)
+		h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+
+	return h;
+}
+
+// Past the end of the base reads as zeroes
+static void base_read(uint64_t lpn, char *buf, unsigned int nr)
+{
+	uint64_t off = lpn * PAGE_SIZE, len = (uint64_t)nr * PAGE_SIZE;
+	ssize_t ret = 0;
+
+	if (off < base_size) {
+		ret = pread(basefd, buf, off + len > base_size ? base_size - off : len, off);
+		if (ret < 0) {
+			perror("overlay: failed to read the base");
+			ret = 0;
+		}
+	}
+	if ((uint64_t)ret < len)
+		memset(buf + ret, 0, len - ret);
+}
+
+// Pages evenly apart from the first to the last one
+static uint64_t base_sample_sum(char *page)
+{
+	uint64_t nr = (base_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+
+	if (nr <= 1) {
+		base_read(0, page, 1);
+		return page_sum(h, page);
+	}
+
+	for (i = 0; i < OVL_SAMPLES; i++) {
+		base_read(i * (nr - 1) / (OVL_SAMPLES - 1), page, 1);
+		h = page_sum(h, page);
+	}
+
+	return h;
+}
+
+static void set_base(const struct stat *st, uint64_t sum)
+{
+	hdr->base_size = base_size;
+	hdr->base_sum = sum;
+	hdr->base_dev = st->st_dev;
+	hdr->base_ino = st->st_ino;
+	hdr->base_mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/* Delta store allocator */
+
+static inline bool cluster_used(uint64_t c)
+{
+	return space[c / 64] & (1ULL << (c % 64));
+}
+
+static inline void mark_cluster(uint64_t c, bool used)
+{
+	if (used)
+		space[c / 64] |= 1ULL << (c % 64);
+	else
+		space[c / 64] &= ~(1ULL << (c % 64));
+}
+
+// Next-fit, skipping full words
+static uint64_t alloc_cluster(void)
+{
+	uint64_t c = cursor, scanned;
+
+	for (scanned = 0; scanned < nr_delta; c++, scanned++) {
+		if (c >= nr_delta)
+			c = 0;
+		if (c % 64 == 0 && space[c / 64] == ~0ULL) {
+			c += 63;
+			scanned += 63;
+			continue;
+		}
+		if (!cluster_used(c)) {
+			mark_cluster(c, true);
+			cursor = c + 1;
+			return c;
+		}
+	}
+
+	return UINT64_MAX;
+}
+
+static void defer_free(uint32_t e)
+{
+	if (pending_free.len == pending_free.cap) {
+		pending_free.cap = pending_free.cap ? pending_free.cap * 2 : 1024;
+		pending_free.cluster = realloc(pending_free.cluster,
+					       pending_free.cap * sizeof(uint32_t));
+		if (!pending_free.cluster) {
+			perror("overlay: failed to grow free list");
+			exit(1);
+		}
+	}
+
+	pending_free.cluster[pending_free.len++] = e - 1;
+}
+
+static inline bool is_delta(uint32_t e)
+{
+	return e && e != OVL_ZERO;
+}
+
+static void set_entry(uint64_t cluster, uint32_t e)
+{
+	uint32_t old = map[cluster];
+
+	if (is_delta(old)) {
+		ostats.delta--;
+		defer_free(old);
+	} else if (old == OVL_ZERO) {
+		ostats.zero--;
+	}
+	if (is_delta(e))
+		ostats.delta++;
+	else if (e == OVL_ZERO)
+		ostats.zero++;
+
+	map[cluster] = e;
+	meta_dirty(&meta, OMAP_HDR_SIZE + cluster * sizeof(uint32_t));
+}
+
+static inline uint64_t delta_ppn(uint32_t e)
+{
+	return (uint64_t)(e - 1) * OVERLAY_PAGES_PER_CLUSTER;
+}
+
+static bool range_is_zero(const char *buf, unsigned int nr)
+{
+#ifdef ZERO_DETECT
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!page_is_zero(buf + i * PAGE_SIZE))
+			return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Request handling */
+
+// The map covers the disksize seen at startup, not a disk grown since
+static bool in_map(uint64_t lpn, uint64_t nr)
+{
+	return likely(lpn + nr <= hdr->nr_clusters * OVERLAY_PAGES_PER_CLUSTER);
+}
+
+void overlay_read(uint64_t lpn, char *buf, unsigned int nr)
+{
+	uint64_t cluster;
+	unsigned int off, n;
+	uint32_t e;
+
+	if (unlikely(!in_map(lpn, nr))) {
+		memset(buf, 0, nr * PAGE_SIZE);
+		return;
+	}
+
+	for (; nr; lpn += n, buf += n * PAGE_SIZE, nr -= n) {
+		cluster = lpn / OVERLAY_PAGES_PER_CLUSTER;
+		off = lpn % OVERLAY_PAGES_PER_CLUSTER;
+		n = OVERLAY_PAGES_PER_CLUSTER - off;
+		if (n > nr)
+			n = nr;
+
+		e = map[cluster];
+		if (!e) {
+			base_read(lpn, buf, n);
+			ostats.base_read += n * PAGE_SIZE;
+		} else if (e == OVL_ZERO) {
+			memset(buf, 0, n * PAGE_SIZE);
+		} else {
+			phys_read(delta_ppn(e) + off, buf, n);
+		}
+	}
+}
+
+// NULL buf writes zeroes
+static void write_cluster(uint64_t cluster, unsigned int off, const char *buf,
+			  unsigned int n)
+{
+	uint32_t e = map[cluster];
+	uint64_t c;
+
+	if (is_delta(e)) {
+		if (n == OVERLAY_PAGES_PER_CLUSTER && (!buf || range_is_zero(buf, n))) {
+			set_entry(cluster, OVL_ZERO);
+			return;
+		}
+		if (buf) {
+			phys_write(delta_ppn(e) + off, buf, n);
+		} else {
+			memset(cbuf, 0, n * PAGE_SIZE);
+			phys_write(delta_ppn(e) + off, cbuf, n);
+		}
+		return;
+	}
+
+	// Zeroes over a cluster reading as zeroes, or replacing all of it
+	if ((!buf || range_is_zero(buf, n)) &&
+	    (e == OVL_ZERO || n == OVERLAY_PAGES_PER_CLUSTER)) {
+		set_entry(cluster, OVL_ZERO);
+		return;
+	}
+
+	c = alloc_cluster();
+	if (unlikely(c == UINT64_MAX)) {
+		fprintf(stderr, "overlay: delta store full, cluster %lu lost\n", cluster);
+		return;
+	}
+
+	if (n < OVERLAY_PAGES_PER_CLUSTER) {
+		if (e == OVL_ZERO) {
+			memset(cbuf, 0, OVERLAY_CLUSTER_SIZE);
+		} else {
+			base_read(cluster * OVERLAY_PAGES_PER_CLUSTER, cbuf,
+				  OVERLAY_PAGES_PER_CLUSTER);
+			ostats.copied++;
+			ostats.copy_bytes += OVERLAY_CLUSTER_SIZE;
+		}
+		if (buf)
+			memcpy(cbuf + off * PAGE_SIZE, buf, n * PAGE_SIZE);
+		else
+			memset(cbuf + off * PAGE_SIZE, 0, n * PAGE_SIZE);
+		buf = cbuf;
+	}
+
+	phys_write(c * OVERLAY_PAGES_PER_CLUSTER, buf, OVERLAY_PAGES_PER_CLUSTER);
+	set_entry(cluster, c + 1);
+}
+
+void overlay_write(uint64_t lpn, const char *buf, unsigned int nr)
+{
+	unsigned int off, n;
+
+	if (unlikely(!in_map(lpn, nr))) {
+		fprintf(stderr, "overlay: pages %lu-%lu past the map\n", lpn, lpn + nr - 1);
+		return;
+	}
+
+	for (; nr; lpn += n, nr -= n) {
+		off = lpn % OVERLAY_PAGES_PER_CLUSTER;
+		n = OVERLAY_PAGES_PER_CLUSTER - off;
+		if (n > nr)
+			n = nr;
+
+		write_cluster(lpn / OVERLAY_PAGES_PER_CLUSTER, off, buf, n);
+		if (buf)
+			buf += n * PAGE_SIZE;
+	}
+}
+
+void overlay_discard(uint64_t lpn, uint64_t nr)
+{
+	uint64_t nr_pages = hdr->nr_clusters * OVERLAY_PAGES_PER_CLUSTER;
+	unsigned int n;
+
+	if (lpn >= nr_pages)
+		return;
+	if (nr > nr_pages - lpn)
+		nr = nr_pages - lpn;
+
+	for (; nr; lpn += n, nr -= n) {
+		n = nr > MAX_REQ_PAGES ? MAX_REQ_PAGES : nr;
+		overlay_write(lpn, NULL, n);
+	}
+}
+
+// Discarded clusters become reusable once the map no longer points at them
+void overlay_flush(void)
+{
+	size_t i;
+
+	meta_flush(&meta);
+
+	for (i = 0; i < pending_free.len; i++)
+		mark_cluster(pending_free.cluster[i], false);
+	pending_free.len = 0;
+}
+
+void overlay_stats(void)
+{
+	printf("overlay: %lu clusters in the delta store (%s), %lu discarded, ",
+	       ostats.delta, humanSize(ostats.delta * OVERLAY_CLUSTER_SIZE), ostats.zero);
+	printf("%s read from the base\n", humanSize(ostats.base_read));
+	printf("overlay: %lu clusters copied up, ", ostats.copied);
+	printf("%s of base data\n", humanSize(ostats.copy_bytes));
+}
+
+int overlay_init(const char *path, const char *base, uint64_t disksize, uint64_t physsize)
+{
+	uint64_t nr_clusters, i, sum = 0;
+	struct stat st;
+	char *page;
+	bool fresh;
+	int ret;
+
+	if (!disksize) {
+		fprintf(stderr, "overlay: no disksize set for %s\n", CHEEDON_DISKSIZE_PATH);
+		return -EINVAL;
+	}
+
+	basefd = open(base, O_RDONLY);
+	if (basefd < 0) {
+		perror(base);
+		return -errno;
+	}
+	if (fstat(basefd, &st)) {
+		perror(base);
+		close(basefd);
+		return -errno;
+	}
+	base_size = lseek(basefd, 0, SEEK_END);
+
+	page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	cbuf = aligned_alloc(PAGE_SIZE, OVERLAY_CLUSTER_SIZE);
+	if (!page || !cbuf) {
+		free(page);
+		free(cbuf);
+		close(basefd);
+		fprintf(stderr, "overlay: out of memory\n");
+		return -ENOMEM;
+	}
+	sum = base_sample_sum(page);
+	free(page);
+
+	nr_clusters = (disksize + OVERLAY_CLUSTER_SIZE - 1) / OVERLAY_CLUSTER_SIZE;
+	nr_delta = physsize / OVERLAY_CLUSTER_SIZE;
+	if (nr_delta >= OVL_ZERO)
+		nr_delta = OVL_ZERO - 1;
+
+	ret = meta_open(&meta, path, OMAP_HDR_SIZE + nr_clusters * sizeof(uint32_t), &fresh);
+	if (ret) {
+		close(basefd);
+		return ret;
+	}
+
+	hdr = (struct omap_hdr *)meta.map;
+	map = (uint32_t *)(meta.map + OMAP_HDR_SIZE);
+
+	if (fresh || hdr->magic != OMAP_MAGIC) {
+		memset(meta.map, 0, meta.len);
+		hdr->magic = OMAP_MAGIC;
+		hdr->version = OMAP_VERSION;
+		hdr->cluster_size = OVERLAY_CLUSTER_SIZE;
+		set_base(&st, sum);
+	} else if (hdr->version != OMAP_VERSION || hdr->cluster_size != OVERLAY_CLUSTER_SIZE) {
+		fprintf(stderr, "%s: cluster size mismatch: %u vs %u, refusing to reuse\n",
+			path, hdr->cluster_size, OVERLAY_CLUSTER_SIZE);
+		goto out_close;
+	} else if (hdr->base_size != base_size || hdr->base_sum != sum ||
+		   hdr->base_mtime != st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec) {
+		// Unmodified clusters would silently read something else
+		fprintf(stderr, "%s: made on top of another base than %s, refusing to reuse\n",
+			path, base);
+		goto out_close;
+	} else if (hdr->base_dev != (uint64_t)st.st_dev || hdr->base_ino != st.st_ino) {
+		printf("overlay: %s was moved, same size, time and samples\n", base);
+		set_base(&st, sum);
+	}
+	if (nr_clusters > hdr->nr_clusters)
+		hdr->nr_clusters = nr_clusters;
+	meta_flush_all(&meta);
+
+	// The allocator state is rebuilt from the map instead of being stored
+	memset(&ostats, 0, sizeof(ostats));
+	space = calloc((nr_delta + 63) / 64 + 1, sizeof(uint64_t));
+	if (!space)
+		goto nomem;
+	// Bits past the end never get handed out
+	for (i = nr_delta; i % 64; i++)
+		mark_cluster(i, true);
+	for (i = 0; i < hdr->nr_clusters; i++) {
+		if (map[i] == OVL_ZERO) {
+			ostats.zero++;
+			continue;
+		}
+		if (!map[i])
+			continue;
+		if (map[i] - 1 >= nr_delta) {
+			fprintf(stderr, "overlay: cluster %lu is beyond the backends\n", i);
+			continue;
+		}
+		mark_cluster(map[i] - 1, true);
+		ostats.delta++;
+	}
+	cursor = 0;
+
+	printf("overlay: %dK clusters on a %s base, ", OVERLAY_K, humanSize(base_size));
+	printf("%s of delta store\n", humanSize(nr_delta * OVERLAY_CLUSTER_SIZE));
+
+	return 0;
+
+nomem:
+	fprintf(stderr, "overlay: out of memory\n");
+	meta_close(&meta);
+	close(basefd);
+	return -ENOMEM;
+
+out_close:
+	meta_close(&meta);
+	close(basefd);
+	return -EINVAL;
+}
+
+void overlay_exit(void)
+{
+	overlay_flush();
+	meta_close(&meta);
+	close(basefd);
+	basefd = -1;
+
+	free(space);
+	free(cbuf);
+	space = NULL;
+	cbuf = NULL;
+}
+
+#endif
@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Hardware counter profiling
+ *
+ * With -DPROFILE the daemon thread counts cycles, instructions, cache
+ * misses, context switches and time on CPU through perf_event_open() and
+ * charges them to the pipeline stage it is in, marked by prof_enter().
+ * Counters the CPU or a VM lacks are left out. Other threads
+ * aren't counted. Kernel time is included where perf_event_paranoid allows
+ * it, so a stage making system calls carries their cost.
+ *
+ * The counters are read as one group, with a read() that costs about as
+ * much as a small stage itself. That cost is measured at startup and taken
+ * off every stage.
+ *
+ * Every stats dump prints the counts per request since the previous one,
+ * so a benchmark can dump them after each job.
+ */
+
+#ifdef PROFILE
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "user.h"
+
+// Reads timed to know what one costs
+#define PROF_CALIBRATE	4096
+
+// Opened in this order, task-clock leads as siblings of it are read along
+enum {
+	EV_TIME,
+	EV_CYCLES,
+	EV_INSNS,
+	EV_MISSES,
+	EV_CSW,
+	EV_NR,
+};
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} events[EV_NR] = {
+	[EV_TIME] = { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	[EV_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[EV_INSNS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[EV_MISSES] = { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[EV_CSW] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static const char *const stage_names[PROF_NR_STAGES] = {
+	[PROF_FETCH] = "fetch",
+	[PROF_MAP] = "map",
+	[PROF_BACKEND] = "backend",
+	[PROF_WAIT] = "wait",
+	[PROF_COMPLETE] = "complete",
+	[PROF_ACK] = "ack",
+	[PROF_OTHER] = "other",
+};
+
+static int fds[EV_NR] = { -1, -1, -1, -1, -1 };
+static int pos[EV_NR];		// in the group read, -1 if not counted
+static int leader = -1, nr_open;
+static bool kernel;
+
+static __thread bool counted;	// the thread prof_init() ran on
+static int cur = PROF_OTHER;
+static uint64_t last[EV_NR], cost[EV_NR];
+static uint64_t sums[PROF_NR_STAGES][EV_NR];
+static uint64_t nr_reqs;
+
+static int open_event(int ev, int group, bool with_kernel)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[ev].type;
+	attr.config = events[ev].config;
+	attr.exclude_kernel = !with_kernel;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static int read_events(uint64_t *v)
+{
+	uint64_t buf[1 + EV_NR];
+	int ev;
+
+	if (unlikely(read(leader, buf, sizeof(buf)) < (ssize_t)((1 + nr_open) * sizeof(uint64_t))))
+		return -EIO;
+
+	for (ev = 0; ev < EV_NR; ev++)
+		v[ev] = pos[ev] < 0 ? 0 : buf[1 + pos[ev]];
+
+	return 0;
+}
+
+// Charges what was counted since the last mark to the current stage
+int prof_enter(int stage)
+{
+	uint64_t now[EV_NR], d;
+	int ev, prev;
+
+	if (!counted)
+		return stage;
+
+	prev = cur;
+	cur = stage;
+	if (unlikely(read_events(now)))
+		return prev;
+
+	for (ev = 0; ev < EV_NR; ev++) {
+		d = now[ev] - last[ev];
+		sums[prev][ev] += d > cost[ev] ? d - cost[ev] : 0;
+		last[ev] = now[ev];
+	}
+
+	return prev;
+}
+
+void prof_req(void)
+{
+	if (counted)
+		nr_reqs++;
+}
+
+static void calibrate(void)
+{
+	uint64_t first[EV_NR];
+	int ev, i;
+
+	read_events(first);
+	for (i = 0; i < PROF_CALIBRATE; i++)
+		read_events(last);
+
+	for (ev = 0; ev < EV_NR; ev++)
+		cost[ev] = ev == EV_CSW ? 0 : (last[ev] - first[ev]) / PROF_CALIBRATE;
+}
+
+int prof_init(void)
+{
+	int ev, fd;
+
+	// Kernel time first, user space alone if that isn't allowed
+	kernel = true;
+	for (ev = 0; ev < EV_NR; ev++) {
+		pos[ev] = -1;
+		fd = open_event(ev, leader, kernel);
+		if (fd < 0 && kernel && (errno == EACCES || errno == EPERM)) {
+			kernel = false;
+			fd = open_event(ev, leader, kernel);
+		}
+		if (fd < 0) {
+			// No PMU in many VMs, the software counter still works
+			fprintf(stderr, "prof: no %s counter: %s\n", events[ev].name,
+				strerror(errno));
+			continue;
+		}
+		fds[ev] = fd;
+		pos[ev] = nr_open++;
+		if (leader < 0)
+			leader = fd;
+	}
+	if (leader < 0)
+		return -ENODEV;
+
+	counted = true;
+	calibrate();
+	memset(sums, 0, sizeof(sums));
+	cur = PROF_OTHER;
+
+	printf("prof: %d counters%s, a read takes %lu ns\n", nr_open,
+	       kernel ? "" : ", hardware ones in user space only", cost[EV_TIME]);
+
+	return 0;
+}
+
+void prof_exit(void)
+{
+	int ev;
+
+	for (ev = 0; ev < EV_NR; ev++) {
+		if (fds[ev] >= 0)
+			close(fds[ev]);
+		fds[ev] = -1;
+	}
+	leader = -1;
+	nr_open = 0;
+	counted = false;
+}
+
+// Per request, "-" for a counter not there
+static void print_ev(int s, int ev, int width, int prec)
+{
+	if (pos[ev] < 0)
+		printf(" %*s", width, "-");
+	else
+		printf(" %*.*f", width, prec, (double)sums[s][ev] / nr_reqs);
+}
+
+// Per request since the last call
+void prof_stats(void)
+{
+	uint64_t total = 0;
+	int s, ev;
+
+	if (!counted)
+		return;
+
+	// Up to now, in the stage the daemon is in
+	prof_enter(cur);
+
+	// Shares of cycles, or of time without them
+	ev = pos[EV_CYCLES] >= 0 ? EV_CYCLES : EV_TIME;
+	for (s = 0; s < PROF_NR_STAGES; s++)
+		total += sums[s][ev];
+
+	printf("prof: %lu requests\n", nr_reqs);
+	if (nr_reqs) {
+		printf("prof: %-8s %8s %10s %10s %6s %8s %7s %6s\n", "stage", "ns", "cycles",
+		       "insns", "IPC", "misses", "ctx-sw", "share");
+		for (s = 0; s < PROF_NR_STAGES; s++) {
+			if (!sums[s][EV_TIME] && !sums[s][EV_CYCLES] && !sums[s][EV_CSW])
+				continue;
+			printf("prof: %-8s", stage_names[s]);
+			print_ev(s, EV_TIME, 8, 0);
+			print_ev(s, EV_CYCLES, 10, 0);
+			print_ev(s, EV_INSNS, 10, 0);
+			if (pos[EV_CYCLES] >= 0 && pos[EV_INSNS] >= 0 && sums[s][EV_CYCLES])
+				printf(" %6.2f", (double)sums[s][EV_INSNS] / sums[s][EV_CYCLES]);
+			else
+				printf(" %6s", "-");
+			print_ev(s, EV_MISSES, 8, 1);
+			print_ev(s, EV_CSW, 7, 2);
+			printf(" %5.1f%%\n", total ? sums[s][ev] * 100.0 / total : 0);
+		}
+	}
+
+	memset(sums, 0, sizeof(sums));
+	nr_reqs = 0;
+}
+
+#endif
@@ -4,26 +4,81 @@
  */
 
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/delay.h>
 #include <linux/semaphore.h>
 #include <linux/blkdev.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
 #include <linux/genhd.h>
+#endif
 #include <linux/backing-dev.h>
 #include <linux/blk-mq.h>
 #include <linux/spinlock.h>
+#include <linux/ioprio.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 
 #include "cheedon.h"
 
+#define CREATE_TRACE_POINTS
+#include "cheedon_trace.h"
+
 //static int front, rear;
 //static struct semaphore mutex, slots, items;
 static struct semaphore slots, items;
-static struct list_head free_tag_list, processing_tag_list; 
+static struct list_head free_tag_list;
+// Pending requests, one list per CHEEDON_CLASS_*
+static struct list_head processing_tag_list[CHEEDON_NR_CLASSES];
+static unsigned int passed_over[CHEEDON_NR_CLASSES];
+// Peeked by a daemon and not acked yet, see cheedon_requeue()
+static struct list_head inflight_tag_list;
 static spinlock_t queue_spin;
 
+/*
+ * rw_page() descriptors, one per CPU past the CHEEDON_QUEUE_SIZE shared
+ * ones. They skip the slots semaphore and the free list, so reclaim never
+ * waits for a tag behind queued writeback. The mutex only matters when a
+ * task sleeping in one gets migrated and another takes its old CPU.
+ */
+static DEFINE_PER_CPU(struct mutex, page_lock);
+
 
 // Protect with lock
 struct cheedon_req *reqs = NULL;
 
+static unsigned char cheedon_req_flags(struct request *rq)
+{
+	unsigned char flags = 0;
+
+	if (rq->cmd_flags & REQ_SYNC)
+		flags |= CHEEDON_REQ_SYNC;
+	if (rq->cmd_flags & REQ_META)
+		flags |= CHEEDON_REQ_META;
+	// On the flushes of blk-flush, REQ_FUA never gets here as FUA isn't declared
+	if (rq->cmd_flags & REQ_PREFLUSH)
+		flags |= CHEEDON_REQ_PREFLUSH;
+
+	return flags;
+}
+
+static unsigned char cheedon_class(struct request *rq, int op)
+{
+	switch (IOPRIO_PRIO_CLASS(req_get_ioprio(rq))) {
+	case IOPRIO_CLASS_RT:
+		return CHEEDON_CLASS_URGENT;
+	case IOPRIO_CLASS_IDLE:
+		return CHEEDON_CLASS_BACKGROUND;
+	}
+
+	if (rq->cmd_flags & (REQ_META | REQ_PREFLUSH))
+		return CHEEDON_CLASS_URGENT;
+	// Reads count as sync, writeback doesn't
+	if (op != REQ_OP_DISCARD && op_is_sync(rq->cmd_flags))
+		return CHEEDON_CLASS_NORMAL;
+
+	return CHEEDON_CLASS_BACKGROUND;
+}
+
 // Lock must be held and freed before and after push()
 int cheedon_push(struct request *rq) {
 	struct cheedon_req *req;
@@ -31,14 +86,16 @@ int cheedon_push(struct request *rq) {
 	bool is_rw = true;
 	unsigned long irqflags;
 	struct cheedon_queue_item *item; 
+	unsigned char prio_class;
 
 	op = req_op(rq);
 	if (unlikely(op > 1)) {
 		is_rw = false;
 		switch (op = req_op(rq)) {
 		case REQ_OP_FLUSH:
-			pr_warn("ignoring REQ_OP_FLUSH\n");
-			return SKIP;
+			// Acked once the daemon made earlier writes durable
+			pr_debug("REQ_OP_FLUSH\n");
+			break;
 		case REQ_OP_WRITE_ZEROES:
 			// pr_warn("ignoring REQ_OP_WRITE_ZEROES\n");
 			// return SKIP;
@@ -54,6 +111,8 @@ int cheedon_push(struct request *rq) {
 		}
 	}
 
+	prio_class = cheedon_class(rq, op);
+
 	while(down_interruptible(&slots) == -EINTR) {
 		//pr_info("interrupt - 1\n");
 	}
@@ -64,7 +123,7 @@ int cheedon_push(struct request *rq) {
 	//down(&mutex);
 
 	item = list_first_entry(&free_tag_list, struct cheedon_queue_item, tag_list);
-	list_move_tail(&item->tag_list, &processing_tag_list);
+	list_move_tail(&item->tag_list, &processing_tag_list[prio_class]);
 	id = item->id;
 
 	//id = (rear + 1) % CHEEDON_QUEUE_SIZE; // XXX: Overflow?
@@ -75,49 +134,188 @@ int cheedon_push(struct request *rq) {
 	req = reqs + id;		/* Insert the item */
 
 	req->rq = rq;
+	req->page = NULL;
 	req->is_rw = is_rw;
 
 	req->user.op = op;
 	req->user.pos = (blk_rq_pos(rq) << SECTOR_SHIFT) >> CHEEDON_LOGICAL_BLOCK_SHIFT;
 	req->user.len = blk_rq_bytes(rq);
 	req->user.id = id;
+	req->user.ioprio = req_get_ioprio(rq);
+	req->user.flags = cheedon_req_flags(rq);
+	req->user.prio_class = prio_class;
 	reinit_completion(&req->acked);
 	req->item = item;
+	req->pushed_ns = ktime_get_ns();
+	trace_cheedon_push(req);
 
 	spin_unlock_irqrestore(&queue_spin, irqflags);
 
 	//up(&mutex);	/* Unlock the buffer */
 	up(&items);	/* Announce available item */
+	cheedon_chr_kick();
 
 	return id;
 }
 
-// Queue is locked until pop
-struct cheedon_req *cheedon_peek(void) {
-	int id, ret;
+/*
+ * Highest class first, but a class passed over CHEEDON_CLASS_BURST times
+ * gets the next turn, so writeback still drains under a stream of reads
+ */
+static struct list_head *cheedon_pick_class(void)
+{
+	int c, pick = -1;
+
+	for (c = 0; c < CHEEDON_NR_CLASSES; c++) {
+		if (list_empty(&processing_tag_list[c]))
+			continue;
+		if (pick < 0) {
+			pick = c;
+		} else if (++passed_over[c] >= CHEEDON_CLASS_BURST) {
+			pick = c;
+			break;
+		}
+	}
+	passed_over[pick] = 0;
+
+	return &processing_tag_list[pick];
+}
+
+// Moves the next pending request in flight, an item was taken already
+static struct cheedon_req *cheedon_take(struct file *owner)
+{
+	int id;
 	struct cheedon_queue_item *item;
 	unsigned long irqflags;
 
-	ret = down_interruptible(&items);	/* Wait for available item */
-	if (unlikely(ret < 0))
-		return NULL;
-
 	/* Lock the buffer */
 	//down(&mutex);
 	spin_lock_irqsave(&queue_spin, irqflags);
 	//while(down_interruptible(&mutex) == -EINTR) {
 	//	pr_info("interrupt - 3\n");
 	//}
-	item = list_first_entry(&processing_tag_list, struct cheedon_queue_item, tag_list);
-	list_del(&item->tag_list);
+	item = list_first_entry(cheedon_pick_class(), struct cheedon_queue_item, tag_list);
+	list_move_tail(&item->tag_list, &inflight_tag_list);
 	id = item->id;
+	reqs[id].owner = owner;
 
 	//id = (front + 1) % CHEEDON_QUEUE_SIZE;	/* Remove the item */
 	spin_unlock_irqrestore(&queue_spin, irqflags);
 
+	trace_cheedon_peek(reqs + id);
+
 	return reqs + id;
 }
 
+// Queue is locked until pop
+struct cheedon_req *cheedon_peek(struct file *owner) {
+	int ret;
+
+	ret = down_interruptible(&items);	/* Wait for available item */
+	if (unlikely(ret < 0))
+		return NULL;
+
+	return cheedon_take(owner);
+}
+
+// NULL rather than waiting, for io_uring fetches
+struct cheedon_req *cheedon_try_peek(struct file *owner)
+{
+	if (down_trylock(&items))
+		return NULL;
+
+	return cheedon_take(owner);
+}
+
+// Only the file which peeked a request may ack it
+int cheedon_ack(struct cheedon_req *req, struct file *owner)
+{
+	unsigned long irqflags;
+	int ret = 0;
+
+	spin_lock_irqsave(&queue_spin, irqflags);
+	if (likely(req->owner == owner)) {
+		list_del(&req->item->tag_list);
+		req->owner = NULL;
+	} else {
+		ret = -EINVAL;
+	}
+	spin_unlock_irqrestore(&queue_spin, irqflags);
+
+	return ret;
+}
+
+/*
+ * Puts what a daemon took but never acked back in front of the pending
+ * requests, in the order it was taken, for the next daemon to pick up.
+ * The submitters keep waiting on their completions meanwhile.
+ */
+void cheedon_requeue(struct file *owner)
+{
+	struct cheedon_queue_item *item, *next;
+	struct cheedon_req *req;
+	unsigned long irqflags;
+	int n = 0;
+
+	spin_lock_irqsave(&queue_spin, irqflags);
+	list_for_each_entry_safe_reverse(item, next, &inflight_tag_list, tag_list) {
+		req = reqs + item->id;
+		if (req->owner != owner)
+			continue;
+
+		req->owner = NULL;
+		list_move(&item->tag_list, &processing_tag_list[req->user.prio_class]);
+		trace_cheedon_requeue(req);
+		n++;
+	}
+	spin_unlock_irqrestore(&queue_spin, irqflags);
+
+	if (n)
+		pr_info("requeued %d requests left by the daemon\n", n);
+	while (n--) {
+		up(&items);
+		cheedon_chr_kick();
+	}
+}
+
+// Synchronous single page I/O, for swap
+int cheedon_push_page(struct page *page, sector_t sector, int op)
+{
+	unsigned int cpu = raw_smp_processor_id();
+	struct cheedon_req *req = reqs + CHEEDON_QUEUE_SIZE + cpu;
+	unsigned long irqflags;
+	int ret;
+
+	mutex_lock(&per_cpu(page_lock, cpu));
+
+	req->rq = NULL;
+	req->page = page;
+	req->is_rw = true;
+	req->user.op = op;
+	req->user.pos = (sector << SECTOR_SHIFT) >> CHEEDON_LOGICAL_BLOCK_SHIFT;
+	req->user.len = PAGE_SIZE;
+	req->user.ioprio = 0;
+	req->user.flags = CHEEDON_REQ_SYNC;
+	req->user.prio_class = CHEEDON_CLASS_URGENT;
+	reinit_completion(&req->acked);
+	req->pushed_ns = ktime_get_ns();
+	trace_cheedon_push(req);
+
+	spin_lock_irqsave(&queue_spin, irqflags);
+	list_add_tail(&req->item->tag_list, &processing_tag_list[CHEEDON_CLASS_URGENT]);
+	spin_unlock_irqrestore(&queue_spin, irqflags);
+	up(&items);
+	cheedon_chr_kick();
+
+	wait_for_completion(&req->acked);
+	ret = req->ret;
+	trace_cheedon_complete(req, ret);
+
+	mutex_unlock(&per_cpu(page_lock, cpu));
+
+	return ret;
+}
+
 void cheedon_pop(int id) {
 	unsigned long irqflags;
 	struct cheedon_queue_item *item;
@@ -145,7 +343,21 @@ void cheedon_queue_init(void) {
 	//front = rear = 0;	/* Empty buffer iff front == rear */
 	//sema_init(&mutex, 1);	/* Binary semaphore for locking */
 	INIT_LIST_HEAD(&free_tag_list);
-	INIT_LIST_HEAD(&processing_tag_list);
+	INIT_LIST_HEAD(&inflight_tag_list);
+	for (i = 0; i < CHEEDON_NR_CLASSES; i++) {
+		INIT_LIST_HEAD(&processing_tag_list[i]);
+		passed_over[i] = 0;
+	}
+
+	// Per CPU descriptors keep their item for good
+	for_each_possible_cpu(i) {
+		item = kzalloc(sizeof(struct cheedon_queue_item), GFP_KERNEL);
+		item->id = CHEEDON_QUEUE_SIZE + i;
+		INIT_LIST_HEAD(&item->tag_list);
+		reqs[item->id].item = item;
+		reqs[item->id].user.id = item->id;
+		mutex_init(&per_cpu(page_lock, i));
+	}
 	spin_lock_init(&queue_spin);
 
 	for (i = 0; i < CHEEDON_QUEUE_SIZE; i++) {
@@ -163,7 +375,7 @@ void cheedon_queue_init(void) {
 void cheedon_queue_exit(void) {
 	int i;
 	struct cheedon_req *req;
-	for (i = 0; i < CHEEDON_QUEUE_SIZE; i++) {
+	for (i = 0; i < CHEEDON_NR_REQS; i++) {
 		req = reqs + i;
 		kfree(req->item);
 	}
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Request trace recorder
+ *
+ * Every request fetched from the chardev is appended to RECORD_PATH as a
+ * 16 byte struct record_ent: arrival time, op, position and length. Data
+ * isn't kept. bench/replay.c issues a trace again against any device.
+ */
+
+#ifdef RECORD
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "user.h"
+
+#define RECORD_BUF_ENTS	4096
+
+static struct record_ent buf[RECORD_BUF_ENTS];
+static unsigned int nr_buf;
+static uint64_t start_ns, nr_recorded;
+static int fd = -1;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000L + ts.tv_nsec;
+}
+
+int record_init(const char *path)
+{
+	struct record_hdr hdr = {
+		.magic = RECORD_MAGIC,
+		.version = RECORD_VERSION,
+		.stripe_k = STRIPE_K,
+		.nr_dev = NUM_DEVICE,
+		.start = time(NULL),
+	};
+
+	// A new trace every start, an old one is worth keeping elsewhere
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -errno;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		perror(path);
+		close(fd);
+		fd = -1;
+		return -EIO;
+	}
+
+	start_ns = now_ns();
+	nr_buf = 0;
+	nr_recorded = 0;
+
+	return 0;
+}
+
+void record_flush(void)
+{
+	ssize_t len = nr_buf * sizeof(buf[0]);
+
+	if (fd < 0 || !nr_buf)
+		return;
+
+	if (write(fd, buf, len) != len)
+		perror("record: failed to write the trace");
+	nr_buf = 0;
+}
+
+void record_req(const struct cheedon_req_user *req)
+{
+	struct record_ent *e = buf + nr_buf;
+
+	e->ns = now_ns() - start_ns;
+	e->pos = req->pos;
+	e->pages = req->len / PAGE_SIZE;
+	e->op = req->op;
+	e->prio_class = req->prio_class;
+	nr_recorded++;
+
+	if (++nr_buf == RECORD_BUF_ENTS)
+		record_flush();
+}
+
+void record_stats(void)
+{
+	printf("record: %lu requests traced\n", nr_recorded);
+}
+
+void record_exit(void)
+{
+	record_flush();
+	if (fd >= 0)
+		close(fd);
+	fd = -1;
+}
+
+#endif
@@ -0,0 +1,282 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+#define pr_fmt(fmt) "cheedon: " fmt
+
+/*
+ * In-kernel fast path for plain striping
+ *
+ * A daemon without features of its own registers its backends and stripe
+ * size with CHEEDON_IOC_REMAP. Reads and writes are then cloned, split on
+ * stripe units and sent straight to the backing devices as dm-stripe does,
+ * completing without a round trip through the chardev. Every other request
+ * still goes to the daemon.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/bio.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/wait.h>
+
+#include "cheedon.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+#define submit_bio_noacct generic_make_request
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define bio_clone_fast(bio, gfp, bs) bio_alloc_clone((bio)->bi_bdev, bio, gfp, bs)
+#endif
+
+// Shared with other openers, the daemon has the backends open itself
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define remap_bdev_get(dev) blkdev_get_by_dev(dev, BLK_OPEN_READ | BLK_OPEN_WRITE, NULL, NULL)
+#define remap_bdev_put(bdev) blkdev_put(bdev, NULL)
+#else
+#define remap_bdev_get(dev) blkdev_get_by_dev(dev, FMODE_READ | FMODE_WRITE, NULL)
+#define remap_bdev_put(bdev) blkdev_put(bdev, FMODE_READ | FMODE_WRITE)
+#endif
+
+struct remap_table {
+	struct file *owner;
+	struct block_device *bdev[CHEEDON_MAX_DEVS];
+	unsigned int nr;
+	sector_t stripe_sectors;
+	atomic_t users;		// requests in flight
+};
+
+struct remap_ctx {
+	struct request *rq;
+	struct remap_table *t;
+	atomic_t pending;
+	blk_status_t status;
+};
+
+static struct remap_table __rcu *table;
+static DEFINE_MUTEX(table_mutex);
+static DECLARE_WAIT_QUEUE_HEAD(table_wait);
+/*
+ * Clones and the pieces split off them come from their own pools, so a
+ * clone never waits on a split it holds up. Those submitted earlier sit on
+ * current->bio_list until queue_rq() returns, a rescuer sends them on when
+ * an allocation would have to wait for them.
+ */
+static struct bio_set remap_bs, split_bs;
+
+bool cheedon_remap_active(void)
+{
+	return rcu_access_pointer(table);
+}
+
+bool cheedon_remap_ok(struct request *rq)
+{
+	return cheedon_remap_active() &&
+	       (req_op(rq) == REQ_OP_READ || req_op(rq) == REQ_OP_WRITE);
+}
+
+static void remap_put(struct remap_ctx *ctx)
+{
+	struct remap_table *t = ctx->t;
+
+	if (!atomic_dec_and_test(&ctx->pending))
+		return;
+
+	blk_mq_end_request(ctx->rq, ctx->status);
+	kfree(ctx);
+
+	if (atomic_dec_and_test(&t->users))
+		wake_up(&table_wait);
+}
+
+static void remap_end_io(struct bio *bio)
+{
+	struct remap_ctx *ctx = bio->bi_private;
+
+	if (unlikely(bio->bi_status))
+		WRITE_ONCE(ctx->status, bio->bi_status);
+	bio_put(bio);
+
+	remap_put(ctx);
+}
+
+blk_status_t cheedon_remap(struct request *rq)
+{
+	struct remap_ctx *ctx;
+	struct remap_table *t;
+	struct bio *src, *clone, *split;
+	sector_t chunk;
+	unsigned int dev, in_chunk, n;
+
+	ctx = kmalloc(sizeof(*ctx), GFP_NOIO);
+	if (unlikely(!ctx))
+		return BLK_STS_RESOURCE;
+
+	rcu_read_lock();
+	t = rcu_dereference(table);
+	if (t)
+		atomic_inc(&t->users);
+	rcu_read_unlock();
+	if (unlikely(!t)) {
+		// Unregistered since cheedon_remap_ok(), let blk-mq retry
+		kfree(ctx);
+		return BLK_STS_RESOURCE;
+	}
+
+	ctx->rq = rq;
+	ctx->t = t;
+	ctx->status = BLK_STS_OK;
+	atomic_set(&ctx->pending, 1);
+
+	__rq_for_each_bio(src, rq) {
+		clone = bio_clone_fast(src, GFP_NOIO, &remap_bs);
+
+		// Same mapping as map_page() in the daemon
+		do {
+			chunk = clone->bi_iter.bi_sector;
+			in_chunk = sector_div(chunk, t->stripe_sectors);
+			n = t->stripe_sectors - in_chunk;
+
+			if (bio_sectors(clone) > n) {
+				split = bio_split(clone, n, GFP_NOIO, &split_bs);
+			} else {
+				split = clone;
+				clone = NULL;
+			}
+
+			dev = sector_div(chunk, t->nr);
+			bio_set_dev(split, t->bdev[dev]);
+			split->bi_iter.bi_sector = chunk * t->stripe_sectors + in_chunk;
+			split->bi_end_io = remap_end_io;
+			split->bi_private = ctx;
+
+			atomic_inc(&ctx->pending);
+			submit_bio_noacct(split);
+		} while (clone);
+	}
+
+	remap_put(ctx);
+
+	return BLK_STS_OK;
+}
+
+static void remap_free(struct remap_table *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->nr; i++)
+		remap_bdev_put(t->bdev[i]);
+	kfree(t);
+}
+
+int cheedon_remap_set(struct file *owner, const struct cheedon_remap_user *u)
+{
+	struct remap_table *t;
+	struct inode *inode;
+	struct file *f;
+	unsigned int i;
+	int ret;
+
+	if (!u->nr || u->nr > CHEEDON_MAX_DEVS || !u->stripe_k ||
+	    u->stripe_k % (PAGE_SIZE / 1024))
+		return -EINVAL;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+	t->owner = owner;
+	t->stripe_sectors = u->stripe_k * 2;
+	atomic_set(&t->users, 1);
+
+	for (i = 0; i < u->nr; i++) {
+		f = fget(u->fds[i]);
+		if (!f) {
+			ret = -EBADF;
+			goto out_free;
+		}
+
+		inode = file_inode(f);
+		if (!S_ISBLK(inode->i_mode)) {
+			fput(f);
+			ret = -ENOTBLK;
+			goto out_free;
+		}
+
+		t->bdev[i] = remap_bdev_get(inode->i_rdev);
+		fput(f);
+		if (IS_ERR(t->bdev[i])) {
+			ret = PTR_ERR(t->bdev[i]);
+			goto out_free;
+		}
+		t->nr++;
+	}
+
+	mutex_lock(&table_mutex);
+	if (rcu_access_pointer(table)) {
+		mutex_unlock(&table_mutex);
+		ret = -EBUSY;
+		goto out_free;
+	}
+	rcu_assign_pointer(table, t);
+	mutex_unlock(&table_mutex);
+
+	pr_info("remapping reads and writes over %u devices, %uK stripes\n",
+		u->nr, u->stripe_k);
+
+	return 0;
+
+out_free:
+	remap_free(t);
+	return ret;
+}
+
+// Only the daemon which registered takes the fast path down
+void cheedon_remap_clear(struct file *owner)
+{
+	struct remap_table *t;
+
+	mutex_lock(&table_mutex);
+	t = rcu_dereference_protected(table, lockdep_is_held(&table_mutex));
+	if (!t || (owner && t->owner != owner)) {
+		mutex_unlock(&table_mutex);
+		return;
+	}
+	RCU_INIT_POINTER(table, NULL);
+	mutex_unlock(&table_mutex);
+
+	// Let requests already remapped finish before dropping the backends
+	synchronize_rcu();
+	if (!atomic_dec_and_test(&t->users))
+		wait_event(table_wait, !atomic_read(&t->users));
+	remap_free(t);
+
+	pr_info("remapping stopped\n");
+}
+
+int cheedon_remap_init(void)
+{
+	int ret;
+
+	ret = bioset_init(&remap_bs, BIO_POOL_SIZE, 0, BIOSET_NEED_RESCUER);
+	if (ret)
+		return ret;
+
+	ret = bioset_init(&split_bs, BIO_POOL_SIZE, 0, BIOSET_NEED_RESCUER);
+	if (ret)
+		bioset_exit(&remap_bs);
+
+	return ret;
+}
+
+void cheedon_remap_exit(void)
+{
+	cheedon_remap_clear(NULL);
+	bioset_exit(&split_bs);
+	bioset_exit(&remap_bs);
+}
@@ -0,0 +1,383 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Online array expansion
+ *
+ * To add backends, list them in user.c and build the daemon for the new
+ * NUM_DEVICE with -DRESHAPE -DRESHAPE_FROM=<old count>. Stripe units below
+ * the watermark are laid out over all devices, the ones above still over
+ * the old ones, and a background thread moves units across it in order.
+ * The watermark and the device counts are kept in RESHAPE_PATH, so the
+ * reshape picks up where it was after a restart, without RESHAPE_FROM.
+ *
+ * Unit s goes to row s / NUM_DEVICE, where the old layout kept unit
+ * s * RESHAPE_FROM / NUM_DEVICE or an earlier one. Moving units in order
+ * thus only overwrites units already moved. A batch is kept small enough
+ * that it doesn't overwrite any unit of itself either, so a batch
+ * interrupted by a crash can simply be copied again.
+ *
+ * The copy rate backs off by half whenever the average request takes
+ * longer than RESHAPE_LAT_US, and creeps back up to RESHAPE_MBPS. With no
+ * request for RESHAPE_IDLE_MS it isn't limited at all.
+ *
+ * The volume can only grow once the reshape is done.
+ */
+
+#ifdef RESHAPE
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "user.h"
+
+#define RESHAPE_MAGIC	0x5053524445454843ULL	// "CHEEDRSP"
+#define RESHAPE_VERSION	1
+
+// Alternately written to one of two slots
+struct reshape_state {
+	uint64_t magic;
+	uint64_t csum;
+	uint32_t version;
+	uint32_t stripe_k;
+	uint32_t from;
+	uint32_t to;
+	uint64_t seq;
+	uint64_t wm;
+	uint64_t end;
+};
+
+struct reshape reshape;
+
+static pthread_rwlock_t reshape_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_t reshape_thread;
+static bool reshape_running;
+static volatile bool reshape_stop;
+
+static int state_fd = -1;
+static uint64_t state_seq;
+static uint64_t end;		// units holding the volume
+static char *buf;
+
+// Foreground, written by the daemon and read by the thread
+static uint64_t hold_start_ns, last_io_ns, lat_ns;
+
+static struct {
+	uint64_t moved, batches, backoffs;
+	double mbps;
+} rstats;
+
+static inline uint64_t reshape_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000L + ts.tv_nsec;
+}
+
+static uint64_t fnv1a(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+
+	return h;
+}
+
+static int state_load(struct reshape_state *st)
+{
+	struct reshape_state slot;
+	uint64_t csum;
+	int i, found = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (pread(state_fd, &slot, sizeof(slot), i * PAGE_SIZE) != sizeof(slot))
+			continue;
+		csum = slot.csum;
+		slot.csum = 0;
+		if (slot.magic != RESHAPE_MAGIC || fnv1a(&slot, sizeof(slot)) != csum)
+			continue;
+		if (!found || slot.seq > st->seq)
+			*st = slot;
+		found = 1;
+	}
+
+	return found ? 0 : -ENOENT;
+}
+
+static int state_save(void)
+{
+	struct reshape_state st = {
+		.magic = RESHAPE_MAGIC,
+		.version = RESHAPE_VERSION,
+		.stripe_k = STRIPE_K,
+		.from = reshape.from,
+		.to = NUM_DEVICE,
+		.seq = ++state_seq,
+		.wm = reshape.wm,
+		.end = end,
+	};
+
+	st.csum = fnv1a(&st, sizeof(st));
+	if (pwrite(state_fd, &st, sizeof(st), (st.seq & 1) * PAGE_SIZE) != sizeof(st) ||
+	    fdatasync(state_fd)) {
+		perror("reshape: failed to save the watermark");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Units from the watermark on whose new place is no old place of a unit
+ * past the watermark
+ */
+static uint64_t batch_size(void)
+{
+	uint64_t n = (NUM_DEVICE - reshape.from) * (reshape.wm / NUM_DEVICE);
+
+	if (n < 1)
+		n = 1;
+	if (n > RESHAPE_BATCH)
+		n = RESHAPE_BATCH;
+	if (n > end - reshape.wm)
+		n = end - reshape.wm;
+
+	return n;
+}
+
+static int move_batch(uint64_t n)
+{
+	uint64_t s, wm = reshape.wm;
+	int dev, i;
+
+	for (s = wm; s < wm + n; s++) {
+		dev = s % reshape.from;
+		if (dev_read(dev, buf + (s - wm) * STRIPE_SIZE, STRIPE_SIZE,
+			     (off_t)(s / reshape.from) * STRIPE_SIZE) != STRIPE_SIZE)
+			return -EIO;
+	}
+	for (s = wm; s < wm + n; s++) {
+		dev = s % NUM_DEVICE;
+		if (dev_write(dev, buf + (s - wm) * STRIPE_SIZE, STRIPE_SIZE,
+			      (off_t)(s / NUM_DEVICE) * STRIPE_SIZE) != STRIPE_SIZE)
+			return -EIO;
+	}
+
+	// Copies must be on disk before the watermark passes them
+	for (i = 0; i < NUM_DEVICE; i++)
+		dev_sync(i);
+
+	reshape.wm = wm + n;
+
+	return state_save();
+}
+
+static void *reshape_main(void *arg)
+{
+	double mbps = RESHAPE_MBPS;
+	struct timespec ts;
+	uint64_t n, now, wait_ns;
+	int ret;
+
+	while (!reshape_stop && reshape.wm < end) {
+		pthread_rwlock_wrlock(&reshape_lock);
+		n = batch_size();
+		ret = move_batch(n);
+		pthread_rwlock_unlock(&reshape_lock);
+		if (ret) {
+			fprintf(stderr, "reshape: stopped at unit %lu: %d\n", reshape.wm, ret);
+			break;
+		}
+		rstats.moved += n * STRIPE_SIZE;
+		rstats.batches++;
+
+		now = reshape_now_ns();
+		if (now - __atomic_load_n(&last_io_ns, __ATOMIC_RELAXED) >= RESHAPE_IDLE_MS * 1000000ULL)
+			continue;
+
+		// Additive increase, multiplicative decrease
+		if (__atomic_load_n(&lat_ns, __ATOMIC_RELAXED) > RESHAPE_LAT_US * 1000ULL) {
+			mbps /= 2;
+			if (mbps < 1)
+				mbps = 1;
+			rstats.backoffs++;
+		} else if ((mbps += RESHAPE_MBPS / 16.0) > RESHAPE_MBPS) {
+			mbps = RESHAPE_MBPS;
+		}
+		rstats.mbps = mbps;
+
+		wait_ns = n * STRIPE_SIZE * 1000 / mbps;
+		ts.tv_sec = wait_ns / 1000000000ULL;
+		ts.tv_nsec = wait_ns % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+
+	if (reshape.wm == end)
+		printf("reshape: done, %u devices\n", NUM_DEVICE);
+
+	return NULL;
+}
+
+// Around every request, so units don't move under it
+void reshape_hold(void)
+{
+	pthread_rwlock_rdlock(&reshape_lock);
+	hold_start_ns = reshape_now_ns();
+}
+
+void reshape_release(void)
+{
+	uint64_t now = reshape_now_ns(), lat;
+
+	pthread_rwlock_unlock(&reshape_lock);
+
+	// Average over the last 8 requests or so
+	lat = __atomic_load_n(&lat_ns, __ATOMIC_RELAXED);
+	lat = lat - lat / 8 + (now - hold_start_ns) / 8;
+	__atomic_store_n(&lat_ns, lat, __ATOMIC_RELAXED);
+	__atomic_store_n(&last_io_ns, now, __ATOMIC_RELAXED);
+}
+
+int reshape_init(const char *path, uint64_t disksize, uint64_t devsize)
+{
+	struct reshape_state st = { 0 };
+	int flags = O_RDWR, ret;
+
+	end = (disksize + STRIPE_SIZE - 1) / STRIPE_SIZE;
+	reshape.from = NUM_DEVICE;
+	reshape.wm = end;
+	memset(&rstats, 0, sizeof(rstats));
+	rstats.mbps = RESHAPE_MBPS;
+
+#ifdef RESHAPE_FROM
+	flags |= O_CREAT;
+#endif
+	state_fd = open(path, flags, 0600);
+	if (state_fd < 0) {
+		if (errno == ENOENT)
+			return 0;	// nothing to reshape
+		perror(path);
+		return -errno;
+	}
+
+	ret = state_load(&st);
+	if (!ret && st.wm == st.end) {
+		if (st.to == NUM_DEVICE)
+			return 0;	// done, all devices are in use
+		ret = -ENOENT;		// the next one, from st.to devices
+	}
+	if (ret) {
+#ifdef RESHAPE_FROM
+		if (RESHAPE_FROM < 1 || RESHAPE_FROM >= NUM_DEVICE ||
+		    (st.magic == RESHAPE_MAGIC && st.to != RESHAPE_FROM)) {
+			fprintf(stderr, "reshape: RESHAPE_FROM must be the device count before, below NUM_DEVICE\n");
+			return -EINVAL;
+		}
+		reshape.from = RESHAPE_FROM;
+		reshape.wm = 0;
+		state_seq = 0;
+#else
+		return 0;	// nothing to reshape
+#endif
+	} else {
+		if (st.to != NUM_DEVICE || st.stripe_k != STRIPE_K || st.end != end ||
+		    !st.from || st.from > NUM_DEVICE || st.wm > end) {
+			fprintf(stderr, "reshape: %s is for %u to %u devices of %uK stripes\n",
+				path, st.from, st.to, st.stripe_k);
+			return -EINVAL;
+		}
+#ifdef RESHAPE_FROM
+		if (st.from != RESHAPE_FROM && st.wm < end) {
+			fprintf(stderr, "reshape: %s reshapes from %u devices\n", path, st.from);
+			return -EINVAL;
+		}
+#endif
+		reshape.from = st.from;
+		reshape.wm = st.wm;
+		state_seq = st.seq;
+	}
+
+	if (reshape.wm == end)
+		return 0;
+
+	if (disksize > devsize / STRIPE_SIZE * STRIPE_SIZE * reshape.from) {
+		fprintf(stderr, "reshape: the volume is larger than %u devices, ", reshape.from);
+		fprintf(stderr, "grow it once the reshape is done\n");
+		return -EINVAL;
+	}
+
+	buf = aligned_alloc(PAGE_SIZE, RESHAPE_BATCH * STRIPE_SIZE);
+	if (!buf) {
+		fprintf(stderr, "reshape: out of memory\n");
+		return -ENOMEM;
+	}
+
+	ret = state_save();
+	if (ret)
+		return ret;
+
+	printf("reshape: %u to %u devices, %.1f%% of %lu units moved\n",
+	       reshape.from, NUM_DEVICE, reshape.wm * 100.0 / end, end);
+
+	return 0;
+}
+
+// Once everything replaying writes at startup is done
+int reshape_start(void)
+{
+	if (reshape.wm == end)
+		return 0;
+
+	reshape_stop = false;
+	if (pthread_create(&reshape_thread, NULL, reshape_main, NULL)) {
+		perror("reshape: failed to start");
+		return -EAGAIN;
+	}
+	reshape_running = true;
+
+	return 0;
+}
+
+void reshape_stats(void)
+{
+	if (!rstats.batches && reshape.wm == end)
+		return;
+
+	printf("reshape: %u to %u devices, %.1f%% done, %s moved in %lu batches",
+	       reshape.from, NUM_DEVICE, end ? reshape.wm * 100.0 / end : 100.0,
+	       humanSize(rstats.moved), rstats.batches);
+	printf(", %lu backoffs, limited to %.0f MB/s, requests take %.0f us\n",
+	       rstats.backoffs, rstats.mbps,
+	       __atomic_load_n(&lat_ns, __ATOMIC_RELAXED) / 1000.0);
+}
+
+void reshape_exit(void)
+{
+	if (reshape_running) {
+		reshape_stop = true;
+		pthread_join(reshape_thread, NULL);
+		reshape_running = false;
+	}
+
+	if (state_fd >= 0)
+		close(state_fd);
+	state_fd = -1;
+	free(buf);
+	buf = NULL;
+}
+
+#endif
@@ -0,0 +1,709 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Per-backend I/O scheduler of the io_uring daemon
+ *
+ * Every device has a read queue and a background queue holding writes and
+ * discards in arrival order. Within each request class, reads go first and
+ * writes may pass discards. Adjacent I/Os of the same kind are merged into a
+ * single readv/writev.
+ * Reordering never changes what a read returns: a read waits for earlier
+ * overlapping writes, and overlapping background I/Os never run at once.
+ *
+ * The number of I/Os in flight per device follows AIMD on the lowest
+ * completion latency seen in each SCHED_INTERVAL_MS, as in CoDel. A device
+ * staying above SCHED_TARGET_US even at its best loses a quarter of its
+ * depth. One that kept its whole depth busy below target gains one.
+ *
+ * Reads of mirrored data still running after HEDGE_PCT of their device's
+ * recent reads had completed are sent to the other copy as well. The first
+ * answer completes the read and the other one is cancelled.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include <liburing.h>
+
+#include "user.h"
+
+#define MERGE_MAX_IOV	64
+#define HIST_BUCKETS	(4 * 32)
+// Samples between threshold updates, also halving the histogram
+#define HIST_DECAY	1024
+// Queued I/Os looked at for bypassing or merging
+#define SCAN_WINDOW	32
+
+struct sio {
+	struct sio *next;
+	uint64_t seq;
+	int op;
+	int prio;		// CHEEDON_CLASS_*
+	off_t off;
+	size_t len;
+	char *buf;
+	void *owner;
+
+	// Reads of mirrored data
+	int alt_dev;		// device holding the other copy, or -1
+	off_t alt_off;
+	bool paired;		// hedged, whichever copy answers first wins
+	bool hedge;
+	struct sio *twin;	// the other read, NULL once it has answered
+	struct dispatch *disp;
+};
+
+struct queue {
+	struct sio *head, *tail;
+	unsigned int nr;
+};
+
+struct sched_dev;
+
+struct dispatch {
+	struct dispatch *next, *prev;
+	struct sched_dev *dev;
+	struct sio *ios;
+	int op;
+	off_t off;
+	size_t len;
+	uint64_t start_ns;
+	bool has_alt, hedged, cancelled;
+	int nr_iov;
+	struct iovec iov[MERGE_MAX_IOV];
+};
+
+struct sched_dev {
+	struct queue rq;	// reads
+	struct queue bq;	// writes and discards
+	struct dispatch *inflight;
+	unsigned int nr_inflight, limit;
+	bool saturated, no_discard;
+	unsigned int prio_skips;	// picks since the last one in arrival order
+	uint64_t interval_start, min_lat;
+	uint64_t avg_lat;	// EWMA, 1/8 weight
+
+	// Read latency histogram, quarter octaves of microseconds
+	uint32_t hist[HIST_BUCKETS];
+	uint32_t nr_samples;
+	uint64_t hedge_ns;
+
+	struct {
+		uint64_t ios, merged, up, down, max_lat;
+		uint64_t bytes[3];
+	} st;
+};
+
+static struct sched_dev devs[NUM_DEVICE];
+static struct io_uring *ring;
+static void (*end_io)(void *owner, int err);
+static void (*hold_io)(void *owner);
+static uint64_t seq;
+static char cancel_tag;
+
+static struct {
+	uint64_t issued, won, cancelled;
+} hstats;
+
+static inline uint64_t sched_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000L + ts.tv_nsec;
+}
+
+static inline bool overlap(off_t a, size_t alen, off_t b, size_t blen)
+{
+	return a < b + (off_t)blen && b < a + (off_t)alen;
+}
+
+static void queue_add(struct queue *q, struct sio *s)
+{
+	s->next = NULL;
+	if (q->tail)
+		q->tail->next = s;
+	else
+		q->head = s;
+	q->tail = s;
+	q->nr++;
+}
+
+static void queue_del(struct queue *q, struct sio *prev, struct sio *s)
+{
+	if (prev)
+		prev->next = s->next;
+	else
+		q->head = s->next;
+	if (q->tail == s)
+		q->tail = prev;
+	q->nr--;
+}
+
+static bool inflight_conflict(struct sched_dev *d, struct sio *s)
+{
+	struct dispatch *p;
+
+	for (p = d->inflight; p; p = p->next) {
+		if (p->op != SCHED_READ && overlap(p->off, p->len, s->off, s->len))
+			return true;
+	}
+
+	return false;
+}
+
+// An earlier queued write or discard covers part of the read
+static bool read_blocked(struct sched_dev *d, struct sio *r)
+{
+	struct sio *b;
+
+	for (b = d->bq.head; b && b->seq < r->seq; b = b->next) {
+		if (overlap(b->off, b->len, r->off, r->len))
+			return true;
+	}
+
+	return inflight_conflict(d, r);
+}
+
+// Background I/Os only pass earlier ones they don't overlap
+static bool bg_blocked(struct sched_dev *d, struct sio *s)
+{
+	struct sio *b;
+
+	for (b = d->bq.head; b != s; b = b->next) {
+		if (overlap(b->off, b->len, s->off, s->len))
+			return true;
+	}
+
+	return inflight_conflict(d, s);
+}
+
+static bool blocked(struct sched_dev *d, struct sio *s)
+{
+	return s->op == SCHED_READ ? read_blocked(d, s) : bg_blocked(d, s);
+}
+
+// First runnable I/O of the given kind and class within the scan window
+static struct sio *queue_pick(struct sched_dev *d, struct queue *q, int op, int prio)
+{
+	struct sio *s, *prev = NULL;
+	int n = 0;
+
+	for (s = q->head; s && n < SCAN_WINDOW; prev = s, s = s->next, n++) {
+		if (s->op != op || (prio >= 0 && s->prio != prio) || blocked(d, s))
+			continue;
+		queue_del(q, prev, s);
+		return s;
+	}
+
+	return NULL;
+}
+
+// Queued I/O starting right where the dispatch ends
+static struct sio *queue_pick_next(struct sched_dev *d, struct queue *q, struct dispatch *p)
+{
+	struct sio *s, *prev = NULL;
+	int n = 0;
+
+	for (s = q->head; s && n < SCAN_WINDOW; prev = s, s = s->next, n++) {
+		if (s->op != p->op || s->off != p->off + (off_t)p->len || blocked(d, s))
+			continue;
+		queue_del(q, prev, s);
+		return s;
+	}
+
+	return NULL;
+}
+
+static void dispatch_add(struct dispatch *p, struct sio *s)
+{
+	s->next = p->ios;
+	s->disp = p;
+	p->ios = s;
+	p->len += s->len;
+	if (s->alt_dev >= 0)
+		p->has_alt = true;
+	if (s->op != SCHED_DISCARD) {
+		p->iov[p->nr_iov].iov_base = s->buf;
+		p->iov[p->nr_iov].iov_len = s->len;
+		p->nr_iov++;
+	}
+}
+
+static struct dispatch *dispatch_alloc(struct sched_dev *d, struct sio *s)
+{
+	struct dispatch *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		perror("sched: out of memory");
+		exit(1);
+	}
+	p->dev = d;
+	p->op = s->op;
+	p->off = s->off;
+	dispatch_add(p, s);
+
+	return p;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	if (unlikely(!sqe)) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+
+	return sqe;
+}
+
+static void dispatch_submit(struct sched_dev *d, struct dispatch *p)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	int fd = d - devs;
+
+	switch (p->op) {
+	case SCHED_READ:
+		io_uring_prep_readv(sqe, fd, p->iov, p->nr_iov, p->off);
+		break;
+	case SCHED_WRITE:
+		io_uring_prep_writev(sqe, fd, p->iov, p->nr_iov, p->off);
+		break;
+	case SCHED_DISCARD:
+		io_uring_prep_fallocate(sqe, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					p->off, p->len);
+		break;
+	}
+	// Backends are registered in device order
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqe, p);
+
+	p->start_ns = sched_now_ns();
+	p->next = d->inflight;
+	if (d->inflight)
+		d->inflight->prev = p;
+	d->inflight = p;
+	d->nr_inflight++;
+
+	d->st.ios++;
+	d->st.bytes[p->op] += p->len;
+}
+
+static bool dev_dispatch(struct sched_dev *d)
+{
+	struct dispatch *p;
+	struct queue *q;
+	struct sio *s = NULL;
+	int prio;
+
+	/*
+	 * Class by class, reads before writes. Every SCHED_PRIO_BURST picks
+	 * one goes by arrival alone, so lower classes still move.
+	 */
+	if (++d->prio_skips >= SCHED_PRIO_BURST) {
+		d->prio_skips = 0;
+		s = queue_pick(d, &d->rq, SCHED_READ, -1);
+		if (!s)
+			s = queue_pick(d, &d->bq, SCHED_WRITE, -1);
+	}
+	for (prio = 0; !s && prio < CHEEDON_NR_CLASSES; prio++) {
+		s = queue_pick(d, &d->rq, SCHED_READ, prio);
+		if (!s)
+			s = queue_pick(d, &d->bq, SCHED_WRITE, prio);
+	}
+	if (!s)
+		s = queue_pick(d, &d->bq, SCHED_DISCARD, -1);
+	if (!s)
+		return false;
+	q = s->op == SCHED_READ ? &d->rq : &d->bq;
+
+	p = dispatch_alloc(d, s);
+	while (p->nr_iov < MERGE_MAX_IOV && p->len < SCHED_MERGE_K * 1024 &&
+	       (s = queue_pick_next(d, q, p))) {
+		dispatch_add(p, s);
+		d->st.merged++;
+	}
+
+	dispatch_submit(d, p);
+
+	return true;
+}
+
+static struct sio *sio_alloc(int op, int prio, off_t off, size_t len, char *buf, void *owner)
+{
+	struct sio *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		perror("sched: out of memory");
+		exit(1);
+	}
+	s->op = op;
+	s->prio = prio;
+	s->off = off;
+	s->len = len;
+	s->buf = buf;
+	s->owner = owner;
+	s->alt_dev = -1;
+
+	return s;
+}
+
+void sched_queue(int dev, int op, int prio, off_t off, size_t len, char *buf, void *owner)
+{
+	struct sched_dev *d = devs + dev;
+	struct sio *s;
+
+	if (op == SCHED_DISCARD && d->no_discard) {
+		end_io(owner, 0);
+		return;
+	}
+
+	s = sio_alloc(op, prio, off, len, buf, owner);
+	s->seq = seq++;
+	queue_add(op == SCHED_READ ? &d->rq : &d->bq, s);
+}
+
+// A read which may be hedged to the copy at alt_off on device alt
+void sched_queue_alt(int dev, int prio, off_t off, int alt, off_t alt_off, size_t len,
+		     char *buf, void *owner)
+{
+	struct sio *s = sio_alloc(SCHED_READ, prio, off, len, buf, owner);
+
+	s->seq = seq++;
+	s->alt_dev = alt;
+	s->alt_off = alt_off;
+	queue_add(&devs[dev].rq, s);
+}
+
+unsigned int sched_load(int dev)
+{
+	return devs[dev].nr_inflight + devs[dev].rq.nr + devs[dev].bq.nr;
+}
+
+void sched_dispatch(void)
+{
+	struct sched_dev *d;
+
+	for (d = devs; d < devs + NUM_DEVICE; d++) {
+		while (d->nr_inflight < d->limit) {
+			if (!dev_dispatch(d))
+				break;
+		}
+		if (d->nr_inflight == d->limit)
+			d->saturated = true;
+	}
+}
+
+// AIMD on the best latency of the last interval
+static void adjust_depth(struct sched_dev *d, uint64_t now)
+{
+	if (now - d->interval_start < SCHED_INTERVAL_MS * 1000000ULL)
+		return;
+
+	if (d->min_lat > SCHED_TARGET_US * 1000ULL) {
+		if (d->limit > 1) {
+			d->limit -= (d->limit + 3) / 4;
+			d->st.down++;
+		}
+	} else if (d->saturated && d->limit < SCHED_MAX_DEPTH) {
+		d->limit++;
+		d->st.up++;
+	}
+
+	d->interval_start = now;
+	d->min_lat = UINT64_MAX;
+	d->saturated = false;
+}
+
+static unsigned int hist_bucket(uint64_t us)
+{
+	unsigned int e, m;
+
+	if (!us)
+		return 0;
+	e = 63 - __builtin_clzll(us);
+	m = e >= 2 ? (us >> (e - 2)) & 3 : (us << (2 - e)) & 3;
+
+	return e * 4 + m < HIST_BUCKETS ? e * 4 + m : HIST_BUCKETS - 1;
+}
+
+// Upper end of a bucket, in nanoseconds
+static uint64_t hist_value(unsigned int b)
+{
+	return ((4ULL + b % 4 + 1) << (b / 4)) / 4 * 1000;
+}
+
+/*
+ * The hedge threshold follows HEDGE_PCT of recent read latencies. Halving
+ * the histogram now and then lets it forget a device's earlier behavior.
+ */
+static void account_read(struct sched_dev *d, uint64_t lat)
+{
+	uint64_t total = 0, sum = 0;
+	unsigned int b;
+
+	d->hist[hist_bucket(lat / 1000)]++;
+	if (++d->nr_samples % HIST_DECAY)
+		return;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		total += d->hist[b];
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		sum += d->hist[b];
+		if (sum * 100 >= total * HEDGE_PCT)
+			break;
+	}
+	d->hedge_ns = hist_value(b) > HEDGE_MIN_US * 1000ULL ?
+		      hist_value(b) : HEDGE_MIN_US * 1000ULL;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		d->hist[b] /= 2;
+}
+
+// Every read of the dispatch was answered by its other copy
+static void maybe_cancel(struct dispatch *p)
+{
+	struct io_uring_sqe *sqe;
+	struct sio *s;
+
+	if (p->cancelled)
+		return;
+	for (s = p->ios; s; s = s->next) {
+		if (!s->paired || s->twin)
+			return;
+	}
+
+	sqe = get_sqe();
+	io_uring_prep_cancel(sqe, p, 0);
+	io_uring_sqe_set_data(sqe, &cancel_tag);
+	p->cancelled = true;
+}
+
+static void sio_done(struct sio *s, int err)
+{
+	struct sio *t = s->twin;
+
+	/*
+	 * Both copies are read into the same buffer, so the owner is held
+	 * until the slower one is done as well
+	 */
+	if (s->paired) {
+		if (!t) {
+			// The other copy answered already
+			end_io(s->owner, 0);
+			return;
+		}
+
+		t->twin = NULL;
+		if (err) {
+			// Leave it to the other copy
+			t->paired = false;
+			end_io(s->owner, 0);
+			return;
+		}
+		if (s->hedge)
+			hstats.won++;
+		maybe_cancel(t->disp);
+	}
+
+	end_io(s->owner, err);
+}
+
+// Sends reads stuck past their device's threshold to the other copy
+void sched_hedge(void)
+{
+	uint64_t now = sched_now_ns();
+	struct sched_dev *d, *a;
+	struct dispatch *p;
+	struct sio *s, *h;
+
+	for (d = devs; d < devs + NUM_DEVICE; d++) {
+		for (p = d->inflight; p; p = p->next) {
+			if (p->op != SCHED_READ || !p->has_alt || p->hedged ||
+			    now - p->start_ns < d->hedge_ns)
+				continue;
+			p->hedged = true;
+
+			for (s = p->ios; s; s = s->next) {
+				if (s->alt_dev < 0 || s->paired)
+					continue;
+
+				// Hedges must not pile up on a busy copy
+				a = devs + s->alt_dev;
+				if (a->nr_inflight >= a->limit)
+					continue;
+
+				h = sio_alloc(SCHED_READ, s->prio, s->alt_off, s->len, s->buf, s->owner);
+				h->seq = s->seq;
+				if (read_blocked(a, h)) {
+					free(h);
+					continue;
+				}
+
+				hold_io(s->owner);
+				h->hedge = h->paired = s->paired = true;
+				h->twin = s;
+				s->twin = h;
+				dispatch_submit(a, dispatch_alloc(a, h));
+				hstats.issued++;
+			}
+		}
+	}
+}
+
+// Time until the next read is due for hedging, UINT64_MAX for none
+uint64_t sched_hedge_wait(void)
+{
+	uint64_t now = sched_now_ns(), wait = UINT64_MAX, t;
+	struct sched_dev *d;
+	struct dispatch *p;
+
+	for (d = devs; d < devs + NUM_DEVICE; d++) {
+		for (p = d->inflight; p; p = p->next) {
+			if (p->op != SCHED_READ || !p->has_alt || p->hedged)
+				continue;
+			t = p->start_ns + d->hedge_ns;
+			t = t > now ? t - now : 0;
+			if (t < wait)
+				wait = t;
+		}
+	}
+
+	return wait;
+}
+
+void sched_complete(struct io_uring_cqe *cqe)
+{
+	struct dispatch *p = io_uring_cqe_get_data(cqe);
+	struct sched_dev *d;
+	uint64_t now, lat;
+	struct sio *s, *next;
+	int err = 0;
+
+	if ((void *)p == &cancel_tag) {
+		if (!cqe->res)
+			hstats.cancelled++;
+		return;
+	}
+
+	d = p->dev;
+	now = sched_now_ns();
+	lat = now - p->start_ns;
+
+	if (cqe->res < 0) {
+		if (cqe->res == -ECANCELED) {
+			err = cqe->res;
+		} else if (p->op == SCHED_DISCARD && cqe->res == -EOPNOTSUPP) {
+			fprintf(stderr, "sched: device %d can't discard, skipping discards\n",
+				(int)(d - devs));
+			d->no_discard = true;
+		} else {
+			fprintf(stderr, "sched: device %d I/O failed: %s\n",
+				(int)(d - devs), strerror(-cqe->res));
+			err = cqe->res;
+		}
+	} else if (p->op != SCHED_DISCARD && (size_t)cqe->res != p->len) {
+		fprintf(stderr, "sched: device %d short I/O: %d of %zu\n",
+			(int)(d - devs), cqe->res, p->len);
+		err = -EIO;
+	}
+
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		d->inflight = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+	d->nr_inflight--;
+
+	if (err != -ECANCELED) {
+		d->avg_lat = d->avg_lat ? (d->avg_lat * 7 + lat) / 8 : lat;
+		if (lat < d->min_lat)
+			d->min_lat = lat;
+		if (lat > d->st.max_lat)
+			d->st.max_lat = lat;
+		if (p->op == SCHED_READ)
+			account_read(d, lat);
+	}
+	adjust_depth(d, now);
+
+	for (s = p->ios; s; s = next) {
+		next = s->next;
+		sio_done(s, err);
+		free(s);
+	}
+	free(p);
+}
+
+bool sched_idle(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (devs[i].nr_inflight || devs[i].rq.nr || devs[i].bq.nr)
+			return false;
+	}
+
+	return true;
+}
+
+void sched_stats(void)
+{
+	struct sched_dev *d;
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		d = devs + i;
+		printf("sched: dev%d depth %u (+%lu/-%lu), %u in flight, %u+%u queued, ",
+		       i, d->limit, d->st.up, d->st.down, d->nr_inflight, d->rq.nr, d->bq.nr);
+		printf("latency %.2f ms avg, %.2f ms max\n",
+		       d->avg_lat / 1e6, d->st.max_lat / 1e6);
+		printf("sched: dev%d %lu I/Os, %lu merged, ", i, d->st.ios, d->st.merged);
+		printf("%s read, ", humanSize(d->st.bytes[SCHED_READ]));
+		printf("%s written, ", humanSize(d->st.bytes[SCHED_WRITE]));
+		printf("%s discarded\n", humanSize(d->st.bytes[SCHED_DISCARD]));
+#ifdef MIRROR
+		printf("sched: dev%d hedging reads after %.2f ms\n", i, d->hedge_ns / 1e6);
+#endif
+	}
+#ifdef MIRROR
+	printf("sched: %lu hedged reads, %lu won, %lu losers cancelled\n",
+	       hstats.issued, hstats.won, hstats.cancelled);
+#endif
+	fflush(stdout);
+}
+
+void sched_init(struct io_uring *r, void (*fn)(void *owner, int err),
+		void (*hold)(void *owner))
+{
+	uint64_t now = sched_now_ns();
+	int i;
+
+	ring = r;
+	end_io = fn;
+	hold_io = hold;
+
+	memset(devs, 0, sizeof(devs));
+	for (i = 0; i < NUM_DEVICE; i++) {
+		devs[i].limit = SCHED_INIT_DEPTH;
+		devs[i].interval_start = now;
+		devs[i].min_lat = UINT64_MAX;
+		devs[i].hedge_ns = HEDGE_MIN_US * 1000ULL;
+	}
+	memset(&hstats, 0, sizeof(hstats));
+}
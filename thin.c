@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Thin provisioning
+ *
+ * One bit per THIN_BLOCK_SIZE block tells whether the block has ever been
+ * written. The bitmap lives in a metadata file which is mmap'd as-is, so
+ * startup only needs to validate the header instead of scanning the backends.
+ *
+ * Dirty pages of the mapping are written back by thin_flush(), which the
+ * daemon calls periodically and before exiting.
+ *
+ * Enabling thin mode on an existing volume makes it read as all-zero.
+ * Pages past the disksize seen at startup, after the disk grew, are passed
+ * through as if allocated until the daemon restarts and covers them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "user.h"
+
+#define THIN_MAGIC	0x4e48544445454843ULL	// "CHEEDTHN"
+#define THIN_VERSION	1
+#define THIN_HDR_SIZE	PAGE_SIZE
+
+struct thin_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t nr_blocks;
+	uint64_t nr_allocated;
+};
+
+static struct meta meta;
+static struct thin_hdr *hdr;
+static uint64_t *bitmap;
+
+static inline bool untracked(uint64_t block)
+{
+	static bool warned;
+
+	if (likely(block < hdr->nr_blocks))
+		return false;
+	if (!warned) {
+		fprintf(stderr, "thin: block %lu past the bitmap, restart to track it\n", block);
+		warned = true;
+	}
+
+	return true;
+}
+
+static inline void mark_dirty(uint64_t block)
+{
+	meta_dirty(&meta, THIN_HDR_SIZE + (block / 64) * sizeof(uint64_t));
+	meta_dirty(&meta, 0);
+}
+
+int thin_init(const char *path, uint64_t disksize)
+{
+	uint64_t nr_blocks, bitmap_len;
+	bool fresh;
+	int ret;
+
+	if (!disksize) {
+		fprintf(stderr, "thin: no disksize set for %s\n", CHEEDON_DISKSIZE_PATH);
+		return -EINVAL;
+	}
+
+	nr_blocks = (disksize + THIN_BLOCK_SIZE - 1) / THIN_BLOCK_SIZE;
+	bitmap_len = (nr_blocks + 63) / 64 * sizeof(uint64_t);
+
+	ret = meta_open(&meta, path, THIN_HDR_SIZE + bitmap_len, &fresh);
+	if (ret)
+		return ret;
+
+	hdr = (struct thin_hdr *)meta.map;
+	bitmap = (uint64_t *)(meta.map + THIN_HDR_SIZE);
+
+	if (fresh || hdr->magic != THIN_MAGIC) {
+		memset(meta.map, 0, meta.len);
+		hdr->magic = THIN_MAGIC;
+		hdr->version = THIN_VERSION;
+		hdr->block_size = THIN_BLOCK_SIZE;
+	} else if (hdr->version != THIN_VERSION || hdr->block_size != THIN_BLOCK_SIZE) {
+		fprintf(stderr, "%s: block size mismatch: %u vs %u, refusing to reuse\n",
+			path, hdr->block_size, THIN_BLOCK_SIZE);
+		meta_close(&meta);
+		return -EINVAL;
+	}
+	// Growing the disk only appends zeroed (unallocated) bits
+	hdr->nr_blocks = nr_blocks;
+	meta_flush_all(&meta);
+
+	printf("thin: %lu blocks of %dK, %lu allocated\n",
+	       nr_blocks, THIN_K, hdr->nr_allocated);
+
+	return 0;
+}
+
+void thin_exit(void)
+{
+	meta_close(&meta);
+}
+
+// False past the bitmap, where blocks are passed through
+bool thin_tracked(uint64_t lpn)
+{
+	return !untracked(lpn / THIN_PAGES_PER_BLOCK);
+}
+
+bool thin_test(uint64_t lpn)
+{
+	uint64_t block = lpn / THIN_PAGES_PER_BLOCK;
+
+	if (unlikely(untracked(block)))
+		return true;
+
+	return bitmap[block / 64] & (1ULL << (block % 64));
+}
+
+// Returns true if the block containing lpn was newly allocated
+bool thin_alloc(uint64_t lpn)
+{
+	uint64_t block = lpn / THIN_PAGES_PER_BLOCK;
+	uint64_t mask = 1ULL << (block % 64);
+
+	if (unlikely(untracked(block)))
+		return false;
+	if (likely(bitmap[block / 64] & mask))
+		return false;
+
+	bitmap[block / 64] |= mask;
+	hdr->nr_allocated++;
+	mark_dirty(block);
+
+	return true;
+}
+
+// Only blocks fully covered by the range are released
+void thin_discard(uint64_t lpn, uint64_t nr_pages)
+{
+	uint64_t block, end;
+
+	block = (lpn + THIN_PAGES_PER_BLOCK - 1) / THIN_PAGES_PER_BLOCK;
+	end = (lpn + nr_pages) / THIN_PAGES_PER_BLOCK;
+	if (end > hdr->nr_blocks)
+		end = hdr->nr_blocks;
+
+	for (; block < end; block++) {
+		uint64_t mask = 1ULL << (block % 64);
+
+		if (!(bitmap[block / 64] & mask))
+			continue;
+
+		bitmap[block / 64] &= ~mask;
+		hdr->nr_allocated--;
+		mark_dirty(block);
+	}
+}
+
+void thin_flush(void)
+{
+	meta_flush(&meta);
+}
+
+uint64_t thin_allocated(void)
+{
+	return meta.map ? hdr->nr_allocated * THIN_BLOCK_SIZE : 0;
+}
@@ -17,57 +17,31 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/uio.h>
+#include <signal.h>
+#include <errno.h>
 
 #include <liburing.h>
 
-#define unlikely(x)     __builtin_expect(!!(x), 0)
-
-enum req_opf {
-	/* read sectors from the device */
-	REQ_OP_READ = 0,
-	/* write sectors to the device */
-	REQ_OP_WRITE = 1,
-	/* flush the volatile write cache */
-	REQ_OP_FLUSH = 2,
-	/* discard sectors */
-	REQ_OP_DISCARD = 3,
-	/* get zone information */
-	REQ_OP_ZONE_REPORT = 4,
-	/* securely erase sectors */
-	REQ_OP_SECURE_ERASE = 5,
-	/* seset a zone write pointer */
-	REQ_OP_ZONE_RESET = 6,
-	/* write the same sector many times */
-	REQ_OP_WRITE_SAME = 7,
-	/* write the zero filled sector many times */
-	REQ_OP_WRITE_ZEROES = 9,
-
-	/* SCSI passthrough using struct scsi_request */
-	REQ_OP_SCSI_IN = 32,
-	REQ_OP_SCSI_OUT = 33,
-	/* Driver private requests */
-	REQ_OP_DRV_IN = 34,
-	REQ_OP_DRV_OUT = 35,
-
-	REQ_OP_LAST,
-};
+#include "user.h"
 
-struct cheedon_req_user {
-	// Aligned to 32B
-	int id;
-	int op;
-	char *buf;
-	unsigned int pos;	// sector_t
-	unsigned int len;
-	unsigned int pad[2];
-};
+#ifdef MIRROR
+#if NUM_DEVICE < 2
+#error "MIRROR needs at least two devices"
+#endif
+#ifdef WEIGHTED
+#error "MIRROR keeps both copies in equal stripes, drop WEIGHTED"
+#endif
+#endif
 
-// #define STRIPE_K 128
-#define STRIPE_SIZE (STRIPE_K * 1024)
-#define QUEUE_DEPTH (32 * 2 * 1024 * 1024 / 4096)
+// Every backend I/O in flight, hedges and their cancels, plus a command per slot
+#ifdef MIRROR
+#define QUEUE_DEPTH (NUM_DEVICE * SCHED_MAX_DEPTH * 3 + SCHED_MAX_REQS)
+#else
+#define QUEUE_DEPTH (NUM_DEVICE * SCHED_MAX_DEPTH + SCHED_MAX_REQS)
+#endif
 
 // Warning, output is static so this function is not reentrant
-static const char *humanSize(uint64_t bytes)
+const char *humanSize(uint64_t bytes)
 {
 	static char output[200];
 
@@ -107,37 +81,425 @@ static inline uint64_t ts_to_ns(struct timespec *ts)
 	return ts->tv_sec * (uint64_t) 1000000000L + ts->tv_nsec;
 }
 
-#define POS (req.pos * 4096UL)
+// #define NUM_DEVICE 2
 
-static void *ptr_align(void const *ptr, size_t alignment)
+// Logical page -> device index, with the byte offset on that device
+static inline int map_page(uint64_t lpn, off_t *off)
 {
-	char const *p0 = ptr;
-	char const *p1 = p0 + alignment - 1;
-	return (void *)(p1 - (size_t)p1 % alignment);
+#ifdef WEIGHTED
+	return layout_map(lpn << PAGE_SHIFT, off);
+#else
+	uint64_t addr = lpn << PAGE_SHIFT;
+	uint64_t stripe = addr / STRIPE_SIZE;
+
+	*off = (stripe / NUM_DEVICE) * STRIPE_SIZE + addr % STRIPE_SIZE;
+
+	return stripe % NUM_DEVICE;
+#endif
 }
 
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
+#ifdef MIRROR
+/*
+ * Chained mirroring: stripe unit s has its first copy on device s % N and
+ * its second one on the next device, each device holding a first and a
+ * second copy per row. Half of the space is usable, with any N >= 2.
+ */
+static inline int map_page_copy(uint64_t lpn, int copy, off_t *off)
+{
+	uint64_t addr = lpn << PAGE_SHIFT;
+	uint64_t stripe = addr / STRIPE_SIZE;
+
+	*off = ((stripe / NUM_DEVICE) * 2 + copy) * STRIPE_SIZE + addr % STRIPE_SIZE;
+
+	return (stripe + copy) % NUM_DEVICE;
+}
 #endif
-// #define NUM_DEVICE 2
 
-static char __tmpbuf[2 * 1024 * 1024 + PAGE_SIZE];
-static char *tmpbuf = __tmpbuf;
-int main()
+/*
+ * Requests are fetched and acked by io_uring commands on the chardev, on
+ * the ring of the backend I/O, so nothing blocks outside of waiting for
+ * completions. Each slot has a fetch waiting in the kernel until it gets
+ * a request, and keeps it with its own buffer until its backend I/Os are
+ * done. Writes are acked first, their data is in the buffer after that.
+ * A read is acked along with fetching the next request. A flush waits
+ * for the writes acked before it to reach the backends, and is acked once
+ * all of them were synced.
+ *
+ * Kernels or modules without them get a read() of the chardev at a time
+ * through the ring and synchronous write() acks instead, see legacy_cmd().
+ */
+struct slot {
+	struct cheedon_req_user req;
+	char *buf;
+	int pending;		// backend I/Os, plus one while queueing
+	unsigned int cmd;	// CHEEDON_URING_CMD_* in flight, or 0
+	bool busy;		// holds a request
+	bool flushing;		// a flush waiting for earlier writes
+	uint64_t seq;		// of a write, or the last one before a flush
+};
+
+static struct slot slots[SCHED_MAX_REQS];
+static struct io_uring ring;
+static int chrfd;
+static bool legacy;		// no io_uring commands on the chardev
+static struct slot *fetching;	// the read() in flight with legacy
+static uint64_t write_seq;
+static unsigned int nr_flushing;
+static char fsync_tags[SCHED_MAX_REQS];	// completions of a slot's fsyncs
+
+static volatile sig_atomic_t stop;
+
+static volatile sig_atomic_t dump_stats;
+
+static void stop_handler(int sig)
+{
+	stop = 1;
+}
+
+static void stats_handler(int sig)
+{
+	dump_stats = 1;
+}
+
+static inline struct slot *cqe_slot(struct io_uring_cqe *cqe)
+{
+	uintptr_t p = (uintptr_t)io_uring_cqe_get_data(cqe);
+
+	if (p < (uintptr_t)slots || p >= (uintptr_t)(slots + SCHED_MAX_REQS))
+		return NULL;
+
+	return (struct slot *)p;
+}
+
+static inline struct slot *cqe_fsync(struct io_uring_cqe *cqe)
+{
+	uintptr_t p = (uintptr_t)io_uring_cqe_get_data(cqe);
+
+	if (p < (uintptr_t)fsync_tags || p >= (uintptr_t)(fsync_tags + SCHED_MAX_REQS))
+		return NULL;
+
+	return slots + (p - (uintptr_t)fsync_tags);
+}
+
+// Sized for all of them, unless hedges piled up
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+	if (unlikely(!sqe)) {
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+
+	return sqe;
+}
+
+static void queue_io(struct slot *s);
+
+// The commands done by write(), fetches are left to fetch_request()
+static void legacy_cmd(struct slot *s, unsigned int op)
+{
+	if (op == CHEEDON_URING_CMD_FETCH)
+		return;
+
+	if (unlikely(write(chrfd, &s->req, sizeof(struct cheedon_req_user)) < 0)) {
+		perror("Failed to ack a request");
+		stop = 1;
+		s->busy = false;
+		return;
+	}
+
+	// Like complete_cmd() would
+	if (op == CHEEDON_URING_CMD_COMMIT && s->busy)
+		queue_io(s);
+}
+
+// Reads the next request into an idle slot, one at a time with legacy
+static void fetch_request(void)
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	for (i = 0; i < SCHED_MAX_REQS; i++) {
+		if (!slots[i].busy && !slots[i].cmd)
+			break;
+	}
+	if (i == SCHED_MAX_REQS)
+		return;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (unlikely(!sqe))
+		return;
+
+	fetching = slots + i;
+	io_uring_prep_read(sqe, chrfd, &fetching->req, sizeof(struct cheedon_req_user), 0);
+	io_uring_sqe_set_data(sqe, fetching);
+	fetching->cmd = CHEEDON_URING_CMD_FETCH;
+}
+
+static void queue_cmd(struct slot *s, unsigned int op)
+{
+	struct cheedon_uring_cmd cmd = { .addr = (uintptr_t)&s->req };
+	struct io_uring_sqe *sqe;
+
+	if (legacy) {
+		legacy_cmd(s, op);
+		return;
+	}
+
+	sqe = get_sqe();
+	io_uring_prep_rw(IORING_OP_URING_CMD, sqe, chrfd, NULL, 0, 0);
+	sqe->cmd_op = op;
+	memcpy(sqe->cmd, &cmd, sizeof(cmd));
+	io_uring_sqe_set_data(sqe, s);
+	s->cmd = op;
+}
+
+// Acks the request, and fetches the next one into the slot unless stopping
+static void commit(struct slot *s)
+{
+	queue_cmd(s, stop ? CHEEDON_URING_CMD_COMMIT : CHEEDON_URING_CMD_COMMIT_AND_FETCH);
+}
+
+static void end_io(void *owner, int err)
+{
+	struct slot *s = owner;
+
+	if (--s->pending)
+		return;
+
+	s->busy = false;
+	if (s->req.op == REQ_OP_READ || s->req.op == REQ_OP_FLUSH)
+		commit(s);
+	else if (!stop)
+		queue_cmd(s, CHEEDON_URING_CMD_FETCH);
+}
+
+static void hold_io(void *owner)
+{
+	struct slot *s = owner;
+
+	s->pending++;
+}
+
+// Every backend synced, once no write acked before the flush is going out
+static void start_flushes(void)
+{
+	struct slot *s, *w;
+	int i;
+
+	for (s = slots; s < slots + SCHED_MAX_REQS; s++) {
+		if (!s->flushing)
+			continue;
+		for (w = slots; w < slots + SCHED_MAX_REQS; w++) {
+			if (w->busy && w->seq <= s->seq &&
+			    (w->req.op == REQ_OP_WRITE || w->req.op == REQ_OP_DISCARD))
+				break;
+		}
+		if (w < slots + SCHED_MAX_REQS)
+			continue;
+
+		s->flushing = false;
+		nr_flushing--;
+		s->pending = NUM_DEVICE;
+		for (i = 0; i < NUM_DEVICE; i++) {
+			struct io_uring_sqe *sqe = get_sqe();
+
+			io_uring_prep_fsync(sqe, i, IORING_FSYNC_DATASYNC);
+			io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+			io_uring_sqe_set_data(sqe, fsync_tags + (s - slots));
+		}
+	}
+}
+
+static void end_fsync(struct slot *s, int res)
 {
+	if (unlikely(res < 0))
+		fprintf(stderr, "Failed to sync a backend: %s\n", strerror(-res));
+	end_io(s, res);
+}
+
+static void queue_io(struct slot *s)
+{
+	struct cheedon_req_user *req = &s->req;
+	unsigned int i, n, nr = req->len / PAGE_SIZE;
+	int j, op, prio = req->prio_class;
+	off_t off;
+
+	switch (req->op) {
+	case REQ_OP_READ:
+		op = SCHED_READ;
+		break;
+	case REQ_OP_WRITE:
+		op = SCHED_WRITE;
+		break;
+	default:
+		op = SCHED_DISCARD;
+		break;
+	}
+
+	// One I/O per stripe unit, usually just one as blk.c splits on them
+	s->pending = 1;
+	for (i = 0; i < nr; i += n) {
+#ifdef MIRROR
+		int k;
+		off_t alt_off;
+
+		j = map_page_copy(req->pos + i, 0, &off);
+		k = map_page_copy(req->pos + i, 1, &alt_off);
+#else
+		j = map_page(req->pos + i, &off);
+#endif
+		n = (STRIPE_SIZE - off % STRIPE_SIZE) / PAGE_SIZE;
+		if (n > nr - i)
+			n = nr - i;
+
+		s->pending++;
+#ifdef MIRROR
+		if (op == SCHED_READ) {
+			// Start on the less busy copy, the other one is the hedge
+			if (sched_load(k) < sched_load(j))
+				sched_queue_alt(k, prio, alt_off, j, off, n * PAGE_SIZE,
+						s->buf + i * PAGE_SIZE, s);
+			else
+				sched_queue_alt(j, prio, off, k, alt_off, n * PAGE_SIZE,
+						s->buf + i * PAGE_SIZE, s);
+			continue;
+		}
+
+		s->pending++;
+		sched_queue(k, op, prio, alt_off, n * PAGE_SIZE, s->buf + i * PAGE_SIZE, s);
+#endif
+		sched_queue(j, op, prio, off, n * PAGE_SIZE, s->buf + i * PAGE_SIZE, s);
+	}
+	end_io(s, 0);
+}
+
+static void handle_request(struct slot *s)
+{
+	struct cheedon_req_user *req = &s->req;
+
+/*
+	printf("req[%d]\n"
+		"  pos=%d\n"
+		"  len=%d\n",
+			req->id, req->pos, req->len);
+*/
+
+	req->buf = s->buf;
+	switch (req->op) {
+	case REQ_OP_READ:
+		queue_io(s);
+		break;
+	case REQ_OP_WRITE:
+	case REQ_OP_DISCARD:
+		// Backend I/O starts once this completes
+		s->seq = ++write_seq;
+		queue_cmd(s, CHEEDON_URING_CMD_COMMIT);
+		break;
+	case REQ_OP_FLUSH:
+		s->seq = write_seq;
+		s->flushing = true;
+		nr_flushing++;
+		break;
+	default:
+		s->busy = false;
+		commit(s);
+		break;
+	}
+}
+
+static void complete_cmd(struct slot *s, int res)
+{
+	unsigned int op = s->cmd;
+
+	s->cmd = 0;
+	if (legacy) {
+		// A read() of the chardev, cut short by a signal when stopping
+		fetching = NULL;
+		if (res == sizeof(struct cheedon_req_user))
+			res = 0;
+		else if (res == -EINTR)
+			res = -ECANCELED;
+		else if (res >= 0)
+			res = -EIO;
+	}
+
+	if (unlikely(res < 0)) {
+		s->busy = false;
+		if (res != -ECANCELED) {
+			fprintf(stderr, "Failed to %s a request: %d\n",
+				op == CHEEDON_URING_CMD_FETCH ? "fetch" : "ack", res);
+			stop = 1;
+		}
+		return;
+	}
+
+	if (op == CHEEDON_URING_CMD_COMMIT) {
+		// A write or discard, with its data in; otherwise the last read
+		if (s->busy)
+			queue_io(s);
+		return;
+	}
+
+	s->busy = true;
+	prof_req();
+#ifdef RECORD
+	record_req(&s->req);
+#endif
+	handle_request(s);
+}
+
+static bool slots_idle(void)
+{
+	int i;
+
+	for (i = 0; i < SCHED_MAX_REQS; i++) {
+		// A read() with legacy only returns once there's a request
+		if (slots[i].busy || (slots[i].cmd && slots + i != fetching))
+			return false;
+	}
+
+	return true;
+}
+
+// An unknown command gets -ENOTTY from the chardev, unless it has none
+static bool probe_cmds(void)
+{
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
 	int ret;
-	int chrfd, copyfd[NUM_DEVICE];
-	ssize_t r;
-	struct cheedon_req_user req;
-	unsigned int i, j, loop;
 
-	struct io_uring ring[NUM_DEVICE];
-	struct io_uring_sqe *sqe[QUEUE_DEPTH];
-	struct io_uring_cqe *cqe = NULL;
+	sqe = io_uring_get_sqe(&ring);
+	io_uring_prep_rw(IORING_OP_URING_CMD, sqe, chrfd, NULL, 0, 0);
+	sqe->cmd_op = 0;
+	io_uring_sqe_set_data(sqe, NULL);
+	io_uring_submit(&ring);
+
+	do {
+		ret = io_uring_wait_cqe(&ring, &cqe);
+	} while (ret == -EINTR);
+	if (ret)
+		return false;
+	ret = cqe->res;
+	io_uring_cqe_seen(&ring, cqe);
+
+	return ret == -ENOTTY;
+}
 
-	off_t stripe_in, pos[NUM_DEVICE], moving_pos[NUM_DEVICE];
+int main()
+{
+	int ret;
+	int copyfd[NUM_DEVICE];
+	unsigned int i;
+	struct io_uring_cqe *cqe = NULL;
+	struct sigaction sa;
+	struct slot *s;
+	bool cancelled = false;
+#ifdef MIRROR
+	uint64_t wait;
+#endif
 	const char *dev_name[4];
-	int submitted[NUM_DEVICE];
 
 	chrfd = open("/dev/cheedon_chr", O_RDWR);
 	if (chrfd < 0) {
@@ -169,95 +531,180 @@ int main()
 		}
 	}
 
+#ifdef WEIGHTED
+	{
+		uint64_t lens[NUM_DEVICE];
+
+		for (i = 0; i < NUM_DEVICE; i++)
+			lens[i] = fdlength(copyfd[i]);
+		ret = layout_init(LAYOUT_PATH, copyfd, lens);
+		if (ret) {
+			fprintf(stderr, "Failed to set up the stripe layout: %d\n", ret);
+			exit(1);
+		}
+	}
+#endif
+
 	/* Initialize io_uring */
-	for (i = 0; i < NUM_DEVICE; i++) {
-		io_uring_queue_init(QUEUE_DEPTH, &ring[i], 0);
-		io_uring_register_files(&ring[i], copyfd, NUM_DEVICE);
+	ret = io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
+	if (ret) {
+		fprintf(stderr, "Failed to set up io_uring: %s\n", strerror(-ret));
+		exit(1);
+	}
+	ret = io_uring_register_files(&ring, copyfd, NUM_DEVICE);
+	if (ret) {
+		fprintf(stderr, "Failed to register backends: %s\n", strerror(-ret));
+		exit(1);
 	}
+	sched_init(&ring, end_io, hold_io);
 
-	tmpbuf = ptr_align(tmpbuf, PAGE_SIZE);
+#ifdef WEIGHTED
+	ret = cheedon_geometry(chrfd, STRIPE_K, layout.period);
+#else
+	ret = cheedon_geometry(chrfd, STRIPE_K, NUM_DEVICE);
+#endif
+	if (ret)
+		perror("Failed to pass the stripe geometry");
+
+#ifdef RECORD
+	ret = record_init(RECORD_PATH);
+	if (ret) {
+		fprintf(stderr, "Failed to start the request trace: %d\n", ret);
+		exit(1);
+	}
+#endif
 
-	while (1) {
-		r = read(chrfd, &req, sizeof(struct cheedon_req_user));
-		if (r < 0)
-			break;
+#ifdef FASTPATH
+	if (cheedon_remap(chrfd, copyfd)) {
+		perror("Failed to hand reads and writes to the kernel");
+		exit(1);
+	}
+#endif
 
-		if (req.op != REQ_OP_READ && req.op != REQ_OP_WRITE) {
-			write(chrfd, &req, sizeof(struct cheedon_req_user));
-			continue;
+	for (i = 0; i < SCHED_MAX_REQS; i++) {
+		slots[i].buf = aligned_alloc(PAGE_SIZE, MAX_REQ_SIZE);
+		if (!slots[i].buf) {
+			perror("Failed to allocate request buffers");
+			exit(1);
 		}
+	}
 
-/*
-		printf("req[%d]\n"
-			"  pos=%d\n"
-			"  len=%d\n",
-				req.id, req.pos, req.len);
-*/
+	// No SA_RESTART, so waiting for completions returns for a clean exit
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = stats_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	legacy = !probe_cmds();
+	if (legacy) {
+		printf("No io_uring commands on /dev/cheedon_chr, using read() and write()\n");
+	} else {
+		for (i = 0; i < SCHED_MAX_REQS; i++)
+			queue_cmd(slots + i, CHEEDON_URING_CMD_FETCH);
+	}
 
-		stripe_in = POS / STRIPE_SIZE;
+#ifdef PROFILE
+	// Counts this thread from here on
+	ret = prof_init();
+	if (ret) {
+		fprintf(stderr, "Failed to open the performance counters: %d\n", ret);
+		exit(1);
+	}
+#endif
 
-		for (i = 0; i < NUM_DEVICE; i++) {
-			pos[i] = ((stripe_in / NUM_DEVICE + ((stripe_in % NUM_DEVICE) > i ? 1 : 0)) * STRIPE_SIZE)
-				+ (POS - stripe_in * STRIPE_SIZE) * ((stripe_in % NUM_DEVICE) == i ? 1 : 0);
-			moving_pos[i] = pos[i];
+	/*
+	 * Fetches and acks are issued by io_uring_submit() and completed in
+	 * the kernel meanwhile, so they count as backend and wait
+	 */
+	while (1) {
+		prof_enter(PROF_BACKEND);
+		if (legacy && !stop && !fetching)
+			fetch_request();
+		if (nr_flushing)
+			start_flushes();
+#ifdef MIRROR
+		sched_hedge();
+#endif
+		sched_dispatch();
+		io_uring_submit(&ring);
+
+		// Submitted above, no fetch gets parked after this
+		if (stop && !cancelled && !legacy) {
+			if (ioctl(chrfd, CHEEDON_IOC_CANCEL_FETCH))
+				perror("Failed to cancel the fetches");
+			cancelled = true;
 		}
 
-		req.buf = tmpbuf;
+		// Acked writes must reach the backends before leaving
+		if (stop && sched_idle() && slots_idle())
+			break;
 
-		if (req.op == REQ_OP_WRITE)
-			write(chrfd, &req, sizeof(struct cheedon_req_user));
+		if (dump_stats) {
+			dump_stats = 0;
+			sched_stats();
+#ifdef RECORD
+			record_stats();
+#endif
+#ifdef PROFILE
+			prof_stats();
+#endif
+			fflush(stdout);
+		}
 
-		loop = req.len / 4096;
-		memset(submitted, 0, sizeof(submitted));
-		for (i = 0; i < loop; i++) {
-			j = ((POS + i * 4096) / STRIPE_SIZE) % NUM_DEVICE;
+		prof_enter(PROF_WAIT);
 
-			while (1) {
-				sqe[i] = io_uring_get_sqe(&ring[j]);
-				if (unlikely(!sqe[i])) {
-					perror("Could not get SQE");
-					continue;
-				}
-				break;
+#ifdef MIRROR
+		// Wake up when the oldest read is due for hedging
+		wait = sched_hedge_wait();
+		if (wait != UINT64_MAX) {
+			struct __kernel_timespec ts = {
+				.tv_sec = wait / 1000000000L,
+				.tv_nsec = wait % 1000000000L,
 			};
 
-			if (req.op == REQ_OP_READ)
-				io_uring_prep_read(sqe[i], copyfd[j],
-						   tmpbuf + (i * 4096), 4096,
-						   moving_pos[j]);
-			else
-				io_uring_prep_write(sqe[i], copyfd[j],
-						    tmpbuf + (i * 4096), 4096,
-						    moving_pos[j]);
-			moving_pos[j] += 4096;
-			submitted[j]++;
-		}
-		for (i = 0; i < NUM_DEVICE; i++) {
-			if (submitted[i] == 0)
-				continue;
-			ret = io_uring_submit(&ring[i]);
-			if (unlikely(ret != submitted[i]))
-				fprintf(stderr, "io_uring(%s:%d) number mismatch: %d vs %d\n", __FILE__, __LINE__, ret, submitted[i]);
+			ret = io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+		} else {
+			ret = io_uring_wait_cqe(&ring, &cqe);
 		}
-		// Blocking
-		for (i = 0; i < NUM_DEVICE; i++) {
-			if (submitted[i] == 0)
-				continue;
-			while (1) {
-				ret = io_uring_wait_cqe_nr(&ring[i], &cqe, submitted[i]);
-				if (unlikely(ret != 0)) {
-					fprintf(stderr, "io_uring(%s:%d) failed: %d(%s)\n", __FILE__, __LINE__, ret, strerror(ret * -1));
-					continue;
-				}
-				break;
-			};
-
-			io_uring_cq_advance(&ring[i], submitted[i]);
+		if (ret == -ETIME)
+			continue;
+#else
+		ret = io_uring_wait_cqe(&ring, &cqe);
+#endif
+		if (ret == -EINTR)
+			continue;
+		if (unlikely(ret)) {
+			fprintf(stderr, "io_uring(%s:%d) failed: %d(%s)\n", __FILE__, __LINE__, ret, strerror(ret * -1));
+			break;
 		}
 
-		if (req.op == REQ_OP_READ)
-			write(chrfd, &req, sizeof(struct cheedon_req_user));
+		do {
+			s = cqe_slot(cqe);
+			if (s) {
+				prof_enter(PROF_MAP);
+				complete_cmd(s, cqe->res);
+			} else if ((s = cqe_fsync(cqe))) {
+				prof_enter(PROF_COMPLETE);
+				end_fsync(s, cqe->res);
+			} else {
+				prof_enter(PROF_COMPLETE);
+				sched_complete(cqe);
+			}
+			io_uring_cqe_seen(&ring, cqe);
+		} while (!io_uring_peek_cqe(&ring, &cqe));
 	}
 
+	sched_stats();
+#ifdef RECORD
+	record_stats();
+	record_exit();
+#endif
+#ifdef PROFILE
+	prof_stats();
+	prof_exit();
+#endif
+
 	return 0;
 }
@@ -17,54 +17,13 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/uio.h>
+#include <signal.h>
+#include <errno.h>
 
-#define unlikely(x)     __builtin_expect(!!(x), 0)
-
-enum req_opf {
-	/* read sectors from the device */
-	REQ_OP_READ = 0,
-	/* write sectors to the device */
-	REQ_OP_WRITE = 1,
-	/* flush the volatile write cache */
-	REQ_OP_FLUSH = 2,
-	/* discard sectors */
-	REQ_OP_DISCARD = 3,
-	/* get zone information */
-	REQ_OP_ZONE_REPORT = 4,
-	/* securely erase sectors */
-	REQ_OP_SECURE_ERASE = 5,
-	/* seset a zone write pointer */
-	REQ_OP_ZONE_RESET = 6,
-	/* write the same sector many times */
-	REQ_OP_WRITE_SAME = 7,
-	/* write the zero filled sector many times */
-	REQ_OP_WRITE_ZEROES = 9,
-
-	/* SCSI passthrough using struct scsi_request */
-	REQ_OP_SCSI_IN = 32,
-	REQ_OP_SCSI_OUT = 33,
-	/* Driver private requests */
-	REQ_OP_DRV_IN = 34,
-	REQ_OP_DRV_OUT = 35,
-
-	REQ_OP_LAST,
-};
-
-struct cheedon_req_user {
-	// Aligned to 32B
-	int id;
-	int op;
-	char *buf;
-	unsigned int pos;	// sector_t
-	unsigned int len;
-	unsigned int pad[2];
-};
-
-// #define STRIPE_K 128
-#define STRIPE_SIZE (STRIPE_K * 1024)
+#include "user.h"
 
 // Warning, output is static so this function is not reentrant
-static const char *humanSize(uint64_t bytes)
+const char *humanSize(uint64_t bytes)
 {
 	static char output[200];
 
@@ -113,29 +72,574 @@ static void *ptr_align(void const *ptr, size_t alignment)
 	return (void *)(p1 - (size_t)p1 % alignment);
 }
 
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
-#endif
 // #define NUM_DEVICE 2
 
+#if defined(COMPRESS) && defined(THIN)
+#error "COMPRESS already keeps unwritten chunks unallocated, drop THIN"
+#endif
+#if defined(DEDUP) && (defined(THIN) || defined(COMPRESS))
+#error "DEDUP maps every page by itself, drop THIN and COMPRESS"
+#endif
+#if defined(LFS) && (defined(THIN) || defined(COMPRESS) || defined(DEDUP))
+#error "LFS places every page by itself, drop THIN, COMPRESS and DEDUP"
+#endif
+#if defined(LFS) && defined(WEIGHTED)
+#error "LFS keeps one log per device, drop WEIGHTED"
+#endif
+#if defined(ZONED) && !defined(LFS)
+#error "ZONED lays LFS segments onto zones, build with LFS"
+#endif
+#if defined(ZONED) && !defined(DIRECT)
+#error "ZONED needs DIRECT, writes must reach zones in order"
+#endif
+#if defined(RESHAPE) && (defined(WEIGHTED) || defined(COMPRESS) || defined(DEDUP) || \
+    defined(LFS) || defined(OVERLAY))
+#error "RESHAPE moves plain stripes, drop WEIGHTED, COMPRESS, DEDUP, LFS and OVERLAY"
+#endif
+#if defined(MMAP) && defined(ZONED)
+#error "Zones can't be written through a mapping, drop MMAP"
+#endif
+#if defined(OVERLAY) && (defined(THIN) || defined(COMPRESS) || defined(DEDUP) || defined(LFS))
+#error "OVERLAY maps every cluster by itself, drop THIN, COMPRESS, DEDUP and LFS"
+#endif
+
 static char __tmpbuf[2 * 1024 * 1024 + PAGE_SIZE];
 static char *tmpbuf = __tmpbuf;
+static const char zero_page[PAGE_SIZE] __maybe_unused __attribute__((aligned(PAGE_SIZE)));
+static int copyfd[NUM_DEVICE];
+
+static volatile sig_atomic_t stop;
+
+static volatile sig_atomic_t dump_stats;
+
+static void stop_handler(int sig)
+{
+	stop = 1;
+}
+
+static void stats_handler(int sig)
+{
+	dump_stats = 1;
+}
+
+// Logical page -> device index, with the byte offset on that device
+static inline int map_page(uint64_t lpn, off_t *off)
+{
+#ifdef WEIGHTED
+	return layout_map(lpn << PAGE_SHIFT, off);
+#else
+	uint64_t addr = lpn << PAGE_SHIFT;
+	uint64_t stripe = addr / STRIPE_SIZE;
+#ifdef RESHAPE
+	unsigned int ndev = reshape_ndev(stripe);
+#else
+	unsigned int ndev = NUM_DEVICE;
+#endif
+
+	*off = (stripe / ndev) * STRIPE_SIZE + addr % STRIPE_SIZE;
+
+	return stripe % ndev;
+#endif
+}
+
+// Raw access to a single backend, for modes doing their own placement
+ssize_t dev_read(int dev, void *buf, size_t len, off_t off)
+{
+	int stage = prof_enter(PROF_BACKEND);
+	ssize_t ret;
+
+#ifdef MMAP
+	ret = mmap_read(dev, buf, len, off);
+#else
+	ret = pread(copyfd[dev], buf, len, off);
+#endif
+	prof_enter(stage);
+
+	return ret;
+}
+
+ssize_t dev_write(int dev, const void *buf, size_t len, off_t off)
+{
+	int stage = prof_enter(PROF_BACKEND);
+	ssize_t ret;
+
+#ifdef MMAP
+	ret = mmap_write(dev, buf, len, off);
+#else
+	ret = pwrite(copyfd[dev], buf, len, off);
+#endif
+	prof_enter(stage);
+
+	return ret;
+}
+
+void dev_sync(int dev)
+{
+	int stage = prof_enter(PROF_BACKEND);
+
+#ifdef MMAP
+	if (mmap_sync(dev))
+#else
+	if (fdatasync(copyfd[dev]))
+#endif
+		perror("Failed to sync device");
+	prof_enter(stage);
+}
+
+// For modes managing the backends beyond plain I/O, like zone resets
+int dev_fd(int dev)
+{
+	return copyfd[dev];
+}
+
+// Linear I/O over the striped backend space, merged per stripe unit
+void phys_read(uint64_t ppn, char *buf, unsigned int nr)
+{
+	unsigned int n;
+	off_t off;
+	int j;
+
+	for (; nr; ppn += n, buf += n * PAGE_SIZE, nr -= n) {
+		j = map_page(ppn, &off);
+		n = (STRIPE_SIZE - off % STRIPE_SIZE) / PAGE_SIZE;
+		if (n > nr)
+			n = nr;
+
+		dev_read(j, buf, n * PAGE_SIZE, off);
+	}
+}
+
+void phys_write(uint64_t ppn, const char *buf, unsigned int nr)
+{
+	unsigned int n;
+	off_t off;
+	int j;
+
+	for (; nr; ppn += n, buf += n * PAGE_SIZE, nr -= n) {
+		j = map_page(ppn, &off);
+		n = (STRIPE_SIZE - off % STRIPE_SIZE) / PAGE_SIZE;
+		if (n > nr)
+			n = nr;
+
+		dev_write(j, buf, n * PAGE_SIZE, off);
+	}
+}
+
+static void dev_lengths(uint64_t *lens)
+{
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++)
+		lens[i] = fdlength(copyfd[i]);
+}
+
+// Usable length of every device, bounded by the smallest one
+static uint64_t __maybe_unused dev_size(void)
+{
+	uint64_t lens[NUM_DEVICE], min;
+	int i;
+
+	dev_lengths(lens);
+	for (i = 1, min = lens[0]; i < NUM_DEVICE; i++) {
+		if (lens[i] < min)
+			min = lens[i];
+	}
+
+	return min;
+}
+
+// Striped capacity
+static uint64_t __maybe_unused phys_size(void)
+{
+#ifdef WEIGHTED
+	uint64_t lens[NUM_DEVICE];
+
+	dev_lengths(lens);
+	return layout_size(lens);
+#else
+	return dev_size() / STRIPE_SIZE * STRIPE_SIZE * NUM_DEVICE;
+#endif
+}
+
+static uint64_t __maybe_unused read_disksize(void)
+{
+	FILE *fp;
+	unsigned long long disksize = 0;
+
+	fp = fopen(CHEEDON_DISKSIZE_PATH, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%llu", &disksize) != 1)
+		disksize = 0;
+	fclose(fp);
+
+	return disksize;
+}
+
+static struct {
+	uint64_t zero_pages;	// all-zero pages found in writes
+	uint64_t zero_saved;	// bytes never sent to the backends as data
+} stats __maybe_unused;
+
+static void print_stats(void)
+{
+#ifdef THIN
+	printf("thin: %s allocated\n", humanSize(thin_allocated()));
+#endif
+#ifdef COMPRESS
+	compress_stats();
+#endif
+#ifdef DEDUP
+	dedup_stats();
+#endif
+#ifdef LFS
+	lfs_stats();
+#endif
+#ifdef OVERLAY
+	overlay_stats();
+#endif
+#ifdef JOURNAL
+	journal_stats();
+#endif
+#if defined(ZERO_DETECT) && !defined(COMPRESS) && !defined(DEDUP) && !defined(LFS) && \
+    !defined(OVERLAY)
+	printf("zero: %lu pages detected, ", stats.zero_pages);
+	printf("%s saved\n", humanSize(stats.zero_saved));
+#endif
+#ifdef RECORD
+	record_stats();
+#endif
+#ifdef RESHAPE
+	reshape_stats();
+#endif
+#ifdef CSUM
+	csum_stats();
+#endif
+#ifdef PROFILE
+	prof_stats();
+#endif
+	fflush(stdout);
+}
+
+#ifdef ZERO_DETECT
+/*
+ * Zero pages are punched out of the backends instead of being written.
+ * Adjacent pages on the same device are merged into a single call, and a
+ * device which can't guarantee zeroes on a punched range falls back to
+ * regular writes for good.
+ */
+static bool punch_unsupported[NUM_DEVICE];
+static struct {
+	int dev;
+	off_t off;
+	size_t len;
+} zr;
+
+static void zero_range_flush(void)
+{
+	off_t off;
+
+	if (!zr.len)
+		return;
+
+	if (!punch_unsupported[zr.dev]) {
+		if (!fallocate(copyfd[zr.dev], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       zr.off, zr.len)) {
+			stats.zero_saved += zr.len;
+			zr.len = 0;
+			return;
+		}
+		if (errno == EOPNOTSUPP || errno == ENODEV) {
+			fprintf(stderr, "zero: device %d can't punch holes, writing zeroes\n",
+				zr.dev);
+			punch_unsupported[zr.dev] = true;
+		}
+	}
+
+	for (off = zr.off; off < zr.off + (off_t)zr.len; off += PAGE_SIZE)
+		dev_write(zr.dev, zero_page, PAGE_SIZE, off);
+	zr.len = 0;
+}
+
+static void zero_range_add(uint64_t lpn)
+{
+	off_t off;
+	int j = map_page(lpn, &off);
+
+	if (zr.len && zr.dev == j && zr.off + (off_t)zr.len == off) {
+		zr.len += PAGE_SIZE;
+		return;
+	}
+
+	zero_range_flush();
+	zr.dev = j;
+	zr.off = off;
+	zr.len = PAGE_SIZE;
+}
+
+#ifdef THIN
+static bool range_is_zero(const uint64_t *zmap, unsigned int i, unsigned int n)
+{
+	for (; n; i++, n--) {
+		if (!(zmap[i / 64] & (1ULL << (i % 64))))
+			return false;
+	}
+
+	return true;
+}
+#endif
+#endif
+
+#ifdef THIN
+static void write_zero_page(uint64_t lpn)
+{
+	off_t off;
+	int j = map_page(lpn, &off);
+
+	dev_write(j, zero_page, PAGE_SIZE, off);
+}
+
+/*
+ * A block allocated by a partial write must not expose stale backend data
+ * in its untouched pages
+ */
+static void thin_fill_block(uint64_t lpn, uint64_t start, uint64_t end)
+{
+	uint64_t p = lpn - lpn % THIN_PAGES_PER_BLOCK;
+	uint64_t last = p + THIN_PAGES_PER_BLOCK;
+
+	for (; p < last; p++) {
+		if (p < start || p >= end)
+			write_zero_page(p);
+	}
+}
+#endif
+
+// Pages of partially covered blocks still read back as zero afterwards
+static void discard_pages(uint64_t lpn, uint64_t nr)
+{
+#ifdef JOURNAL
+	journal_discard(lpn, nr);
+#endif
+#ifdef COMPRESS
+	compress_discard(lpn, nr);
+#endif
+#ifdef DEDUP
+	dedup_discard(lpn, nr);
+#endif
+#ifdef LFS
+	lfs_discard(lpn, nr);
+#endif
+#ifdef OVERLAY
+	overlay_discard(lpn, nr);
+#endif
+#ifdef CSUM
+	csum_discard(lpn, nr);
+#endif
+#ifdef THIN
+	uint64_t first, last, p;
+
+	first = (lpn + THIN_PAGES_PER_BLOCK - 1) / THIN_PAGES_PER_BLOCK * THIN_PAGES_PER_BLOCK;
+	last = (lpn + nr) / THIN_PAGES_PER_BLOCK * THIN_PAGES_PER_BLOCK;
+
+	for (p = lpn; p < lpn + nr; p++) {
+		if (first < last && p == first) {
+			p = last - 1;
+			continue;
+		}
+		if (thin_test(p))
+			write_zero_page(p);
+	}
+
+	thin_discard(lpn, nr);
+#endif
+}
+
+static void flush_metadata(void)
+{
+#ifdef THIN
+	thin_flush();
+#endif
+#ifdef COMPRESS
+	compress_flush();
+#endif
+#ifdef DEDUP
+	dedup_flush();
+#endif
+#ifdef LFS
+	lfs_flush();
+#endif
+#ifdef OVERLAY
+	overlay_flush();
+#endif
+#ifdef RECORD
+	record_flush();
+#endif
+#ifdef CSUM
+	csum_flush();
+#endif
+}
+
+// Everything but the journal reads and writes through these
+static void load_pages(uint64_t lpn, char *buf, unsigned int nr)
+{
+#if defined(COMPRESS)
+	compress_read(lpn, buf, nr);
+#elif defined(DEDUP)
+	dedup_read(lpn, buf, nr);
+#elif defined(LFS)
+	lfs_read(lpn, buf, nr);
+#elif defined(OVERLAY)
+	overlay_read(lpn, buf, nr);
+#elif !defined(THIN)
+	// Within one stripe unit once the module has the geometry
+	phys_read(lpn, buf, nr);
+#else
+	unsigned int i;
+	off_t off;
+	int j;
+
+	for (i = 0; i < nr; i++) {
+		if (!thin_test(lpn + i)) {
+			memcpy(buf + (i * 4096), zero_page, 4096);
+			continue;
+		}
+		j = map_page(lpn + i, &off);
+
+		dev_read(j, buf + (i * 4096), 4096, off);
+	}
+#endif
+}
+
+static void store_pages(uint64_t lpn, char *buf, unsigned int nr)
+{
+#if defined(COMPRESS)
+	compress_write(lpn, buf, nr);
+#elif defined(DEDUP)
+	dedup_write(lpn, buf, nr);
+#elif defined(LFS)
+	lfs_write(lpn, buf, nr);
+#elif defined(OVERLAY)
+	overlay_write(lpn, buf, nr);
+#elif !defined(THIN) && !defined(ZERO_DETECT)
+	phys_write(lpn, buf, nr);
+#else
+	unsigned int i;
+	off_t off;
+	int j;
+#ifdef ZERO_DETECT
+	uint64_t zmap[MAX_REQ_PAGES / 64] = { 0 };
+
+	for (i = 0; i < nr; i++) {
+		if (page_is_zero(buf + (i * 4096))) {
+			zmap[i / 64] |= 1ULL << (i % 64);
+			stats.zero_pages++;
+		}
+	}
+#endif
+
+	for (i = 0; i < nr; i++) {
+#ifdef THIN
+		if (i == 0 || (lpn + i) % THIN_PAGES_PER_BLOCK == 0) {
+			unsigned int n = THIN_PAGES_PER_BLOCK - (lpn + i) % THIN_PAGES_PER_BLOCK;
+
+			if (n > nr - i)
+				n = nr - i;
+#ifdef ZERO_DETECT
+			// Zeroes into a free block, or over a whole block
+			if (range_is_zero(zmap, i, n) && thin_tracked(lpn + i) &&
+			    (!thin_test(lpn + i) || n == THIN_PAGES_PER_BLOCK)) {
+				thin_discard(lpn + i, n);
+				stats.zero_saved += n * PAGE_SIZE;
+				i += n - 1;
+				continue;
+			}
+#endif
+			if (thin_alloc(lpn + i) && THIN_PAGES_PER_BLOCK > 1)
+				thin_fill_block(lpn + i, lpn, lpn + nr);
+		}
+#endif
+#ifdef ZERO_DETECT
+		if (zmap[i / 64] & (1ULL << (i % 64))) {
+			zero_range_add(lpn + i);
+			continue;
+		}
+#endif
+		j = map_page(lpn + i, &off);
+
+		dev_write(j, buf + (i * 4096), 4096, off);
+	}
+
+#ifdef ZERO_DETECT
+	zero_range_flush();
+#endif
+#endif
+}
+
+// What was stored so far, then the maps pointing at it, onto stable storage
+static void sync_pages(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++)
+		dev_sync(i);
+	flush_metadata();
+}
+
+// REQ_OP_FLUSH, every write acked before it has to survive a crash
+static void flush_pages(void)
+{
+#ifdef JOURNAL
+	journal_sync();
+#else
+	sync_pages();
+#endif
+}
+
+static void read_pages(uint64_t lpn, char *buf, unsigned int nr)
+{
+	load_pages(lpn, buf, nr);
+#ifdef JOURNAL
+	journal_read(lpn, buf, nr);
+#endif
+#ifdef CSUM
+	csum_verify(lpn, buf, nr);
+#endif
+}
+
+static void write_pages(uint64_t lpn, char *buf, unsigned int nr)
+{
+#ifdef CSUM
+	// Of what the kernel handed over, before any mode transforms it
+	csum_write(lpn, buf, nr);
+#endif
+#ifdef JOURNAL
+	journal_write(lpn, buf, nr);
+#else
+	store_pages(lpn, buf, nr);
+#endif
+}
+
 int main()
 {
 	int ret;
-	int chrfd, copyfd[NUM_DEVICE];
+	int chrfd;
 	ssize_t r;
 	struct cheedon_req_user req;
-	unsigned int i, j, loop;
+	unsigned int i;
+	struct sigaction sa;
+	struct timespec now;
+	uint64_t last_flush = 0;
 
-	off_t stripe_in, pos[NUM_DEVICE], moving_pos[NUM_DEVICE];
 	const char *dev_name[4];
 
+#ifndef AUTOTUNE
 	chrfd = open("/dev/cheedon_chr", O_RDWR);
 	if (chrfd < 0) {
 		perror("Failed to open /dev/cheedon_chr");
 		return 1;
 	}
+#endif
 
 	/* Device name */
 /*
@@ -161,14 +665,210 @@ int main()
 		}
 	}
 
+#ifdef AUTOTUNE
+	{
+		uint64_t lens[NUM_DEVICE];
+
+		// Measures the backends and exits, cheedon0 isn't served
+		dev_lengths(lens);
+		ret = autotune(copyfd, lens);
+		if (ret) {
+			fprintf(stderr, "Failed to autotune the layout: %d\n", ret);
+			exit(1);
+		}
+		exit(0);
+	}
+#endif
+
+#ifdef MMAP
+	{
+		uint64_t lens[NUM_DEVICE];
+
+		dev_lengths(lens);
+		ret = mmap_init(copyfd, lens);
+		if (ret) {
+			fprintf(stderr, "Failed to map the backends: %d\n", ret);
+			exit(1);
+		}
+	}
+#endif
+
+#ifdef RESHAPE
+	// Before anything touches the backends
+	ret = reshape_init(RESHAPE_PATH, read_disksize(), dev_size());
+	if (ret) {
+		fprintf(stderr, "Failed to resume the reshape: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef WEIGHTED
+	{
+		uint64_t lens[NUM_DEVICE];
+
+		dev_lengths(lens);
+		ret = layout_init(LAYOUT_PATH, copyfd, lens);
+		if (ret) {
+			fprintf(stderr, "Failed to set up the stripe layout: %d\n", ret);
+			exit(1);
+		}
+		printf("layout: %s usable\n", humanSize(layout_size(lens)));
+	}
+#endif
+
+#ifdef THIN
+	ret = thin_init(THIN_PATH, read_disksize());
+	if (ret) {
+		fprintf(stderr, "Failed to initialize thin bitmap: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef COMPRESS
+	ret = compress_init(COMPRESS_PATH, read_disksize(), phys_size());
+	if (ret) {
+		fprintf(stderr, "Failed to initialize compression map: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef DEDUP
+	ret = dedup_init(DEDUP_PATH, read_disksize(), phys_size());
+	if (ret) {
+		fprintf(stderr, "Failed to initialize dedup map: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef LFS
+	ret = lfs_init(LFS_PATH, read_disksize(), dev_size());
+	if (ret) {
+		fprintf(stderr, "Failed to initialize log: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef OVERLAY
+	ret = overlay_init(OVERLAY_PATH, OVERLAY_BASE, read_disksize(), phys_size());
+	if (ret) {
+		fprintf(stderr, "Failed to initialize overlay map: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef ZERO_DETECT
+	zero_init();
+#endif
+
+#ifdef CSUM
+	ret = csum_init(CSUM_PATH, read_disksize());
+	if (ret) {
+		fprintf(stderr, "Failed to initialize checksums: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef JOURNAL
+	// Replays into every mode above, so it comes up last
+	ret = journal_init(JOURNAL_PATH, store_pages, sync_pages);
+	if (ret) {
+		fprintf(stderr, "Failed to open the journal: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef RECORD
+	ret = record_init(RECORD_PATH);
+	if (ret) {
+		fprintf(stderr, "Failed to start the request trace: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#if !defined(COMPRESS) && !defined(DEDUP) && !defined(LFS) && !defined(OVERLAY)
+#ifdef WEIGHTED
+	ret = cheedon_geometry(chrfd, STRIPE_K, layout.period);
+#else
+	ret = cheedon_geometry(chrfd, STRIPE_K, NUM_DEVICE);
+#endif
+	if (ret)
+		perror("Failed to pass the stripe geometry");
+#endif
+
+#ifdef FASTPATH
+	if (cheedon_remap(chrfd, copyfd)) {
+		perror("Failed to hand reads and writes to the kernel");
+		exit(1);
+	}
+#endif
+
+	// No SA_RESTART, so a blocking read() on chrfd returns for a clean exit
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = stats_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+
 	tmpbuf = ptr_align(tmpbuf, PAGE_SIZE);
 
-	while (1) {
+#ifdef RESHAPE
+	ret = reshape_start();
+	if (ret) {
+		fprintf(stderr, "Failed to start the reshape: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+#ifdef PROFILE
+	// Counts this thread from here on
+	ret = prof_init();
+	if (ret) {
+		fprintf(stderr, "Failed to open the performance counters: %d\n", ret);
+		exit(1);
+	}
+#endif
+
+	while (!stop) {
+		prof_enter(PROF_OTHER);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		// The data first, a map must never point at a page still in flight
+		if (ts_to_ns(&now) - last_flush >= META_FLUSH_MS * 1000000UL) {
+			sync_pages();
+			last_flush = ts_to_ns(&now);
+		}
+
+		if (dump_stats) {
+			dump_stats = 0;
+			print_stats();
+		}
+
+		prof_enter(PROF_FETCH);
 		r = read(chrfd, &req, sizeof(struct cheedon_req_user));
-		if (r < 0)
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
 			break;
+		}
+		prof_req();
+		prof_enter(PROF_MAP);
+#ifdef RECORD
+		record_req(&req);
+#endif
+#ifdef RESHAPE
+		reshape_hold();
+#endif
 
 		if (req.op != REQ_OP_READ && req.op != REQ_OP_WRITE) {
+			if (req.op == REQ_OP_DISCARD)
+				discard_pages(req.pos, req.len / PAGE_SIZE);
+			// Writes before it went out before it was fetched
+			if (req.op == REQ_OP_FLUSH)
+				flush_pages();
+#ifdef RESHAPE
+			reshape_release();
+#endif
+			prof_enter(PROF_ACK);
 			write(chrfd, &req, sizeof(struct cheedon_req_user));
 			continue;
 		}
@@ -180,35 +880,24 @@ int main()
 				req.id, req.pos, req.len);
 */
 
-		stripe_in = POS / STRIPE_SIZE;
-
-		for (i = 0; i < NUM_DEVICE; i++) {
-			pos[i] = ((stripe_in / NUM_DEVICE + ((stripe_in % NUM_DEVICE) > i ? 1 : 0)) * STRIPE_SIZE)
-				+ (POS - stripe_in * STRIPE_SIZE) * ((stripe_in % NUM_DEVICE) == i ? 1 : 0);
-			moving_pos[i] = pos[i];
-		}
-
 		req.buf = tmpbuf;
 
-		if (req.op == REQ_OP_WRITE)
+		if (req.op == REQ_OP_WRITE) {
+			prof_enter(PROF_ACK);
 			write(chrfd, &req, sizeof(struct cheedon_req_user));
-
-		loop = req.len / 4096;
-		for (i = 0; i < loop; i++) {
-			j = ((POS + i * 4096) / STRIPE_SIZE) % NUM_DEVICE;
-
-			if (req.op == REQ_OP_READ)
-				pread(copyfd[j],
-				      tmpbuf + (i * 4096), 4096,
-				      moving_pos[j]);
-			else
-				pwrite(copyfd[j],
-				       tmpbuf + (i * 4096), 4096,
-				       moving_pos[j]);
-			moving_pos[j] += 4096;
+			prof_enter(PROF_MAP);
 		}
 
+		if (req.op == REQ_OP_READ)
+			read_pages(req.pos, tmpbuf, req.len / 4096);
+		else
+			write_pages(req.pos, tmpbuf, req.len / 4096);
+#ifdef RESHAPE
+		reshape_release();
+#endif
+
 		if (req.op == REQ_OP_READ) {
+			prof_enter(PROF_ACK);
 			write(chrfd, &req, sizeof(struct cheedon_req_user));
 /*		} else {
 			for (i = 0; i < NUM_DEVICE; i++) {
@@ -218,5 +907,42 @@ int main()
 */		}
 	}
 
+	print_stats();
+
+#ifdef RESHAPE
+	// Stops moving units before the journal destages into them
+	reshape_exit();
+#endif
+#ifdef JOURNAL
+	journal_exit();
+#endif
+#ifdef THIN
+	thin_exit();
+#endif
+#ifdef COMPRESS
+	compress_exit();
+#endif
+#ifdef DEDUP
+	dedup_exit();
+#endif
+#ifdef LFS
+	lfs_exit();
+#endif
+#ifdef OVERLAY
+	overlay_exit();
+#endif
+#ifdef RECORD
+	record_exit();
+#endif
+#ifdef CSUM
+	csum_exit();
+#endif
+#ifdef MMAP
+	mmap_exit();
+#endif
+#ifdef PROFILE
+	prof_exit();
+#endif
+
 	return 0;
 }
@@ -0,0 +1,600 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+#ifndef __CHEEDON_USER_H
+#define __CHEEDON_USER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+#define __maybe_unused  __attribute__((unused))
+
+enum req_opf {
+	/* read sectors from the device */
+	REQ_OP_READ = 0,
+	/* write sectors to the device */
+	REQ_OP_WRITE = 1,
+	/* flush the volatile write cache */
+	REQ_OP_FLUSH = 2,
+	/* discard sectors */
+	REQ_OP_DISCARD = 3,
+	/* get zone information */
+	REQ_OP_ZONE_REPORT = 4,
+	/* securely erase sectors */
+	REQ_OP_SECURE_ERASE = 5,
+	/* seset a zone write pointer */
+	REQ_OP_ZONE_RESET = 6,
+	/* write the same sector many times */
+	REQ_OP_WRITE_SAME = 7,
+	/* write the zero filled sector many times */
+	REQ_OP_WRITE_ZEROES = 9,
+
+	/* SCSI passthrough using struct scsi_request */
+	REQ_OP_SCSI_IN = 32,
+	REQ_OP_SCSI_OUT = 33,
+	/* Driver private requests */
+	REQ_OP_DRV_IN = 34,
+	REQ_OP_DRV_OUT = 35,
+
+	REQ_OP_LAST,
+};
+
+struct cheedon_req_user {
+	// Aligned to 32B
+	int id;
+	int op;
+	char *buf;
+	unsigned int pos;	// sector_t but divided by 4096
+	unsigned int len;
+	unsigned short ioprio;	// req_get_ioprio()
+	unsigned char flags;	// CHEEDON_REQ_*
+	unsigned char prio_class;	// CHEEDON_CLASS_*
+	unsigned int pad;
+};
+
+#define CHEEDON_REQ_SYNC	(1 << 0)
+#define CHEEDON_REQ_META	(1 << 1)
+#define CHEEDON_REQ_PREFLUSH	(1 << 2)
+
+// Dispatch classes of cheedon.h, served in this order
+enum {
+	CHEEDON_CLASS_URGENT,
+	CHEEDON_CLASS_NORMAL,
+	CHEEDON_CLASS_BACKGROUND,
+	CHEEDON_NR_CLASSES,
+};
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+#define PAGE_SHIFT 12
+
+// #define STRIPE_K 128
+#define STRIPE_SIZE (STRIPE_K * 1024)
+
+// blk_queue_max_hw_sectors() in blk.c
+#define MAX_REQ_SIZE (2 * 1024 * 1024)
+#define MAX_REQ_PAGES (MAX_REQ_SIZE / PAGE_SIZE)
+
+#define CHEEDON_DISKSIZE_PATH "/sys/block/cheedon0/disksize"
+
+// ioctls of /dev/cheedon_chr
+#define CHEEDON_MAX_DEVS 16
+
+struct cheedon_remap_user {
+	unsigned int stripe_k;
+	unsigned int nr;
+	int fds[CHEEDON_MAX_DEVS];
+};
+
+struct cheedon_geometry_user {
+	unsigned int stripe_k;
+	unsigned int nr;
+};
+
+#define CHEEDON_IOC_MAGIC 0xCE
+#define CHEEDON_IOC_REMAP _IOW(CHEEDON_IOC_MAGIC, 1, struct cheedon_remap_user)
+#define CHEEDON_IOC_GEOMETRY _IOW(CHEEDON_IOC_MAGIC, 2, struct cheedon_geometry_user)
+#define CHEEDON_IOC_CANCEL_FETCH _IO(CHEEDON_IOC_MAGIC, 3)
+
+// io_uring commands of uring.c, addr points to a struct cheedon_req_user
+struct cheedon_uring_cmd {
+	unsigned long long addr;
+};
+
+#define CHEEDON_URING_CMD_FETCH _IOR(CHEEDON_IOC_MAGIC, 0x20, struct cheedon_uring_cmd)
+#define CHEEDON_URING_CMD_COMMIT _IOW(CHEEDON_IOC_MAGIC, 0x21, struct cheedon_uring_cmd)
+#define CHEEDON_URING_CMD_COMMIT_AND_FETCH _IOWR(CHEEDON_IOC_MAGIC, 0x22, struct cheedon_uring_cmd)
+
+// Lets the block layer split requests on stripe units
+static inline int cheedon_geometry(int chrfd, unsigned int stripe_k, unsigned int units)
+{
+	struct cheedon_geometry_user geo = {
+		.stripe_k = stripe_k,
+		.nr = units,
+	};
+
+	return ioctl(chrfd, CHEEDON_IOC_GEOMETRY, &geo);
+}
+
+// FASTPATH, plain striping served in the kernel
+#ifdef FASTPATH
+#if defined(THIN) || defined(COMPRESS) || defined(DEDUP) || defined(LFS) || \
+    defined(OVERLAY) || defined(JOURNAL) || defined(ZERO_DETECT) || defined(WEIGHTED) || \
+    defined(MIRROR) || defined(RESHAPE) || defined(MMAP) || defined(CSUM)
+#error "FASTPATH bypasses the daemon for reads and writes, drop its features"
+#endif
+#if NUM_DEVICE > CHEEDON_MAX_DEVS
+#error "FASTPATH handles up to CHEEDON_MAX_DEVS devices"
+#endif
+// The daemon's page cache of the backends would go stale under the kernel's I/O
+#ifndef DIRECT
+#error "FASTPATH needs DIRECT"
+#endif
+
+// Reads and writes no longer reach the daemon after this
+static inline int cheedon_remap(int chrfd, const int *fds)
+{
+	struct cheedon_remap_user remap = {
+		.stripe_k = STRIPE_K,
+		.nr = NUM_DEVICE,
+	};
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++)
+		remap.fds[i] = fds[i];
+
+	return ioctl(chrfd, CHEEDON_IOC_REMAP, &remap);
+}
+#endif
+
+// layout.c
+#ifdef WEIGHTED
+#ifndef LAYOUT_PATH
+#define LAYOUT_PATH "cheedon.layout"
+#endif
+#define LAYOUT_MAX_PERIOD 64
+// Read per device by the calibration pass
+#ifndef LAYOUT_CAL_MB
+#define LAYOUT_CAL_MB 256
+#endif
+
+struct layout {
+	unsigned int period;			// stripe units per period
+	unsigned int weight[NUM_DEVICE];	// units per device and period
+	uint8_t dev[LAYOUT_MAX_PERIOD];		// device of each unit
+	uint32_t rank[LAYOUT_MAX_PERIOD];	// its index on that device
+};
+
+extern struct layout layout;
+
+// Stripe unit of a byte address -> device index, with the offset on it
+static inline int layout_map(uint64_t addr, off_t *off)
+{
+	uint64_t stripe = addr / STRIPE_SIZE;
+	uint64_t period = stripe / layout.period;
+	unsigned int k = stripe % layout.period;
+	int dev = layout.dev[k];
+
+	*off = (period * layout.weight[dev] + layout.rank[k]) * STRIPE_SIZE +
+	       addr % STRIPE_SIZE;
+
+	return dev;
+}
+
+int layout_init(const char *path, const int *fds, const uint64_t *lens);
+uint64_t layout_size(const uint64_t *lens);
+#endif
+
+// Metadata of all modes is written back at least this often, after the data
+#define META_FLUSH_MS 1000
+
+// user.c
+const char *humanSize(uint64_t bytes);
+void phys_read(uint64_t ppn, char *buf, unsigned int nr);
+void phys_write(uint64_t ppn, const char *buf, unsigned int nr);
+ssize_t dev_read(int dev, void *buf, size_t len, off_t off);
+ssize_t dev_write(int dev, const void *buf, size_t len, off_t off);
+void dev_sync(int dev);
+int dev_fd(int dev);
+
+// meta.c
+struct meta {
+	int fd;
+	char *map;
+	size_t len;
+	uint64_t *dirty;	// one bit per page of the mapping
+	size_t nr_dirty_words;
+	bool is_dirty;
+};
+
+static inline void meta_dirty(struct meta *m, size_t off)
+{
+	uint64_t page = off >> PAGE_SHIFT;
+
+	m->dirty[page / 64] |= 1ULL << (page % 64);
+	m->is_dirty = true;
+}
+
+int meta_open(struct meta *m, const char *path, size_t len, bool *fresh);
+void meta_close(struct meta *m);
+void meta_flush(struct meta *m);
+void meta_flush_all(struct meta *m);
+
+// thin.c
+#ifndef THIN_K
+#define THIN_K 64
+#endif
+#define THIN_BLOCK_SIZE (THIN_K * 1024)
+#define THIN_PAGES_PER_BLOCK (THIN_BLOCK_SIZE / PAGE_SIZE)
+#ifndef THIN_PATH
+#define THIN_PATH "cheedon.thin"
+#endif
+
+int thin_init(const char *path, uint64_t disksize);
+void thin_exit(void);
+bool thin_tracked(uint64_t lpn);
+bool thin_test(uint64_t lpn);
+bool thin_alloc(uint64_t lpn);
+void thin_discard(uint64_t lpn, uint64_t nr_pages);
+void thin_flush(void);
+uint64_t thin_allocated(void);
+
+// zero.c
+extern bool (*page_is_zero)(const void *page);
+void zero_init(void);
+
+// compress.c
+#ifndef COMPRESS_K
+#define COMPRESS_K 64
+#endif
+#define COMPRESS_CHUNK_SIZE (COMPRESS_K * 1024)
+#define COMPRESS_PAGES_PER_CHUNK (COMPRESS_CHUNK_SIZE / PAGE_SIZE)
+// Worker threads besides the daemon itself, -1 for one per extra CPU
+#ifndef COMPRESS_THREADS
+#define COMPRESS_THREADS -1
+#endif
+#ifndef COMPRESS_PATH
+#define COMPRESS_PATH "cheedon.cmap"
+#endif
+
+int compress_init(const char *path, uint64_t disksize, uint64_t physsize);
+void compress_exit(void);
+void compress_read(uint64_t lpn, char *buf, unsigned int nr);
+void compress_write(uint64_t lpn, char *buf, unsigned int nr);
+void compress_discard(uint64_t lpn, uint64_t nr);
+void compress_flush(void);
+void compress_stats(void);
+
+// dedup.c
+#ifndef DEDUP_PATH
+#define DEDUP_PATH "cheedon.dmap"
+#endif
+#ifndef DEDUP_INDEX_PATH
+#define DEDUP_INDEX_PATH "cheedon.didx"
+#endif
+// Memory of the dedup state, 8.1 bytes per 4K backend page plus 16 bytes
+// per index slot up to one per page
+#ifndef DEDUP_INDEX_MB
+#define DEDUP_INDEX_MB 1024
+#endif
+
+int dedup_init(const char *path, uint64_t disksize, uint64_t physsize);
+void dedup_exit(void);
+void dedup_read(uint64_t lpn, char *buf, unsigned int nr);
+void dedup_write(uint64_t lpn, const char *buf, unsigned int nr);
+void dedup_discard(uint64_t lpn, uint64_t nr);
+void dedup_flush(void);
+void dedup_stats(void);
+uint64_t dedup_memory(void);
+
+// lfs.c
+#ifndef LFS_SEG_K
+#define LFS_SEG_K 4096
+#endif
+// Largest single append to a segment, summary page included
+#ifndef LFS_CHUNK_K
+#define LFS_CHUNK_K 512
+#endif
+#ifndef LFS_PATH
+#define LFS_PATH "cheedon.lfs"
+#endif
+#ifndef LFS_CKPT_SEC
+#define LFS_CKPT_SEC 60
+#endif
+// Cleaning rate while requests are coming in
+#ifndef LFS_GC_MBPS
+#define LFS_GC_MBPS 16
+#endif
+#define LFS_GC_TICK_MS 10
+// No request for this long and the cleaner runs at full speed
+#define LFS_IDLE_MS 100
+
+int lfs_init(const char *path, uint64_t disksize, uint64_t devsize);
+void lfs_exit(void);
+void lfs_read(uint64_t lpn, char *buf, unsigned int nr);
+void lfs_write(uint64_t lpn, const char *buf, unsigned int nr);
+void lfs_discard(uint64_t lpn, uint64_t nr);
+void lfs_flush(void);
+void lfs_stats(void);
+
+// zoned.c
+// Zone size of regular files standing in for zoned devices
+#ifndef ZONED_EMU_K
+#define ZONED_EMU_K LFS_SEG_K
+#endif
+
+int zoned_init(uint64_t seg_size, uint64_t *zone_size, uint32_t *nr_zones);
+void zoned_exit(void);
+ssize_t zoned_write(int dev, const void *buf, size_t len, off_t off);
+void zoned_reset(int dev, off_t off);
+void zoned_finish(int dev, off_t off);
+void zoned_finish_others(int dev, off_t keep);
+int64_t zoned_wp(int dev, off_t off);
+void zoned_stats(void);
+
+// overlay.c
+#ifndef OVERLAY_K
+#define OVERLAY_K 64
+#endif
+#define OVERLAY_CLUSTER_SIZE (OVERLAY_K * 1024)
+#define OVERLAY_PAGES_PER_CLUSTER (OVERLAY_CLUSTER_SIZE / PAGE_SIZE)
+// Read-only image every volume starts as
+#ifndef OVERLAY_BASE
+#define OVERLAY_BASE "cheedon.base"
+#endif
+#ifndef OVERLAY_PATH
+#define OVERLAY_PATH "cheedon.omap"
+#endif
+
+int overlay_init(const char *path, const char *base, uint64_t disksize, uint64_t physsize);
+void overlay_exit(void);
+void overlay_read(uint64_t lpn, char *buf, unsigned int nr);
+void overlay_write(uint64_t lpn, const char *buf, unsigned int nr);
+void overlay_discard(uint64_t lpn, uint64_t nr);
+void overlay_flush(void);
+void overlay_stats(void);
+
+// journal.c
+#ifndef JOURNAL_PATH
+#define JOURNAL_PATH "cheedon.jnl"
+#endif
+// Log size, a block device smaller than this is used whole
+#ifndef JOURNAL_MB
+#define JOURNAL_MB 256
+#endif
+// Fill level at which the log is destaged to the backends
+#ifndef JOURNAL_DESTAGE_PCT
+#define JOURNAL_DESTAGE_PCT 75
+#endif
+
+int journal_init(const char *path, void (*store)(uint64_t lpn, char *buf, unsigned int nr),
+		 void (*sync)(void));
+void journal_exit(void);
+void journal_read(uint64_t lpn, char *buf, unsigned int nr);
+void journal_write(uint64_t lpn, char *buf, unsigned int nr);
+void journal_discard(uint64_t lpn, uint64_t nr);
+void journal_sync(void);
+void journal_stats(void);
+
+// sched.c, the backend scheduler of uring.c
+// Requests the daemon works on at once, 2 MiB of buffer each
+#ifndef SCHED_MAX_REQS
+#define SCHED_MAX_REQS 32
+#endif
+// Completion latency each backend is kept under
+#ifndef SCHED_TARGET_US
+#define SCHED_TARGET_US 10000
+#endif
+#define SCHED_INTERVAL_MS 100
+#define SCHED_INIT_DEPTH 8
+#ifndef SCHED_MAX_DEPTH
+#define SCHED_MAX_DEPTH 64
+#endif
+// Picks by class before one goes by arrival alone
+#define SCHED_PRIO_BURST 32
+// Largest I/O built by merging
+#ifndef SCHED_MERGE_K
+#define SCHED_MERGE_K 1024
+#endif
+// Reads of mirrored data slower than this share of recent ones get hedged
+#ifndef HEDGE_PCT
+#define HEDGE_PCT 95
+#endif
+// Never hedged earlier than this
+#ifndef HEDGE_MIN_US
+#define HEDGE_MIN_US 2000
+#endif
+
+enum {
+	SCHED_READ,
+	SCHED_WRITE,
+	SCHED_DISCARD,
+};
+
+struct io_uring;
+struct io_uring_cqe;
+
+// end_io() once per queued I/O, hold() takes one more for a hedged read
+void sched_init(struct io_uring *ring, void (*end_io)(void *owner, int err),
+		void (*hold)(void *owner));
+void sched_queue(int dev, int op, int prio, off_t off, size_t len, char *buf, void *owner);
+void sched_queue_alt(int dev, int prio, off_t off, int alt, off_t alt_off, size_t len,
+		     char *buf, void *owner);
+unsigned int sched_load(int dev);
+void sched_hedge(void);
+uint64_t sched_hedge_wait(void);
+void sched_dispatch(void);
+void sched_complete(struct io_uring_cqe *cqe);
+bool sched_idle(void);
+void sched_stats(void);
+
+// record.c, and bench/replay.c reading its traces
+#ifndef RECORD_PATH
+#define RECORD_PATH "cheedon.rec"
+#endif
+#define RECORD_MAGIC "CHEEDREC"
+#define RECORD_VERSION 1
+
+struct record_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t stripe_k;	// of the daemon which recorded it
+	uint32_t nr_dev;
+	uint32_t pad;
+	uint64_t start;		// wall clock, seconds
+};
+
+struct record_ent {
+	uint64_t ns;		// since the start of the trace
+	uint32_t pos;		// in pages
+	uint16_t pages;
+	uint8_t op;		// REQ_OP_*
+	uint8_t prio_class;
+};
+
+int record_init(const char *path);
+void record_exit(void);
+void record_req(const struct cheedon_req_user *req);
+void record_flush(void);
+void record_stats(void);
+
+// autotune.c
+// Stripe sizes tried with 1 to NUM_DEVICE devices, in KiB
+#ifndef AUTOTUNE_STRIPES
+#define AUTOTUNE_STRIPES 4, 16, 64, 256
+#endif
+// Scratch space at the end of every backend, saved and restored
+#ifndef AUTOTUNE_MB
+#define AUTOTUNE_MB 64
+#endif
+#ifndef AUTOTUNE_SEC
+#define AUTOTUNE_SEC 3
+#endif
+// Threads issuing I/O
+#ifndef AUTOTUNE_QD
+#define AUTOTUNE_QD 16
+#endif
+#ifndef AUTOTUNE_TRACE
+#define AUTOTUNE_TRACE RECORD_PATH
+#endif
+#ifndef AUTOTUNE_PATH
+#define AUTOTUNE_PATH "cheedon.tune"
+#endif
+// Copy of the scratch space while it is in use
+#ifndef AUTOTUNE_SCRATCH_PATH
+#define AUTOTUNE_SCRATCH_PATH "cheedon.scratch"
+#endif
+
+int autotune(const int *fds, const uint64_t *lens);
+
+// reshape.c
+#ifndef RESHAPE_PATH
+#define RESHAPE_PATH "cheedon.rsp"
+#endif
+// Stripe units moved at once at most
+#ifndef RESHAPE_BATCH
+#define RESHAPE_BATCH 64
+#endif
+// Copy rate while requests are coming in
+#ifndef RESHAPE_MBPS
+#define RESHAPE_MBPS 64
+#endif
+// Average request time the copy backs off above
+#ifndef RESHAPE_LAT_US
+#define RESHAPE_LAT_US 2000
+#endif
+#define RESHAPE_IDLE_MS 100
+
+struct reshape {
+	unsigned int from;	// devices striped over above the watermark
+	uint64_t wm;		// in stripe units
+};
+
+extern struct reshape reshape;
+
+#ifdef RESHAPE
+// Devices a stripe unit is striped over
+static inline unsigned int reshape_ndev(uint64_t stripe)
+{
+	return stripe < reshape.wm ? NUM_DEVICE : reshape.from;
+}
+#endif
+
+int reshape_init(const char *path, uint64_t disksize, uint64_t devsize);
+int reshape_start(void);
+void reshape_exit(void);
+void reshape_hold(void);
+void reshape_release(void);
+void reshape_stats(void);
+
+// mmap.c
+int mmap_init(const int *fds, const uint64_t *lens);
+void mmap_exit(void);
+ssize_t mmap_read(int dev, void *buf, size_t len, off_t off);
+ssize_t mmap_write(int dev, const void *buf, size_t len, off_t off);
+int mmap_sync(int dev);
+
+// csum.c
+#ifndef CSUM_PATH
+#define CSUM_PATH "cheedon.csum"
+#endif
+// Share of the pages read which get verified
+#ifndef CSUM_VERIFY_PCT
+#define CSUM_VERIFY_PCT 10
+#endif
+
+struct csum_impl {
+	const char *name;
+	uint32_t (*page)(const void *page);
+	bool (*usable)(void);
+};
+
+// Preferred first, up to a NULL name, for bench/csum_bench.c
+extern const struct csum_impl csum_impls[];
+const struct csum_impl *csum_setup(void);
+int csum_init(const char *path, uint64_t disksize);
+void csum_exit(void);
+void csum_write(uint64_t lpn, const char *buf, unsigned int nr);
+void csum_verify(uint64_t lpn, const char *buf, unsigned int nr);
+void csum_discard(uint64_t lpn, uint64_t nr);
+void csum_flush(void);
+void csum_stats(void);
+
+// prof.c, pipeline stages of both daemons
+enum {
+	PROF_FETCH,		// taking a request off the chardev
+	PROF_MAP,		// stripe math and the modes, up to backend I/O
+	PROF_BACKEND,		// handing I/O to the backends, waiting for it in user.c
+	PROF_WAIT,		// for completions, uring.c
+	PROF_COMPLETE,		// handling them, uring.c
+	PROF_ACK,		// passing the result to the chardev
+	PROF_OTHER,
+	PROF_NR_STAGES,
+};
+
+#ifdef PROFILE
+int prof_init(void);
+void prof_exit(void);
+int prof_enter(int stage);
+void prof_req(void);
+void prof_stats(void);
+#else
+// Markers stay in the hot path, for nothing
+static inline int prof_enter(int stage)
+{
+	return stage;
+}
+
+static inline void prof_req(void)
+{
+}
+#endif
+
+#endif
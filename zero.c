@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * All-zero page detection
+ *
+ * Most pages written by filesystems are not zero, so every variant bails out
+ * after the first 256 bytes that contain a set bit.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "user.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static bool page_is_zero_avx2(const void *page)
+{
+	const __m256i *p = page;
+	__m256i acc;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / 32; i += 8) {
+		acc = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_or_si256(_mm256_loadu_si256(p + i),
+						_mm256_loadu_si256(p + i + 1)),
+				_mm256_or_si256(_mm256_loadu_si256(p + i + 2),
+						_mm256_loadu_si256(p + i + 3))),
+			_mm256_or_si256(
+				_mm256_or_si256(_mm256_loadu_si256(p + i + 4),
+						_mm256_loadu_si256(p + i + 5)),
+				_mm256_or_si256(_mm256_loadu_si256(p + i + 6),
+						_mm256_loadu_si256(p + i + 7))));
+		if (!_mm256_testz_si256(acc, acc))
+			return false;
+	}
+
+	return true;
+}
+
+__attribute__((target("sse2")))
+static bool page_is_zero_sse2(const void *page)
+{
+	const __m128i *p = page;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc;
+	int i, j;
+
+	for (i = 0; i < PAGE_SIZE / 16; i += 16) {
+		acc = _mm_loadu_si128(p + i);
+		for (j = 1; j < 16; j++)
+			acc = _mm_or_si128(acc, _mm_loadu_si128(p + i + j));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+static bool page_is_zero_generic(const void *page)
+{
+	const uint64_t *p = page;
+	uint64_t acc;
+	int i, j;
+
+	for (i = 0; i < PAGE_SIZE / 8; i += 32) {
+		acc = 0;
+		for (j = 0; j < 32; j++)
+			acc |= p[i + j];
+		if (acc)
+			return false;
+	}
+
+	return true;
+}
+
+bool (*page_is_zero)(const void *page) = page_is_zero_generic;
+
+void zero_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		page_is_zero = page_is_zero_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		page_is_zero = page_is_zero_sse2;
+#endif
+}
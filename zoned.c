@@ -0,0 +1,411 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Zoned backends for the log-structured mode
+ *
+ * With -DZONED, every LFS segment is laid at the start of its own zone of
+ * a host-managed ZNS or SMR device. Segments are only ever appended to, so
+ * writes land on the write pointer. A retired segment has its zone finished
+ * so that it stops counting against the active zone limit, and a segment is
+ * reset right before it is reused. Each device keeps a single open segment,
+ * the cleaner appending to it too, which fits any open or active limit.
+ * cheedon0 itself stays a conventional device.
+ *
+ * LFS_SEG_K has to fit in the zone capacity, ideally matching it. Whatever
+ * is left of a zone past its segment goes unused.
+ *
+ * Regular files are cut into ZONED_EMU_K zones that behave the same way,
+ * for testing without zoned null_blk: a write off the write pointer fails,
+ * a reset punches the zone out and write pointers are found again from the
+ * allocated extents on startup.
+ */
+
+#ifdef ZONED
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/blkzoned.h>
+
+#include "user.h"
+
+#define REPORT_ZONES	256
+
+struct zdev {
+	bool emulated;
+	uint64_t zone_size;	// bytes
+	uint32_t nr_zones;
+	uint8_t *conv;		// conventional zones, written anywhere
+	uint64_t *wp;		// emulated write pointers, bytes into the zone
+};
+
+static struct zdev zdevs[NUM_DEVICE];
+
+static struct {
+	uint64_t resets, finishes, rejected;
+} zstats;
+
+// A zone limit from sysfs, 0 when there is none
+static unsigned int zone_limit(int fd, const char *name)
+{
+	unsigned int val = 0;
+	struct stat st;
+	char path[128];
+	FILE *fp;
+
+	if (fstat(fd, &st))
+		return 0;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+		 major(st.st_rdev), minor(st.st_rdev), name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%u", &val) != 1)
+		val = 0;
+	fclose(fp);
+
+	return val;
+}
+
+static struct blk_zone_report *report_alloc(void)
+{
+	struct blk_zone_report *rep;
+
+	rep = malloc(sizeof(*rep) + REPORT_ZONES * sizeof(struct blk_zone));
+	if (!rep)
+		fprintf(stderr, "zoned: out of memory\n");
+
+	return rep;
+}
+
+static int report(int fd, struct blk_zone_report *rep, uint64_t sector, uint32_t nr)
+{
+	memset(rep, 0, sizeof(*rep));
+	rep->sector = sector;
+	rep->nr_zones = nr;
+
+	if (ioctl(fd, BLKREPORTZONE, rep))
+		return -errno;
+
+	return rep->nr_zones ? 0 : -EIO;
+}
+
+static uint64_t zone_capacity(struct blk_zone_report *rep, struct blk_zone *z)
+{
+#ifdef BLK_ZONE_REP_CAPACITY
+	if (rep->flags & BLK_ZONE_REP_CAPACITY)
+		return z->capacity << 9;
+#endif
+	return z->len << 9;
+}
+
+static int zdev_init(int dev, uint64_t seg_size)
+{
+	struct zdev *zd = zdevs + dev;
+	struct blk_zone_report *rep;
+	struct blk_zone *z;
+	uint32_t sectors, i, n;
+	int fd = dev_fd(dev), ret;
+
+	if (ioctl(fd, BLKGETZONESZ, &sectors) || !sectors) {
+		fprintf(stderr, "zoned: device %d is not zoned\n", dev);
+		return -EINVAL;
+	}
+	if (ioctl(fd, BLKGETNRZONES, &zd->nr_zones)) {
+		perror("zoned: BLKGETNRZONES");
+		return -errno;
+	}
+	zd->zone_size = (uint64_t)sectors << 9;
+	zd->conv = calloc(zd->nr_zones, 1);
+	rep = report_alloc();
+	if (!zd->conv || !rep) {
+		free(rep);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < zd->nr_zones; i += n) {
+		ret = report(fd, rep, (uint64_t)i * sectors, REPORT_ZONES);
+		if (ret) {
+			fprintf(stderr, "zoned: failed to report zones of device %d: %d\n", dev, ret);
+			free(rep);
+			return ret;
+		}
+
+		n = rep->nr_zones;
+		for (z = rep->zones; z < rep->zones + n && i + (z - rep->zones) < zd->nr_zones; z++) {
+			if (z->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+				zd->conv[i + (z - rep->zones)] = 1;
+				continue;
+			}
+			if (zone_capacity(rep, z) < seg_size) {
+				fprintf(stderr, "zoned: zones of device %d hold %s, ",
+					dev, humanSize(zone_capacity(rep, z)));
+				fprintf(stderr, "build with a smaller LFS_SEG_K\n");
+				free(rep);
+				return -EINVAL;
+			}
+		}
+	}
+	free(rep);
+
+	printf("zoned: device %d has %u zones of %s, open/active limits %u/%u\n",
+	       dev, zd->nr_zones, humanSize(zd->zone_size),
+	       zone_limit(fd, "max_open_zones"), zone_limit(fd, "max_active_zones"));
+
+	return 0;
+}
+
+// End of the last allocated extent of a zone, where writes stopped
+static uint64_t emu_wp(int fd, off_t start, off_t end)
+{
+	off_t data = start, hole, wp = start;
+
+	while ((data = lseek(fd, data, SEEK_DATA)) >= 0 && data < end) {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+		wp = hole;
+		data = hole;
+	}
+
+	return (wp - start + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+static int emu_init(int dev, uint64_t seg_size, uint64_t len)
+{
+	struct zdev *zd = zdevs + dev;
+	int fd = dev_fd(dev);
+	uint32_t i;
+
+	zd->emulated = true;
+	zd->zone_size = ZONED_EMU_K * 1024ULL;
+	zd->nr_zones = len / zd->zone_size;
+	if (zd->zone_size < seg_size) {
+		fprintf(stderr, "zoned: ZONED_EMU_K is smaller than LFS_SEG_K\n");
+		return -EINVAL;
+	}
+
+	zd->conv = calloc(zd->nr_zones, 1);
+	zd->wp = calloc(zd->nr_zones, sizeof(uint64_t));
+	if (!zd->conv || !zd->wp)
+		return -ENOMEM;
+
+	for (i = 0; i < zd->nr_zones; i++)
+		zd->wp[i] = emu_wp(fd, (off_t)i * zd->zone_size, (off_t)(i + 1) * zd->zone_size);
+
+	printf("zoned: device %d emulates %u zones of %s\n",
+	       dev, zd->nr_zones, humanSize(zd->zone_size));
+
+	return 0;
+}
+
+int zoned_init(uint64_t seg_size, uint64_t *zone_size, uint32_t *nr_zones)
+{
+	struct stat st;
+	int i, ret;
+
+	memset(zdevs, 0, sizeof(zdevs));
+	memset(&zstats, 0, sizeof(zstats));
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		if (fstat(dev_fd(i), &st)) {
+			perror("zoned: stat");
+			return -errno;
+		}
+
+		if (S_ISREG(st.st_mode))
+			ret = emu_init(i, seg_size, st.st_size);
+		else
+			ret = zdev_init(i, seg_size);
+		if (ret)
+			return ret;
+
+		// Segments sit at the same offset on every device
+		if (zdevs[i].zone_size != zdevs[0].zone_size) {
+			fprintf(stderr, "zoned: devices 0 and %d have different zone sizes\n", i);
+			return -EINVAL;
+		}
+		if (!i || zdevs[i].nr_zones < *nr_zones)
+			*nr_zones = zdevs[i].nr_zones;
+	}
+	*zone_size = zdevs[0].zone_size;
+
+	return 0;
+}
+
+void zoned_exit(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_DEVICE; i++) {
+		free(zdevs[i].conv);
+		free(zdevs[i].wp);
+	}
+	memset(zdevs, 0, sizeof(zdevs));
+}
+
+static int zone_op(int dev, off_t off, unsigned long op)
+{
+	struct zdev *zd = zdevs + dev;
+	struct blk_zone_range range;
+	uint32_t zone = off / zd->zone_size;
+
+	if (zd->conv[zone])
+		return 0;
+
+	if (zd->emulated) {
+		if (op == BLKRESETZONE) {
+			if (zd->wp[zone] && fallocate(dev_fd(dev),
+					FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					(off_t)zone * zd->zone_size, zd->zone_size))
+				return -errno;
+			zd->wp[zone] = 0;
+		} else {
+			zd->wp[zone] = zd->zone_size;
+		}
+		return 0;
+	}
+
+	range.sector = (uint64_t)zone * zd->zone_size >> 9;
+	range.nr_sectors = zd->zone_size >> 9;
+	if (ioctl(dev_fd(dev), op, &range))
+		return -errno;
+
+	return 0;
+}
+
+// Empties the zone at off, before a segment is written into it again
+void zoned_reset(int dev, off_t off)
+{
+	int ret = zone_op(dev, off, BLKRESETZONE);
+
+	if (ret)
+		fprintf(stderr, "zoned: failed to reset a zone of device %d: %d\n", dev, ret);
+	else
+		zstats.resets++;
+}
+
+// Marks the zone at off full, releasing its open and active resources
+void zoned_finish(int dev, off_t off)
+{
+#ifdef BLKFINISHZONE
+	int ret = zone_op(dev, off, BLKFINISHZONE);
+
+	if (ret)
+		fprintf(stderr, "zoned: failed to finish a zone of device %d: %d\n", dev, ret);
+	else
+		zstats.finishes++;
+#endif
+}
+
+/*
+ * Bytes written to the zone at off, -1 for a conventional zone. Past the
+ * end of the log after a write torn by a crash.
+ */
+int64_t zoned_wp(int dev, off_t off)
+{
+	struct zdev *zd = zdevs + dev;
+	struct blk_zone_report *rep;
+	uint32_t zone = off / zd->zone_size;
+	int64_t wp;
+
+	if (zd->conv[zone])
+		return -1;
+	if (zd->emulated)
+		return zd->wp[zone];
+
+	rep = report_alloc();
+	if (!rep || report(dev_fd(dev), rep, off >> 9, 1)) {
+		free(rep);
+		return zd->zone_size;	// unknown, don't write into it
+	}
+
+	if (rep->zones[0].cond == BLK_ZONE_COND_FULL)
+		wp = zd->zone_size;
+	else
+		wp = (rep->zones[0].wp - rep->zones[0].start) << 9;
+	free(rep);
+
+	return wp;
+}
+
+/*
+ * Finishes every zone left open or closed by an earlier run but the one
+ * at keep, so they don't eat into the active zone limit
+ */
+void zoned_finish_others(int dev, off_t keep)
+{
+	struct zdev *zd = zdevs + dev;
+	struct blk_zone_report *rep;
+	struct blk_zone *z;
+	uint32_t i, n;
+
+	if (zd->emulated)
+		return;
+
+	rep = report_alloc();
+	if (!rep)
+		return;
+
+	for (i = 0; i < zd->nr_zones; i += n) {
+		if (report(dev_fd(dev), rep, (uint64_t)i * zd->zone_size >> 9, REPORT_ZONES))
+			break;
+
+		n = rep->nr_zones;
+		for (z = rep->zones; z < rep->zones + n; z++) {
+			if (z->cond != BLK_ZONE_COND_IMP_OPEN && z->cond != BLK_ZONE_COND_EXP_OPEN &&
+			    z->cond != BLK_ZONE_COND_CLOSED)
+				continue;
+			if ((off_t)(z->start << 9) / zd->zone_size == keep / zd->zone_size)
+				continue;
+			zoned_finish(dev, z->start << 9);
+		}
+	}
+	free(rep);
+}
+
+ssize_t zoned_write(int dev, const void *buf, size_t len, off_t off)
+{
+	struct zdev *zd = zdevs + dev;
+	uint32_t zone = off / zd->zone_size;
+
+	if (!zd->emulated || zd->conv[zone])
+		return dev_write(dev, buf, len, off);
+
+	// What a sequential write required zone would refuse
+	if (off - (off_t)zone * zd->zone_size != zd->wp[zone] ||
+	    zd->wp[zone] + len > zd->zone_size) {
+		fprintf(stderr, "zoned: device %d, write at %ld off the write pointer\n",
+			dev, (long)off);
+		zstats.rejected++;
+		errno = EIO;
+		return -1;
+	}
+
+	zd->wp[zone] += len;
+
+	return dev_write(dev, buf, len, off);
+}
+
+void zoned_stats(void)
+{
+	printf("zoned: %lu resets, %lu finishes", zstats.resets, zstats.finishes);
+	if (zstats.rejected)
+		printf(", %lu writes off the write pointer", zstats.rejected);
+	printf("\n");
+}
+
+#endif